@@ -0,0 +1,266 @@
+#include "thirdparty/httplib.h"
+#include "thirdparty/json.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <format>
+#include <iostream>
+#include <mutex>
+#include <numeric>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+import gitkf;
+
+using json = nlohmann::json;
+
+constexpr int kDefaultPort = 13324;
+
+struct LoadOption {
+    int port { kDefaultPort };
+    std::string repoPath { std::filesystem::current_path().string() };
+    std::string path {};
+    int clients { 50 };
+    int sessions { 5 };
+    int steps { 30 };
+    int thinkMs { 100 };
+    double toggleRate { 0.1 };
+
+    static LoadOption Parse(int argc, char* argv[])
+    {
+        LoadOption option {};
+        for (int i = 1; i < argc; ++i) {
+            auto value = [&]() -> std::string {
+                if (i + 1 >= argc) {
+                    throw std::runtime_error { std::format("Missing argument for {}.", argv[i]) };
+                }
+                return argv[++i];
+            };
+            if (!strcmp(argv[i], "--port")) {
+                option.port = std::stoi(value());
+            } else if (!strcmp(argv[i], "--repo")) {
+                option.repoPath = value();
+            } else if (!strcmp(argv[i], "--path")) {
+                option.path = value();
+            } else if (!strcmp(argv[i], "--clients")) {
+                option.clients = std::max(std::stoi(value()), 1);
+            } else if (!strcmp(argv[i], "--sessions")) {
+                option.sessions = std::max(std::stoi(value()), 1);
+            } else if (!strcmp(argv[i], "--steps")) {
+                option.steps = std::max(std::stoi(value()), 0);
+            } else if (!strcmp(argv[i], "--think-ms")) {
+                option.thinkMs = std::max(std::stoi(value()), 0);
+            } else if (!strcmp(argv[i], "--toggle-rate")) {
+                option.toggleRate = std::clamp(std::stod(value()), 0.0, 1.0);
+            } else {
+                throw std::runtime_error { std::format(
+                    "Unknown option: {}\n"
+                    "Usage: gitkf_load [--port <port>] [--repo <repo>] [--path <path>] [--clients <n>] "
+                    "[--sessions <n>] [--steps <n>] [--think-ms <ms>] [--toggle-rate <0..1>]",
+                    argv[i]) };
+            }
+        }
+        return option;
+    }
+};
+
+/// @brief Latency samples of one kind of request, in milliseconds.
+class LatencyRecorder {
+public:
+    void Add(std::chrono::steady_clock::duration duration)
+    {
+        std::unique_lock lock { m_mutex };
+        m_samples.push_back(std::chrono::duration<double, std::milli> { duration }.count());
+    }
+
+    json Report() const
+    {
+        std::unique_lock lock { m_mutex };
+        auto samples = m_samples;
+        lock.unlock();
+
+        json report {};
+        report["count"] = samples.size();
+        if (samples.empty()) {
+            return report;
+        }
+        std::ranges::sort(samples);
+        auto percentile = [&samples](double p) { return samples[(size_t)(p * (samples.size() - 1))]; };
+        report["mean"] = std::accumulate(samples.begin(), samples.end(), 0.0) / samples.size();
+        report["p50"] = percentile(0.5);
+        report["p90"] = percentile(0.9);
+        report["p99"] = percentile(0.99);
+        report["max"] = samples.back();
+        return report;
+    }
+
+private:
+    mutable std::mutex m_mutex {};
+    std::vector<double> m_samples {};
+};
+
+struct LoadStats {
+    LatencyRecorder firstEvent {};
+    LatencyRecorder fullStream {};
+    LatencyRecorder gitCommit {};
+    std::atomic<size_t> requests {};
+    std::atomic<size_t> errors {};
+    std::atomic<size_t> bytes {};
+};
+
+/// @brief Load the history the same way as the web UI does, return ids of loaded commits.
+static std::vector<std::string> LoadHistory(httplib::Client& client, const LoadOption& option, LoadStats& stats)
+{
+    std::vector<std::string> ids {};
+    LineReader reader {};
+    bool firstEvent { true };
+    httplib::Params params { { "repo", option.repoPath }, { "path", option.path } };
+    auto start = std::chrono::steady_clock::now();
+    auto res = client.Get("/api/git-log", params, httplib::Headers {}, [&](const char* data, size_t size) {
+        stats.bytes += size;
+        reader.Append(data, size);
+        while (auto pLine = reader.GetLine()) {
+            if (!pLine->starts_with("data: ")) {
+                continue;
+            }
+            if (std::exchange(firstEvent, false)) {
+                stats.firstEvent.Add(std::chrono::steady_clock::now() - start);
+            }
+            auto event = json::parse(pLine->substr(6), nullptr, /*allow_exceptions=*/false);
+            if (event.contains("commits")) {
+                for (const auto& commit : event["commits"]) {
+                    ids.push_back(commit["id"]);
+                }
+            }
+        }
+        return true;
+    });
+
+    ++stats.requests;
+    if (!res || res->status != httplib::StatusCode::OK_200 || ids.empty()) {
+        ++stats.errors;
+        return {};
+    }
+    stats.fullStream.Add(std::chrono::steady_clock::now() - start);
+    return ids;
+}
+
+static void LoadCommit(httplib::Client& client, const LoadOption& option, LoadStats& stats, const std::string& id,
+    bool ignoreWhitespace)
+{
+    httplib::Params params { { "repo", option.repoPath }, { "path", option.path } };
+    if (ignoreWhitespace) {
+        params.emplace("ignoreWhitespace", "1");
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    auto res = client.Get(std::format("/api/git-commit/{}", id), params, httplib::Headers {});
+    ++stats.requests;
+    if (!res || res->status != httplib::StatusCode::OK_200) {
+        ++stats.errors;
+        return;
+    }
+    stats.gitCommit.Add(std::chrono::steady_clock::now() - start);
+    stats.bytes += res->body.size();
+}
+
+/// @brief Replay navigation of one engineer: open the history, select a commit, then keep pressing arrow down,
+///        toggling ignore-whitespace once in a while.
+static void RunClient(const LoadOption& option, LoadStats& stats, int index)
+{
+    auto client = httplib::Client { "localhost", option.port };
+    client.set_keep_alive(true);
+    std::mt19937 random { (unsigned)index };
+    std::bernoulli_distribution toggle { option.toggleRate };
+
+    for (auto session = 0; session < option.sessions; ++session) {
+        auto ids = LoadHistory(client, option, stats);
+        if (ids.empty()) {
+            continue;
+        }
+
+        auto selected = std::uniform_int_distribution<size_t> { 0, ids.size() - 1 }(random);
+        auto ignoreWhitespace = false;
+        LoadCommit(client, option, stats, ids[selected], ignoreWhitespace);
+        for (auto step = 0; step < option.steps; ++step) {
+            std::this_thread::sleep_for(std::chrono::milliseconds { option.thinkMs });
+            if (toggle(random)) {
+                ignoreWhitespace = !ignoreWhitespace;
+            } else {
+                selected = (selected + 1) % ids.size();
+            }
+            LoadCommit(client, option, stats, ids[selected], ignoreWhitespace);
+        }
+    }
+}
+
+static size_t GetServerResidentMemory(httplib::Client& client)
+{
+    auto res = client.Get("/api/stats");
+    if (!res || res->status != httplib::StatusCode::OK_200) {
+        return 0;
+    }
+    return json::parse(res->body, nullptr, /*allow_exceptions=*/false).value("residentMemoryBytes", (size_t)0);
+}
+
+int main(int argc, char* argv[])
+{
+    try {
+        auto option = LoadOption::Parse(argc, argv);
+        auto statsClient = httplib::Client { "localhost", option.port };
+        auto startRss = GetServerResidentMemory(statsClient);
+        if (!startRss) {
+            throw std::runtime_error { std::format("No gitkf server is running on port {}.", option.port) };
+        }
+
+        // Sample server memory while the load is running.
+        std::atomic<size_t> peakRss { startRss };
+        std::jthread sampler { [&](std::stop_token stopToken) {
+            auto client = httplib::Client { "localhost", option.port };
+            while (!stopToken.stop_requested()) {
+                auto rss = GetServerResidentMemory(client);
+                for (auto peak = peakRss.load(); rss > peak && !peakRss.compare_exchange_weak(peak, rss);) {
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds { 200 });
+            }
+        } };
+
+        LoadStats stats {};
+        auto start = std::chrono::steady_clock::now();
+        {
+            std::vector<std::jthread> clients {};
+            for (auto i = 0; i < option.clients; ++i) {
+                clients.emplace_back([&option, &stats, i] { RunClient(option, stats, i); });
+            }
+        }
+        auto elapsed = std::chrono::duration<double> { std::chrono::steady_clock::now() - start }.count();
+        sampler = {};
+
+        json report {};
+        report["clients"] = option.clients;
+        report["duration_s"] = elapsed;
+        report["requests"] = stats.requests.load();
+        report["errors"] = stats.errors.load();
+        report["throughput_rps"] = stats.requests / elapsed;
+        report["throughput_bytes_per_s"] = stats.bytes / elapsed;
+        report["git_log_first_event_ms"] = stats.firstEvent.Report();
+        report["git_log_full_stream_ms"] = stats.fullStream.Report();
+        report["git_commit_ms"] = stats.gitCommit.Report();
+        report["server_rss_bytes"] = {
+            { "start", startRss },
+            { "peak", peakRss.load() },
+            { "end", GetServerResidentMemory(statsClient) },
+        };
+        std::cout << report.dump(/*indent=*/2) << std::endl;
+        return stats.errors ? 1 : 0;
+    } catch (const std::exception& ex) {
+        std::cerr << "Exception: " << ex.what() << std::endl;
+        return 1;
+    }
+}
@@ -0,0 +1,505 @@
+#include "thirdparty/httplib.h"
+#include "thirdparty/json.hpp"
+#include "thirdparty/libgit2/include/git2.h"
+#include "thirdparty/libgit2/include/git2/sys/mempack.h"
+#include "thirdparty/libgit2/include/git2/sys/odb_backend.h"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <numeric>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+import gitkf;
+
+using json = nlohmann::json;
+
+static void Check(int error, std::string_view what)
+{
+    if (error < 0) {
+        auto* pError = git_error_last();
+        throw std::runtime_error { std::format(
+            "{} failed: {}", what, pError && pError->message ? pError->message : "unknown error") };
+    }
+}
+
+/// @brief Write a synthetic repository object by object. Objects are kept in memory and flushed to the repository as
+///        packs, so even a 1M-commit history doesn't leave millions of loose objects behind. Refs are written to
+///        packed-refs, the same as a cloned repository.
+class SyntheticRepo {
+public:
+    explicit SyntheticRepo(const std::filesystem::path& path)
+        : m_path { path }
+    {
+        std::filesystem::remove_all(path);
+        Check(git_repository_init(std::out_ptr(m_pRepo), path.string().c_str(), /*is_bare=*/false), "Init repository");
+        Check(git_repository_odb(std::out_ptr(m_pOdb), m_pRepo.get()), "Open odb");
+        Check(git_mempack_new(&m_pMempack), "Create mempack");
+
+        // The odb owns the backend once it is added.
+        Check(git_odb_add_backend(m_pOdb.get(), m_pMempack, /*priority=*/999), "Add mempack backend");
+    }
+
+    git_oid WriteBlob(std::string_view content) { return Write(content, GIT_OBJECT_BLOB); }
+
+    /// @brief Write a flat tree, files must be sorted by name.
+    git_oid WriteTree(const std::vector<std::pair<std::string, git_oid>>& files)
+    {
+        std::string content {};
+        for (const auto& [name, id] : files) {
+            content += std::format("100644 {}", name);
+            content += '\0';
+            content.append((const char*)id.id, sizeof(id.id));
+        }
+        return Write(content, GIT_OBJECT_TREE);
+    }
+
+    git_oid WriteCommit(const git_oid& tree, const std::vector<git_oid>& parents, std::string_view message)
+    {
+        auto content = std::format("tree {}\n", GitHashToString(tree.id));
+        for (const auto& parent : parents) {
+            content += std::format("parent {}\n", GitHashToString(parent.id));
+        }
+
+        // Every commit is one second newer than its parents, so time order matches topological order.
+        auto signature = std::format("Bench <bench@gitkf> {} +0000", m_time++);
+        content += std::format("author {}\ncommitter {}\n\n{}\n", signature, signature, message);
+        return Write(content, GIT_OBJECT_COMMIT);
+    }
+
+    git_oid WriteTag(const git_oid& commit, std::string_view name)
+    {
+        auto content = std::format("object {}\ntype commit\ntag {}\ntagger Bench <bench@gitkf> {} +0000\n\n{}\n",
+            GitHashToString(commit.id), name, m_time, name);
+        return Write(content, GIT_OBJECT_TAG);
+    }
+
+    /// @brief Set ref, pPeeled is the commit an annotated tag points to.
+    void SetRef(const std::string& name, const git_oid& id, const git_oid* pPeeled = nullptr)
+    {
+        auto line = std::format("{} {}\n", GitHashToString(id.id), name);
+        if (pPeeled) {
+            line += std::format("^{}\n", GitHashToString(pPeeled->id));
+        }
+        m_refs[name] = std::move(line);
+    }
+
+    /// @brief Flush pending objects, write packed-refs and point HEAD to headRef.
+    void Finish(const std::string& headRef)
+    {
+        Flush();
+
+        auto gitDir = m_path / ".git";
+        std::ofstream packedRefs { gitDir / "packed-refs", std::ios::binary };
+        packedRefs << "# pack-refs with: peeled fully-peeled sorted \n";
+        for (const auto& [name, line] : m_refs) {
+            packedRefs << line;
+        }
+        std::ofstream { gitDir / "HEAD", std::ios::binary } << std::format("ref: {}\n", headRef);
+    }
+
+private:
+    static constexpr size_t kMaxPendingObjects = 300'000;
+
+    git_oid Write(std::string_view content, git_object_t type)
+    {
+        git_oid id {};
+        Check(git_odb_write(&id, m_pOdb.get(), content.data(), content.size(), type), "Write object");
+        if (++m_pendingObjects == kMaxPendingObjects) {
+            Flush();
+        }
+        return id;
+    }
+
+    void Flush()
+    {
+        if (!m_pendingObjects) {
+            return;
+        }
+
+        git_buf pack {};
+        std::unique_ptr<git_buf> pPack { &pack };
+        Check(git_mempack_dump(&pack, m_pRepo.get(), m_pMempack), "Dump mempack");
+
+        git_odb_writepack* pWritepack {};
+        Check(git_odb_write_pack(&pWritepack, m_pOdb.get(), nullptr, nullptr), "Write pack");
+        git_indexer_progress stats {};
+        auto error = pWritepack->append(pWritepack, pack.ptr, pack.size, &stats);
+        if (!error) {
+            error = pWritepack->commit(pWritepack, &stats);
+        }
+        pWritepack->free(pWritepack);
+        Check(error, "Index pack");
+
+        Check(git_mempack_reset(m_pMempack), "Reset mempack");
+        m_pendingObjects = 0;
+    }
+
+    std::filesystem::path m_path {};
+    std::unique_ptr<git_repository> m_pRepo {};
+    std::unique_ptr<git_odb> m_pOdb {};
+    git_odb_backend* m_pMempack {};
+    size_t m_pendingObjects {};
+    int64_t m_time { 1'500'000'000 };
+    std::map<std::string, std::string> m_refs {};
+};
+
+/// @brief Append count commits to parent (or start a new history if parent is zero), each one changes counter.txt.
+static git_oid WriteLinearCommits(SyntheticRepo& repo, git_oid parent, size_t count, std::string_view prefix)
+{
+    for (auto i = 0u; i < count; ++i) {
+        auto message = std::format("{} {}", prefix, i);
+        auto tree = repo.WriteTree({ { "counter.txt", repo.WriteBlob(message) } });
+        parent = repo.WriteCommit(
+            tree, git_oid_is_zero(&parent) ? std::vector<git_oid> {} : std::vector<git_oid> { parent }, message);
+    }
+    return parent;
+}
+
+static void GenerateLinear(SyntheticRepo& repo, size_t size)
+{
+    repo.SetRef("refs/heads/main", WriteLinearCommits(repo, {}, size, "linear"));
+}
+
+/// @brief Rounds of 8 short topic branches merged back by a single octopus merge, followed by a few trunk commits.
+static void GenerateOctopus(SyntheticRepo& repo, size_t size)
+{
+    constexpr size_t kBranches = 8;
+    constexpr size_t kBranchLength = 5;
+    constexpr size_t kTrunkLength = 10;
+
+    auto trunk = WriteLinearCommits(repo, {}, kTrunkLength, "trunk");
+    for (size_t round = 0, count = 0; count < size; ++round) {
+        std::vector<git_oid> parents { trunk };
+        for (auto i = 0u; i < kBranches; ++i) {
+            parents.push_back(WriteLinearCommits(repo, trunk, kBranchLength, std::format("topic {}.{}", round, i)));
+        }
+        auto message = std::format("octopus {}", round);
+        trunk = repo.WriteCommit(repo.WriteTree({ { "counter.txt", repo.WriteBlob(message) } }), parents, message);
+        trunk = WriteLinearCommits(repo, trunk, kTrunkLength, std::format("trunk {}", round));
+        count += kBranches * kBranchLength + 1 + kTrunkLength;
+    }
+    repo.SetRef("refs/heads/main", trunk);
+}
+
+/// @brief A trunk of size commits with size / 2 short branches forking from all over it.
+static void GenerateManyBranches(SyntheticRepo& repo, size_t size)
+{
+    std::vector<git_oid> trunk {};
+    trunk.reserve(size);
+    git_oid tip {};
+    for (auto i = 0u; i < size; ++i) {
+        tip = WriteLinearCommits(repo, tip, 1, std::format("trunk {}", i));
+        trunk.push_back(tip);
+    }
+    repo.SetRef("refs/heads/main", tip);
+
+    for (auto i = 0u; i < size / 2; ++i) {
+        auto base = trunk[(i * 7919ull) % trunk.size()];
+        auto branch = WriteLinearCommits(repo, base, 3, std::format("feature {}", i));
+        repo.SetRef(std::format("refs/heads/feature/{}", i), branch);
+        repo.SetRef(std::format("refs/remotes/origin/feature/{}", i), i % 4 ? branch : base);
+    }
+}
+
+/// @brief A commit which rewrites every other line of size files.
+static void GenerateHugeDiff(SyntheticRepo& repo, size_t size)
+{
+    constexpr size_t kLines = 200;
+
+    auto writeTree = [&](std::string_view version) {
+        std::vector<std::pair<std::string, git_oid>> files {};
+        for (auto i = 0u; i < size; ++i) {
+            std::string content {};
+            for (auto j = 0u; j < kLines; ++j) {
+                content += std::format("file {} line {} {}\n", i, j, j % 2 ? version : "");
+            }
+            files.emplace_back(std::format("file-{:08}.txt", i), repo.WriteBlob(content));
+        }
+        return repo.WriteTree(files);
+    };
+
+    auto base = repo.WriteCommit(writeTree("base"), {}, "base");
+    auto huge = repo.WriteCommit(writeTree("changed"), { base }, "huge diff");
+    repo.SetRef("refs/heads/main", huge);
+    repo.SetRef("refs/tags/huge-diff", huge);
+}
+
+/// @brief A linear history of size / 5 commits with size tags, every other one is annotated.
+static void GenerateTags(SyntheticRepo& repo, size_t size)
+{
+    std::vector<git_oid> commits {};
+    git_oid tip {};
+    for (auto i = 0u; i < std::max<size_t>(size / 5, 1); ++i) {
+        tip = WriteLinearCommits(repo, tip, 1, std::format("commit {}", i));
+        commits.push_back(tip);
+    }
+    repo.SetRef("refs/heads/main", tip);
+
+    for (auto i = 0u; i < size; ++i) {
+        auto name = std::format("v{}.{}.{}", i / 10000, i / 100 % 100, i % 100);
+        const auto& commit = commits[i % commits.size()];
+        if (i % 2) {
+            repo.SetRef("refs/tags/" + name, repo.WriteTag(commit, name), &commit);
+        } else {
+            repo.SetRef("refs/tags/" + name, commit);
+        }
+    }
+}
+
+struct RepoSpec {
+    const char* name {};
+    size_t size {};
+    void (*generate)(SyntheticRepo&, size_t) {};
+    bool patchBenchmarks {};
+};
+
+constexpr RepoSpec kRepoSpecs[] = {
+    { "linear", 100'000, GenerateLinear },
+    { "octopus", 20'000, GenerateOctopus },
+    { "many-branches", 10'000, GenerateManyBranches },
+    { "1m-commits", 1'000'000, GenerateLinear },
+    { "huge-diff", 2'000, GenerateHugeDiff, /*patchBenchmarks=*/true },
+    { "50k-tags", 50'000, GenerateTags },
+};
+
+struct BenchOption {
+    std::filesystem::path outDir { std::filesystem::temp_directory_path() / "gitkf-bench" };
+    double scale { 1.0 };
+    int iterations { 5 };
+    std::string filter {};
+
+    static BenchOption Parse(int argc, char* argv[])
+    {
+        BenchOption option {};
+        for (int i = 1; i < argc; ++i) {
+            auto value = [&]() -> std::string {
+                if (i + 1 >= argc) {
+                    throw std::runtime_error { std::format("Missing argument for {}.", argv[i]) };
+                }
+                return argv[++i];
+            };
+            if (!strcmp(argv[i], "--out")) {
+                option.outDir = value();
+            } else if (!strcmp(argv[i], "--scale")) {
+                option.scale = std::stod(value());
+            } else if (!strcmp(argv[i], "--iterations")) {
+                option.iterations = std::max(std::stoi(value()), 1);
+            } else if (!strcmp(argv[i], "--filter")) {
+                option.filter = value();
+            } else {
+                throw std::runtime_error { std::format("Unknown option: {}\n"
+                                                       "Usage: gitkf_bench [--out <dir>] [--scale <factor>] "
+                                                       "[--iterations <n>] [--filter <benchmark/repo substring>]",
+                    argv[i]) };
+            }
+        }
+        return option;
+    }
+
+    bool Matches(std::string_view benchmark, std::string_view repo) const
+    {
+        return filter.empty() || std::format("{}/{}", benchmark, repo).find(filter) != std::string::npos;
+    }
+};
+
+/// @brief Get the repository, it is generated only once for the same size and reused by later runs.
+static std::filesystem::path EnsureRepo(const BenchOption& option, const RepoSpec& spec, size_t size)
+{
+    auto path = option.outDir / spec.name;
+    auto markerPath = path / ".git" / "gitkf-bench";
+    auto marker = std::format("{} {}", spec.name, size);
+    std::string existing {};
+    if (std::ifstream in { markerPath }; std::getline(in, existing) && existing == marker) {
+        return path;
+    }
+
+    std::cerr << std::format("Generating {} ({})...", spec.name, size) << std::endl;
+    auto start = std::chrono::steady_clock::now();
+    {
+        SyntheticRepo repo { path };
+        spec.generate(repo, size);
+        repo.Finish("refs/heads/main");
+    }
+    std::ofstream { markerPath } << marker;
+    std::cerr << std::format("Generated {} in {:.1f}s.", spec.name,
+        std::chrono::duration<double> { std::chrono::steady_clock::now() - start }.count())
+              << std::endl;
+    return path;
+}
+
+/// @brief Run benchmark and print the result as a json line. run returns the size of what it produced (bytes, refs or
+///        lines), it is reported as well so that a result can be checked against the work done.
+static void RunBenchmark(
+    const BenchOption& option, std::string_view benchmark, std::string_view repo, const std::function<size_t()>& run)
+{
+    if (!option.Matches(benchmark, repo)) {
+        return;
+    }
+
+    // Warm up, shared repositories, ref snapshots and OS file cache are all hot after it.
+    auto output = run();
+
+    std::vector<double> samples {};
+    for (auto i = 0; i < option.iterations; ++i) {
+        auto start = std::chrono::steady_clock::now();
+        output = run();
+        samples.push_back(
+            std::chrono::duration<double, std::milli> { std::chrono::steady_clock::now() - start }.count());
+    }
+    std::ranges::sort(samples);
+
+    json result {};
+    result["benchmark"] = std::string { benchmark };
+    result["repo"] = std::string { repo };
+    result["iterations"] = samples.size();
+    result["min_ms"] = samples.front();
+    result["median_ms"] = samples[samples.size() / 2];
+    result["mean_ms"] = std::accumulate(samples.begin(), samples.end(), 0.0) / samples.size();
+    result["max_ms"] = samples.back();
+    result["output"] = output;
+    std::cout << result.dump() << std::endl;
+}
+
+static std::string GetHeadId(git_repository* pRepo)
+{
+    git_oid head {};
+    Check(git_reference_name_to_id(&head, pRepo, "HEAD"), "Resolve HEAD");
+    return GitHashToString(head.id);
+}
+
+/// @brief Get the patch of HEAD, in the same format as "git show".
+static std::string GetHeadPatch(git_repository* pRepo)
+{
+    git_oid head {};
+    std::unique_ptr<git_commit> pCommit {};
+    std::unique_ptr<git_commit> pParent {};
+    std::unique_ptr<git_tree> pTree {};
+    std::unique_ptr<git_tree> pParentTree {};
+    std::unique_ptr<git_diff> pDiff {};
+    Check(git_reference_name_to_id(&head, pRepo, "HEAD"), "Resolve HEAD");
+    Check(git_commit_lookup(std::out_ptr(pCommit), pRepo, &head), "Lookup HEAD");
+    Check(git_commit_parent(std::out_ptr(pParent), pCommit.get(), 0), "Lookup parent");
+    Check(git_commit_tree(std::out_ptr(pTree), pCommit.get()), "Lookup tree");
+    Check(git_commit_tree(std::out_ptr(pParentTree), pParent.get()), "Lookup parent tree");
+    Check(git_diff_tree_to_tree(std::out_ptr(pDiff), pRepo, pParentTree.get(), pTree.get(), nullptr), "Diff");
+
+    git_buf buf {};
+    std::unique_ptr<git_buf> pBuf { &buf };
+    Check(git_diff_to_buf(&buf, pDiff.get(), GIT_DIFF_FORMAT_PATCH), "Format patch");
+    return { buf.ptr, buf.size };
+}
+
+static void RunRepoBenchmarks(const BenchOption& option, const RepoSpec& spec)
+{
+    constexpr std::string_view kBenchmarks[] = { "git_log", "git_commit", "ref_snapshot", "parse_patch", "json_dump" };
+    if (std::ranges::none_of(kBenchmarks, [&](auto benchmark) { return option.Matches(benchmark, spec.name); })) {
+        return;
+    }
+
+    auto size = std::max<size_t>((size_t)(spec.size * option.scale), 1);
+    auto path = EnsureRepo(option, spec, size);
+    auto repoPath = path.string();
+
+    std::unique_ptr<git_repository> pRepo {};
+    Check(git_repository_open(std::out_ptr(pRepo), repoPath.c_str()), "Open repository");
+    auto head = GetHeadId(pRepo.get());
+
+    // The first page of history, including layout and serialization, the same as what the web UI requests.
+    RunBenchmark(option, "git_log", spec.name, [&] {
+        size_t bytes {};
+        httplib::DataSink sink {};
+        sink.write = [&bytes](const char*, size_t size) {
+            bytes += size;
+            return true;
+        };
+        sink.is_writable = [] { return true; };
+        CancellationToken token {};
+        get_git_log(sink, token, repoPath, repoPath, /*noMerges=*/false, /*commitId=*/"", /*authors=*/{},
+            /*live=*/false);
+        return bytes;
+    });
+
+    RunBenchmark(option, "git_commit", spec.name, [&] {
+        CancellationToken token {};
+        return get_git_commit(token, repoPath, /*follow=*/"", head, /*ignoreWhitespace=*/false).size();
+    });
+
+    // Build the snapshot directly, GitRepository::GetRefSnapshot() would just return the cached one.
+    RunBenchmark(option, "ref_snapshot", spec.name, [&] {
+        auto pSnapshot = BuildGitRefSnapshot(pRepo.get(), GetRefStoreSignature(git_repository_commondir(pRepo.get())));
+        return pSnapshot->refs.size();
+    });
+
+    if (!spec.patchBenchmarks
+        || (!option.Matches("parse_patch", spec.name) && !option.Matches("json_dump", spec.name))) {
+        return;
+    }
+
+    auto patch = GetHeadPatch(pRepo.get());
+    RunBenchmark(option, "parse_patch", spec.name, [&] { return parse_patch(patch).size(); });
+
+    auto parsed = parse_patch(patch);
+    RunBenchmark(option, "json_dump", spec.name, [&] {
+        return parsed
+            .dump(/*indent=*/-1, /*indent_char=*/' ', /*ensure_ascii=*/false,
+                /*error_handler=*/json::error_handler_t::replace)
+            .size();
+    });
+}
+
+/// @brief Feed "git log --pretty=format:%H" like output to LineReader in pipe sized chunks, the same as get_git_log.
+static void RunLineReaderBenchmark(const BenchOption& option)
+{
+    constexpr size_t kChunkSize = 4096;
+    if (!option.Matches("line_reader", "synthetic")) {
+        return;
+    }
+
+    auto lines = std::max<size_t>((size_t)(1'000'000 * option.scale), 1);
+    std::string output {};
+    output.reserve(lines * 41);
+    for (auto i = 0u; i < lines; ++i) {
+        output += std::format("{:040x}\n", i * 2654435761ull);
+    }
+
+    RunBenchmark(option, "line_reader", "synthetic", [&] {
+        size_t count {};
+        LineReader reader {};
+        for (size_t pos = 0; pos < output.size(); pos += kChunkSize) {
+            reader.Append(output.data() + pos, std::min(kChunkSize, output.size() - pos));
+            while (reader.GetLine()) {
+                ++count;
+            }
+        }
+        return count;
+    });
+}
+
+int main(int argc, char* argv[])
+{
+    try {
+        auto option = BenchOption::Parse(argc, argv);
+        std::filesystem::create_directories(option.outDir);
+
+        git_libgit2_init();
+        RunLineReaderBenchmark(option);
+        for (const auto& spec : kRepoSpecs) {
+            RunRepoBenchmarks(option, spec);
+        }
+        git_libgit2_shutdown();
+        return 0;
+    } catch (const std::exception& ex) {
+        std::cerr << "Exception: " << ex.what() << std::endl;
+        return 1;
+    }
+}
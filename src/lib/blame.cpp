@@ -0,0 +1,411 @@
+module;
+
+#include <algorithm>
+#include <charconv>
+#include <cstdint>
+#include <format>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thirdparty/libgit2/include/git2.h>
+#include <unordered_map>
+#include <vector>
+
+export module gitkf:blame;
+import :cancellation;
+import :diff_cache;
+import :git_repository;
+import :git_smart_pointer;
+import :line_reader;
+import :platform_utils;
+
+/// @brief Commit which lines are attributed to.
+export struct BlameCommit {
+    std::string id {};
+    std::string author {};
+    int64_t time {};
+    std::string summary {};
+};
+
+/// @brief Lines [line, line + count) of a file (1-based) come from lines [origLine, origLine + count) of the file in
+///        commits[commit] of the blame.
+export struct BlameRange {
+    size_t line {};
+    size_t count {};
+    size_t commit {};
+    size_t origLine {};
+};
+
+/// @brief Blame of a file at a commit, lines[i] is the attribution of line i + 1. Lines with origLine 0 are not
+///        attributed yet.
+export struct Blame {
+    struct Line {
+        uint32_t commit {};
+        uint32_t origLine {};
+    };
+
+    std::vector<BlameCommit> commits {};
+    std::vector<Line> lines {};
+
+    size_t AddCommit(BlameCommit commit)
+    {
+        auto [it, added] = m_commitIndexes.emplace(commit.id, commits.size());
+        if (added) {
+            commits.push_back(std::move(commit));
+        }
+        return it->second;
+    }
+
+    /// @brief Ranges of attributed lines, adjacent lines from adjacent lines of a commit make one range.
+    std::vector<BlameRange> GetRanges() const
+    {
+        std::vector<BlameRange> ranges {};
+        for (size_t i = 0; i < lines.size(); ++i) {
+            auto [commit, origLine] = lines[i];
+            if (!origLine) {
+                continue;
+            }
+            if (!ranges.empty()) {
+                auto& last = ranges.back();
+                if (last.line + last.count == i + 1 && last.commit == commit
+                    && last.origLine + last.count == origLine) {
+                    ++last.count;
+                    continue;
+                }
+            }
+            ranges.push_back({ i + 1, 1, commit, origLine });
+        }
+        return ranges;
+    }
+
+    bool IsComplete() const
+    {
+        return std::ranges::all_of(lines, [](const Line& line) { return line.origLine != 0; });
+    }
+
+private:
+    std::unordered_map<std::string, size_t> m_commitIndexes {};
+};
+
+/// @brief Find the blob of path (relative to the work directory) in the tree of a commit.
+export std::optional<git_oid> FindBlob(git_commit* pCommit, const std::string& path)
+{
+    std::unique_ptr<git_tree> pTree {};
+    std::unique_ptr<git_tree_entry> pEntry {};
+    if (git_commit_tree(std::out_ptr(pTree), pCommit)) {
+        return std::nullopt;
+    }
+    if (git_tree_entry_bypath(std::out_ptr(pEntry), pTree.get(), path.c_str())) {
+        return std::nullopt;
+    }
+    if (git_tree_entry_type(pEntry.get()) != GIT_OBJECT_BLOB) {
+        return std::nullopt;
+    }
+    return *git_tree_entry_id(pEntry.get());
+}
+
+static size_t CountLines(std::string_view text)
+{
+    return std::ranges::count(text, '\n') + (!text.empty() && !text.ends_with('\n'));
+}
+
+/// @brief Pairs of (old line, new line) which are unchanged from blob oldId to blob newId (1-based). Diffs are not
+///        symmetric, so this is always diffed from the parent to the child, the way "git blame" does.
+static std::vector<std::pair<uint32_t, uint32_t>> FindUnchangedLines(
+    git_repository* pRepo, const git_oid& oldId, const git_oid& newId, size_t newLineCount)
+{
+    std::unique_ptr<git_blob> pOld {};
+    std::unique_ptr<git_blob> pNew {};
+    if (git_blob_lookup(std::out_ptr(pOld), pRepo, &oldId)) {
+        return {};
+    }
+    if (git_blob_lookup(std::out_ptr(pNew), pRepo, &newId)) {
+        return {};
+    }
+
+    // Without context, hunks are the changed lines exactly. An empty side of a hunk starts after its line.
+    std::vector<git_diff_hunk> hunks {};
+    git_diff_options options = GIT_DIFF_OPTIONS_INIT;
+    options.context_lines = 0;
+    options.flags |= GIT_DIFF_FORCE_TEXT;
+    git_diff_blobs(
+        pOld.get(), nullptr, pNew.get(), nullptr, &options, nullptr, nullptr,
+        [](const git_diff_delta*, const git_diff_hunk* pHunk, void* pPayload) {
+            ((std::vector<git_diff_hunk>*)pPayload)->push_back(*pHunk);
+            return 0;
+        },
+        nullptr, &hunks);
+
+    std::vector<std::pair<uint32_t, uint32_t>> lines {};
+    uint32_t oldLine = 1;
+    uint32_t newLine = 1;
+    auto addUnchanged = [&](size_t newEnd) {
+        for (; newLine < newEnd && newLine <= newLineCount; ++oldLine, ++newLine) {
+            lines.emplace_back(oldLine, newLine);
+        }
+    };
+    for (const auto& hunk : hunks) {
+        addUnchanged(hunk.new_lines ? hunk.new_start : hunk.new_start + 1);
+        oldLine = (hunk.old_lines ? hunk.old_start : hunk.old_start + 1) + hunk.old_lines;
+        newLine += hunk.new_lines;
+    }
+    addUnchanged(newLineCount + 1);
+    return lines;
+}
+
+static size_t CountBlobLines(git_repository* pRepo, const git_oid& blobId)
+{
+    std::unique_ptr<git_blob> pBlob {};
+    if (git_blob_lookup(std::out_ptr(pBlob), pRepo, &blobId)) {
+        return 0;
+    }
+    return CountLines({ (const char*)git_blob_rawcontent(pBlob.get()), (size_t)git_blob_rawsize(pBlob.get()) });
+}
+
+static std::string GetBlameCacheKey(const git_oid& commitId, const std::string& path)
+{
+    return std::format("blame\n{}\n{}", GitHashToString(commitId.id), path);
+}
+
+/// @brief Cached blames are lines of "<id>\t<time>\t<author>\t<summary>" for the commits, a line of the number of
+///        lines, then lines of "<line> <count> <commit> <origLine>" for the ranges.
+static std::string SerializeBlame(const Blame& blame)
+{
+    auto clean = [](std::string text) {
+        std::ranges::replace_if(text, [](char ch) { return ch == '\t' || ch == '\n'; }, ' ');
+        return text;
+    };
+    auto out = std::format("{}\n", blame.commits.size());
+    for (const auto& commit : blame.commits) {
+        out += std::format("{}\t{}\t{}\t{}\n", commit.id, commit.time, clean(commit.author), clean(commit.summary));
+    }
+    out += std::format("{}\n", blame.lines.size());
+    for (const auto& range : blame.GetRanges()) {
+        out += std::format("{} {} {} {}\n", range.line, range.count, range.commit, range.origLine);
+    }
+    return out;
+}
+
+static std::optional<Blame> ParseBlame(std::string_view text)
+{
+    auto takeLine = [&text] {
+        auto line = text.substr(0, text.find('\n'));
+        text.remove_prefix(std::min(text.size(), line.size() + 1));
+        return line;
+    };
+    auto takeNumber = [](std::string_view& line) {
+        size_t value {};
+        auto [pEnd, ec] = std::from_chars(line.data(), line.data() + line.size(), value);
+        line.remove_prefix(std::min(line.size(), (size_t)(pEnd - line.data()) + 1));
+        return value;
+    };
+
+    Blame blame {};
+    auto header = takeLine();
+    for (auto i = takeNumber(header); i > 0; --i) {
+        auto line = takeLine();
+        BlameCommit commit {};
+        commit.id = line.substr(0, line.find('\t'));
+        line.remove_prefix(std::min(line.size(), commit.id.size() + 1));
+        commit.time = (int64_t)takeNumber(line);
+        commit.author = line.substr(0, line.find('\t'));
+        line.remove_prefix(std::min(line.size(), commit.author.size() + 1));
+        commit.summary = line;
+        blame.AddCommit(std::move(commit));
+    }
+    auto lineCount = takeLine();
+    blame.lines.resize(takeNumber(lineCount));
+    while (!text.empty()) {
+        auto line = takeLine();
+        auto first = takeNumber(line);
+        auto count = takeNumber(line);
+        auto commit = takeNumber(line);
+        auto origLine = takeNumber(line);
+        if (!first || first + count - 1 > blame.lines.size() || commit >= blame.commits.size()) {
+            return std::nullopt;
+        }
+        for (size_t i = 0; i < count; ++i) {
+            blame.lines[first - 1 + i] = { (uint32_t)commit, (uint32_t)(origLine + i) };
+        }
+    }
+    return blame;
+}
+
+static std::shared_ptr<const Blame> GetCachedBlame(const git_oid& commitId, const std::string& path)
+{
+    auto pText = GetDiffCache().Get(GetBlameCacheKey(commitId, path));
+    auto blame = pText ? ParseBlame(*pText) : std::nullopt;
+    return blame ? std::make_shared<const Blame>(std::move(*blame)) : nullptr;
+}
+
+static void PutCachedBlame(const git_oid& commitId, const std::string& path, const Blame& blame)
+{
+    GetDiffCache().Put(GetBlameCacheKey(commitId, path), std::make_shared<const std::string>(SerializeBlame(blame)));
+}
+
+/// @brief Attribute lines of blame from the cached blame of a neighbour commit. Lines a commit doesn't change come
+///        from its first parent, so the blame at a child of a cached parent is complete without running git, and the
+///        blame at the parent of a cached child only misses the lines the child deleted or changed.
+static void ReuseNeighbourBlame(git_repository* pRepo, git_commit* pCommit, const git_oid& blobId,
+    const std::string& path, const git_oid* pNearId, Blame& blame)
+{
+    auto reuse = [&blame](const Blame& neighbour, uint32_t neighbourLine, uint32_t line) {
+        if (neighbourLine <= neighbour.lines.size() && line <= blame.lines.size()) {
+            auto [commit, origLine] = neighbour.lines[neighbourLine - 1];
+            blame.lines[line - 1] = { (uint32_t)blame.AddCommit(neighbour.commits[commit]), origLine };
+        }
+    };
+
+    // The first parent, for a merge only if every line is unchanged from it.
+    std::unique_ptr<git_commit> pParent {};
+    if (!git_commit_parent(std::out_ptr(pParent), pCommit, 0)) {
+        auto parentBlobId = FindBlob(pParent.get(), path);
+        if (auto pParentBlame = parentBlobId ? GetCachedBlame(*git_commit_id(pParent.get()), path) : nullptr) {
+            auto lines = FindUnchangedLines(pRepo, *parentBlobId, blobId, blame.lines.size());
+            if (git_commit_parentcount(pCommit) == 1 || lines.size() == blame.lines.size()) {
+                for (auto [parentLine, line] : lines) {
+                    reuse(*pParentBlame, parentLine, line);
+                }
+
+                // The rest are changed by the commit.
+                auto* pAuthor = git_commit_author(pCommit);
+                auto* pSummary = git_commit_summary(pCommit);
+                auto commit = blame.AddCommit({
+                    .id = GitHashToString(git_commit_id(pCommit)->id),
+                    .author = pAuthor ? pAuthor->name : "",
+                    .time = pAuthor ? pAuthor->when.time : 0,
+                    .summary = pSummary ? pSummary : "",
+                });
+                for (uint32_t i = 0; i < blame.lines.size(); ++i) {
+                    if (!blame.lines[i].origLine) {
+                        blame.lines[i] = { (uint32_t)commit, i + 1 };
+                    }
+                }
+                return;
+            }
+        }
+    }
+
+    // A child the client has just blamed, e.g. when it walks down the history.
+    std::unique_ptr<git_commit> pChild {};
+    if (!pNearId || git_commit_lookup(std::out_ptr(pChild), pRepo, pNearId)) {
+        return;
+    }
+    std::unique_ptr<git_commit> pChildParent {};
+    if (git_commit_parentcount(pChild.get()) != 1 || git_commit_parent(std::out_ptr(pChildParent), pChild.get(), 0)) {
+        return;
+    }
+    if (!git_oid_equal(git_commit_id(pChildParent.get()), git_commit_id(pCommit))) {
+        return;
+    }
+    auto childBlobId = FindBlob(pChild.get(), path);
+    auto pChildBlame = childBlobId ? GetCachedBlame(*pNearId, path) : nullptr;
+    if (pChildBlame) {
+        for (auto [line, childLine] :
+            FindUnchangedLines(pRepo, blobId, *childBlobId, CountBlobLines(pRepo, *childBlobId))) {
+            reuse(*pChildBlame, childLine, line);
+        }
+    }
+}
+
+/// @brief Blame path (relative to the work directory) at a commit, its content is blobId. Attributed lines are reported
+///        through onRanges as soon as they are known: lines reused from the cached blame of a neighbour (the first
+///        parent, or the child pNearId) at once, the rest in the order "git blame --incremental" finds them. Stop when
+///        onRanges returns false or the token is cancelled. Complete blames are cached in the diff cache, so they
+///        survive restarts if it has a directory.
+export void RunBlame(const std::string& workDir, git_repository* pRepo, git_commit* pCommit, const git_oid& blobId,
+    const std::string& path, const git_oid* pNearId, CancellationToken& token,
+    const std::function<bool(const Blame& blame, const std::vector<BlameRange>& ranges)>& onRanges)
+{
+    constexpr size_t kMaxLineRanges = 64;
+
+    const auto& commitId = *git_commit_id(pCommit);
+    if (auto pCached = GetCachedBlame(commitId, path)) {
+        onRanges(*pCached, pCached->GetRanges());
+        return;
+    }
+
+    Blame blame {};
+    blame.lines.resize(CountBlobLines(pRepo, blobId));
+    ReuseNeighbourBlame(pRepo, pCommit, blobId, path, pNearId, blame);
+    if (auto ranges = blame.GetRanges(); !ranges.empty() && !onRanges(blame, ranges)) {
+        return;
+    }
+
+    // Blame the rest, only the lines which are not attributed yet, unless there are too many ranges of them.
+    auto cmd = std::format("git blame --incremental {}", GitHashToString(commitId.id));
+    size_t lineRanges {};
+    std::string lineRangeArguments {};
+    for (size_t i = 0; i < blame.lines.size();) {
+        if (blame.lines[i].origLine) {
+            ++i;
+            continue;
+        }
+        auto begin = i;
+        while (i < blame.lines.size() && !blame.lines[i].origLine) {
+            ++i;
+        }
+        ++lineRanges;
+        lineRangeArguments += std::format(" -L {},{}", begin + 1, i);
+    }
+    if (!lineRanges) {
+        PutCachedBlame(commitId, path, blame);
+        return;
+    }
+    if (lineRanges <= kMaxLineRanges) {
+        cmd += lineRangeArguments;
+    }
+    cmd += std::format(" -- \"{}\"", path);
+
+    // Every entry is "<id> <origLine> <line> <count>", the commit headers when the commit is first seen, then
+    // "filename <path>". The commit is added with the filename, so it is never reported before its headers.
+    LineReader lineReader {};
+    std::optional<BlameRange> entry {};
+    BlameCommit entryCommit {};
+    auto stopped = false;
+    ExternRun(
+        cmd, workDir.c_str(),
+        [&](char* data, size_t size) {
+            lineReader.Append(data, size);
+            std::vector<BlameRange> ranges {};
+            while (auto pLine = lineReader.GetLine()) {
+                std::string_view line = *pLine;
+                if (!entry) {
+                    auto idEnd = line.find(' ');
+                    if (idEnd == std::string_view::npos) {
+                        continue;
+                    }
+                    entryCommit = { .id = std::string { line.substr(0, idEnd) } };
+                    BlameRange range {};
+                    auto* pEnd = line.data() + line.size();
+                    auto* p = std::from_chars(line.data() + idEnd + 1, pEnd, range.origLine).ptr;
+                    p = std::from_chars(p + (p < pEnd), pEnd, range.line).ptr;
+                    std::from_chars(p + (p < pEnd), pEnd, range.count);
+                    entry = range;
+                } else if (line.starts_with("author ")) {
+                    entryCommit.author = line.substr(7);
+                } else if (line.starts_with("author-time ")) {
+                    std::from_chars(line.data() + 12, line.data() + line.size(), entryCommit.time);
+                } else if (line.starts_with("summary ")) {
+                    entryCommit.summary = line.substr(8);
+                } else if (line.starts_with("filename ")) {
+                    entry->commit = blame.AddCommit(std::move(entryCommit));
+                    for (size_t i = 0; i < entry->count && entry->line + i <= blame.lines.size(); ++i) {
+                        blame.lines[entry->line - 1 + i]
+                            = { (uint32_t)entry->commit, (uint32_t)(entry->origLine + i) };
+                    }
+                    ranges.push_back(*entry);
+                    entry.reset();
+                }
+            }
+            stopped = !ranges.empty() && !onRanges(blame, ranges);
+            return !stopped;
+        },
+        &token);
+
+    if (!stopped && !token.IsCancelled() && blame.IsComplete()) {
+        PutCachedBlame(commitId, path, blame);
+    }
+}
@@ -0,0 +1,156 @@
+module;
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <stop_token>
+#include <thread>
+#include <utility>
+#include <vector>
+
+export module gitkf:cancellation;
+
+/// @brief Cancellation flag of a request. Long running work polls IsCancelled(), blocking work (e.g. waiting for the
+///        output of a child process) registers a callback with OnCancel() to abort itself.
+export class CancellationToken {
+public:
+    class Registration {
+    public:
+        Registration() = default;
+        Registration(CancellationToken* pToken, size_t id)
+            : m_pToken { pToken }
+            , m_id { id }
+        {
+        }
+        Registration(const Registration&) = delete;
+        Registration(Registration&& other) noexcept
+            : m_pToken { std::exchange(other.m_pToken, nullptr) }
+            , m_id { other.m_id }
+        {
+        }
+
+        Registration& operator=(Registration&& other) noexcept
+        {
+            if (this != &other) {
+                Reset();
+                m_pToken = std::exchange(other.m_pToken, nullptr);
+                m_id = other.m_id;
+            }
+            return *this;
+        }
+
+        ~Registration() { Reset(); }
+
+        void Reset()
+        {
+            if (m_pToken) {
+                std::exchange(m_pToken, nullptr)->Unregister(m_id);
+            }
+        }
+
+    private:
+        CancellationToken* m_pToken {};
+        size_t m_id {};
+    };
+
+    CancellationToken() = default;
+    CancellationToken(const CancellationToken&) = delete;
+
+    bool IsCancelled() const { return m_cancelled.load(std::memory_order_relaxed); }
+
+    void Cancel()
+    {
+        std::unique_lock lock { m_mutex };
+        if (m_cancelled.exchange(true)) {
+            return;
+        }
+        for (auto& [id, callback] : m_callbacks) {
+            callback();
+        }
+    }
+
+    /// @brief Call callback when the token is cancelled, or right now if it is cancelled already. The callback is
+    ///        never called after the returned registration is destroyed.
+    [[nodiscard]] Registration OnCancel(std::function<void()> callback)
+    {
+        std::unique_lock lock { m_mutex };
+        if (m_cancelled) {
+            callback();
+            return {};
+        }
+        auto id = m_nextId++;
+        m_callbacks.emplace(id, std::move(callback));
+        return { this, id };
+    }
+
+private:
+    void Unregister(size_t id)
+    {
+        std::unique_lock lock { m_mutex };
+        m_callbacks.erase(id);
+    }
+
+    std::atomic<bool> m_cancelled {};
+    std::mutex m_mutex {};
+    std::map<size_t, std::function<void()>> m_callbacks {};
+    size_t m_nextId {};
+};
+
+/// @brief Cancel the token as soon as the client connection is closed. Connections are probed on a shared background
+///        thread, so that work blocked somewhere (e.g. a child process producing no output) is cancelled as well,
+///        not only when the next write fails. The probe is never called after this object is destroyed.
+export class ConnectionWatch {
+public:
+    ConnectionWatch(CancellationToken& token, std::function<bool()> isConnectionClosed)
+        : m_token { token }
+        , m_isConnectionClosed { std::move(isConnectionClosed) }
+    {
+        auto& monitor = GetMonitor();
+        std::unique_lock lock { monitor.mutex };
+        monitor.watches.push_back(this);
+        if (!monitor.thread.joinable()) {
+            monitor.thread = std::jthread { [&monitor](std::stop_token stopToken) { monitor.Run(stopToken); } };
+        }
+    }
+
+    ConnectionWatch(const ConnectionWatch&) = delete;
+
+    ~ConnectionWatch()
+    {
+        auto& monitor = GetMonitor();
+        std::unique_lock lock { monitor.mutex };
+        std::erase(monitor.watches, this);
+    }
+
+private:
+    struct Monitor {
+        std::mutex mutex {};
+        std::vector<ConnectionWatch*> watches {};
+        std::jthread thread {};
+
+        void Run(std::stop_token stopToken)
+        {
+            while (!stopToken.stop_requested()) {
+                std::this_thread::sleep_for(std::chrono::milliseconds { 100 });
+                std::unique_lock lock { mutex };
+                for (auto* pWatch : watches) {
+                    if (!pWatch->m_token.IsCancelled() && pWatch->m_isConnectionClosed()) {
+                        pWatch->m_token.Cancel();
+                    }
+                }
+            }
+        }
+    };
+
+    static Monitor& GetMonitor()
+    {
+        static Monitor s_monitor {};
+        return s_monitor;
+    }
+
+    CancellationToken& m_token;
+    std::function<bool()> m_isConnectionClosed {};
+};
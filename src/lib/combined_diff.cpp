@@ -0,0 +1,565 @@
+module;
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cstdint>
+#include <cstring>
+#include <format>
+#include <latch>
+#include <memory>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <thirdparty/libgit2/include/git2.h>
+#include <unordered_map>
+#include <vector>
+
+export module gitkf:combined_diff;
+import :cancellation;
+import :diff_stat;
+import :git_repository;
+import :git_smart_pointer;
+import :thread_pool;
+import :tree_diff;
+
+// Parents of a line are bits of a mask, two more bits mark lines which are shown.
+constexpr size_t kMaxCombinedParents = 62;
+constexpr size_t kCombinedContextLines = 3;
+
+// Lost lines of a line are coalesced by a longest common subsequence, which is quadratic.
+constexpr size_t kMaxCoalesceCells = 4 * 1024 * 1024;
+
+/// @brief Combined diff of a file of a merge commit, in "git show --cc" format.
+export struct CombinedFileDiff {
+    FileStat stat {};
+    std::string patch {};
+};
+
+/// @brief A file which differs from every parent of a merge commit, a zero id means it isn't there.
+struct MergedFile {
+    std::string path {};
+    git_oid id {};
+    uint32_t mode {};
+    std::vector<git_oid> parentIds {};
+    std::vector<uint32_t> parentModes {};
+    size_t parentsSeen {};
+};
+
+/// @brief A line of a parent which isn't in the merge result, parents has a bit for every parent it is lost from.
+struct LostLine {
+    std::string_view text {};
+    uint64_t parents {};
+};
+
+/// @brief A line of the merge result (and one past its end, which only has lost lines). flag has a bit for every parent
+///        the line isn't in, lost are the lines of parents removed before it, and parentLines are the line numbers in
+///        the parents at this line.
+struct ResultLine {
+    std::string_view text {};
+    uint64_t flag {};
+    std::vector<LostLine> lost {};
+    std::vector<size_t> parentLines {};
+};
+
+static std::vector<std::string_view> SplitLines(std::string_view text)
+{
+    std::vector<std::string_view> lines {};
+    while (!text.empty()) {
+        auto pEnd = (const char*)std::memchr(text.data(), '\n', text.size());
+        auto line = text.substr(0, pEnd ? pEnd - text.data() + 1 : text.size());
+        lines.push_back(line);
+        text.remove_prefix(line.size());
+    }
+    return lines;
+}
+
+static std::string_view GetBlobContent(const git_blob* pBlob)
+{
+    return pBlob ? std::string_view { (const char*)git_blob_rawcontent(pBlob), (size_t)git_blob_rawsize(pBlob) }
+                 : std::string_view {};
+}
+
+/// @brief Whether lost lines are the same, a last line without '\n' is the same as one with it.
+static bool IsSameLine(std::string_view a, std::string_view b, bool ignoreWhitespace)
+{
+    if (!ignoreWhitespace) {
+        return a.substr(0, a.size() - a.ends_with('\n')) == b.substr(0, b.size() - b.ends_with('\n'));
+    }
+    auto isSpace = [](char ch) { return std::isspace((unsigned char)ch) != 0; };
+    size_t i = 0;
+    size_t j = 0;
+    while (true) {
+        for (; i < a.size() && isSpace(a[i]); ++i) { }
+        for (; j < b.size() && isSpace(b[j]); ++j) { }
+        if (i == a.size() || j == b.size()) {
+            return i == a.size() && j == b.size();
+        }
+        if (a[i++] != b[j++]) {
+            return false;
+        }
+    }
+}
+
+/// @brief Hunks of the diff from oldBlob to newBlob without context, so they are the changed lines exactly. An empty
+///        side of a hunk starts after its line.
+static std::vector<git_diff_hunk> DiffBlobLines(const git_blob* pOld, const git_blob* pNew, bool ignoreWhitespace)
+{
+    std::vector<git_diff_hunk> hunks {};
+    git_diff_options options = GIT_DIFF_OPTIONS_INIT;
+    options.context_lines = 0;
+    options.interhunk_lines = 0;
+    options.flags |= GIT_DIFF_FORCE_TEXT | GIT_DIFF_INDENT_HEURISTIC;
+    if (ignoreWhitespace) {
+        options.flags |= GIT_DIFF_IGNORE_WHITESPACE;
+    }
+    git_diff_blobs(
+        pOld, nullptr, pNew, nullptr, &options, nullptr, nullptr,
+        [](const git_diff_delta*, const git_diff_hunk* pHunk, void* pPayload) {
+            ((std::vector<git_diff_hunk>*)pPayload)->push_back(*pHunk);
+            return 0;
+        },
+        nullptr, &hunks);
+    return hunks;
+}
+
+/// @brief Add the lines lost from a parent to the lines lost from the parents before it. A line lost from several
+///        parents is shown once, so they are matched by their longest common subsequence, with the same order of
+///        unmatched lines as git.
+static void CoalesceLostLines(
+    std::vector<LostLine>& lost, std::span<const std::string_view> lines, size_t parent, bool ignoreWhitespace)
+{
+    auto bit = uint64_t { 1 } << parent;
+    if (lost.empty() || lost.size() * lines.size() > kMaxCoalesceCells) {
+        for (auto line : lines) {
+            lost.push_back({ line, bit });
+        }
+        return;
+    }
+
+    auto width = lines.size() + 1;
+    std::vector<uint32_t> lcs((lost.size() + 1) * width);
+    for (size_t i = 1; i <= lost.size(); ++i) {
+        for (size_t j = 1; j <= lines.size(); ++j) {
+            lcs[i * width + j] = IsSameLine(lost[i - 1].text, lines[j - 1], ignoreWhitespace)
+                ? lcs[(i - 1) * width + j - 1] + 1
+                : std::max(lcs[i * width + j - 1], lcs[(i - 1) * width + j]);
+        }
+    }
+
+    std::vector<LostLine> merged {};
+    merged.reserve(lost.size() + lines.size());
+    for (auto i = lost.size(), j = lines.size(); i || j;) {
+        if (i && j && IsSameLine(lost[i - 1].text, lines[j - 1], ignoreWhitespace)) {
+            merged.push_back({ lost[i - 1].text, lost[i - 1].parents | bit });
+            --i;
+            --j;
+        } else if (j && (!i || lcs[i * width + j - 1] >= lcs[(i - 1) * width + j])) {
+            merged.push_back({ lines[--j], bit });
+        } else {
+            merged.push_back(lost[--i]);
+        }
+    }
+    std::reverse(merged.begin(), merged.end());
+    lost = std::move(merged);
+}
+
+/// @brief Mark the lines which are shown, the same as "make_hunks" and "give_context" of git's combine-diff.c in dense
+///        mode: changed lines are shown with a few lines of context, except for hunks where the result takes one
+///        version of the parents' lines as it is. Return false if no line is shown.
+static bool MarkShownLines(std::vector<ResultLine>& lines, size_t parentCount)
+{
+    auto allMask = (uint64_t { 1 } << parentCount) - 1;
+    auto mark = uint64_t { 1 } << parentCount;
+    auto noPreDelete = uint64_t { 2 } << parentCount;
+    auto count = lines.size() - 2;
+
+    for (auto& line : lines) {
+        if ((line.flag & allMask) || !line.lost.empty()) {
+            line.flag |= mark;
+        }
+    }
+
+    // A last line which is only there for its lost lines is shown as context anyway.
+    auto adjustHunkTail = [&](size_t hunkBegin, size_t i) {
+        return hunkBegin + 1 <= i && !(lines[i - 1].flag & allMask) ? i - 1 : i;
+    };
+    auto findNext = [&](size_t i, bool uninteresting) {
+        for (; i <= count && (uninteresting ? (lines[i].flag & mark) != 0 : !(lines[i].flag & mark)); ++i) { }
+        return i;
+    };
+
+    // Drop hunks whose changes all come from the same parents: the result is one of two versions.
+    for (size_t i = 0; i <= count;) {
+        i = findNext(i, /*uninteresting=*/false);
+        if (i > count) {
+            break;
+        }
+        auto hunkBegin = i;
+        auto j = i + 1;
+        for (; j <= count; ++j) {
+            if (!(lines[j].flag & mark)) {
+                auto lookahead = std::min(adjustHunkTail(hunkBegin, j) + kCombinedContextLines, count + 1);
+                auto next = findNext(j, /*uninteresting=*/false);
+                if (next >= lookahead) {
+                    break;
+                }
+                j = next;
+            }
+        }
+        auto hunkEnd = j;
+
+        uint64_t sameDiff {};
+        auto interesting = false;
+        auto addDiff = [&](uint64_t diff) {
+            if (!sameDiff) {
+                sameDiff = diff;
+            } else if (sameDiff != diff) {
+                interesting = true;
+            }
+        };
+        for (j = hunkBegin; j < hunkEnd && !interesting; ++j) {
+            if (auto diff = lines[j].flag & allMask) {
+                addDiff(diff);
+            }
+            for (auto it = lines[j].lost.begin(); it != lines[j].lost.end() && !interesting; ++it) {
+                addDiff(it->parents);
+            }
+        }
+        if (!interesting && sameDiff != allMask) {
+            for (j = hunkBegin; j < hunkEnd; ++j) {
+                lines[j].flag &= ~mark;
+            }
+        }
+        i = hunkEnd;
+    }
+
+    // Give the rest context, and join hunks with short gaps between them.
+    auto i = findNext(0, /*uninteresting=*/false);
+    if (i > count) {
+        return false;
+    }
+    while (i <= count) {
+        for (auto j = i > kCombinedContextLines ? i - kCombinedContextLines : 0; j < i; ++j) {
+            if (!(lines[j].flag & mark)) {
+                lines[j].flag |= noPreDelete;
+            }
+            lines[j].flag |= mark;
+        }
+
+        while (true) {
+            auto j = findNext(i, /*uninteresting=*/true);
+            if (j > count) {
+                return true;
+            }
+            auto k = findNext(j, /*uninteresting=*/false);
+            j = adjustHunkTail(i, j);
+            if (k < j + kCombinedContextLines) {
+                for (; j < k; ++j) {
+                    lines[j].flag |= mark;
+                }
+                i = k;
+                continue;
+            }
+
+            for (auto end = std::min(j + kCombinedContextLines, count + 1); j < end; ++j) {
+                lines[j].flag |= mark;
+            }
+            i = k;
+            break;
+        }
+    }
+    return true;
+}
+
+/// @brief Format the header of a combined diff, with the modes of the file if they differ from a parent.
+static std::string FormatCombinedHeader(const MergedFile& file)
+{
+    auto abbrev = [](const git_oid& oid) { return GitHashToString(oid.id).substr(0, 7); };
+    auto header = std::format("diff --cc {}\nindex ", file.path);
+    for (size_t i = 0; i < file.parentIds.size(); ++i) {
+        header += (i ? "," : "") + abbrev(file.parentIds[i]);
+    }
+    header += ".." + abbrev(file.id) + '\n';
+
+    auto added = std::ranges::all_of(file.parentIds, [](const git_oid& oid) { return git_oid_is_zero(&oid); });
+    auto deleted = git_oid_is_zero(&file.id);
+    if (std::ranges::any_of(file.parentModes, [&file](uint32_t mode) { return mode != file.mode; })) {
+        if (added) {
+            header += std::format("new file mode {:06o}", file.mode);
+        } else {
+            header += deleted ? "deleted file mode " : "mode ";
+            for (size_t i = 0; i < file.parentModes.size(); ++i) {
+                header += std::format("{}{:06o}", i ? "," : "", file.parentModes[i]);
+            }
+            if (!deleted) {
+                header += std::format("..{:06o}", file.mode);
+            }
+        }
+        header += '\n';
+    }
+    header += added ? "--- /dev/null\n" : std::format("--- a/{}\n", file.path);
+    header += deleted ? "+++ /dev/null\n" : std::format("+++ b/{}\n", file.path);
+    return header;
+}
+
+/// @brief Format the shown lines, the same as "dump_sline" of git's combine-diff.c. Every line has a column per
+///        parent: '+' if it isn't in the parent, '-' if it is lost from the parent.
+static void FormatCombinedHunks(const std::vector<ResultLine>& lines, size_t parentCount, CombinedFileDiff& diff)
+{
+    auto allMask = (uint64_t { 1 } << parentCount) - 1;
+    auto mark = uint64_t { 1 } << parentCount;
+    auto noPreDelete = uint64_t { 2 } << parentCount;
+    auto count = lines.size() - 2;
+    auto markers = std::string(parentCount + 1, '@');
+
+    auto appendLine = [&diff](std::string_view text) {
+        diff.patch += text;
+        if (!text.ends_with('\n')) {
+            diff.patch += '\n';
+        }
+    };
+
+    for (size_t lineIndex = 0;;) {
+        std::string_view hunkComment {};
+        for (; lineIndex <= count && !(lines[lineIndex].flag & mark); ++lineIndex) {
+            auto text = lines[lineIndex].text;
+            if (!text.empty() && (std::isalpha((unsigned char)text[0]) || text[0] == '_' || text[0] == '$')) {
+                hunkComment = text;
+            }
+        }
+        if (lineIndex > count) {
+            break;
+        }
+        auto hunkEnd = lineIndex + 1;
+        for (; hunkEnd <= count && (lines[hunkEnd].flag & mark); ++hunkEnd) { }
+
+        // The hunk of the lines lost at the end doesn't count the line past the end.
+        auto resultLines = hunkEnd - lineIndex - (hunkEnd > count);
+        diff.patch += markers;
+        for (size_t i = 0; i < parentCount; ++i) {
+            auto begin = lines[lineIndex].parentLines[i];
+            diff.patch += std::format(" -{},{}", begin, lines[hunkEnd].parentLines[i] - begin);
+        }
+        diff.patch += std::format(" +{},{} {}", lineIndex + 1, resultLines, markers);
+
+        // Like git, the comment is cut at 40 bytes and its last non-space byte is dropped.
+        size_t commentEnd {};
+        for (size_t i = 0; i < std::min<size_t>(hunkComment.size(), 40) && hunkComment[i] != '\n'; ++i) {
+            if (!std::isspace((unsigned char)hunkComment[i])) {
+                commentEnd = i;
+            }
+        }
+        if (commentEnd) {
+            diff.patch += ' ';
+            diff.patch += hunkComment.substr(0, commentEnd);
+        }
+        diff.patch += '\n';
+
+        for (; lineIndex < hunkEnd; ++lineIndex) {
+            const auto& line = lines[lineIndex];
+            if (!(line.flag & noPreDelete)) {
+                for (const auto& lost : line.lost) {
+                    for (size_t i = 0; i < parentCount; ++i) {
+                        diff.patch += (lost.parents >> i) & 1 ? '-' : ' ';
+                    }
+                    appendLine(lost.text);
+                    ++diff.stat.deletions;
+                }
+            }
+            if (lineIndex == count) {
+                break;
+            }
+            for (size_t i = 0; i < parentCount; ++i) {
+                diff.patch += (line.flag >> i) & 1 ? '+' : ' ';
+            }
+            appendLine(line.text);
+            diff.stat.additions += (line.flag & allMask) != 0;
+        }
+        lineIndex = hunkEnd;
+    }
+}
+
+/// @brief Combined diff of a file which differs from every parent, or nullopt if the dense view drops it because the
+///        result takes every change as it is in one parent. A deleted file is diffed as an empty one.
+static std::optional<CombinedFileDiff> DiffMergedFile(
+    git_repository* pRepo, const MergedFile& file, bool ignoreWhitespace)
+{
+    auto lookupBlob = [pRepo](const git_oid& oid, std::unique_ptr<git_blob>& pBlob) {
+        return git_oid_is_zero(&oid) || !git_blob_lookup(std::out_ptr(pBlob), pRepo, &oid);
+    };
+
+    // Submodules have no blobs, they aren't shown.
+    std::unique_ptr<git_blob> pBlob {};
+    if (!lookupBlob(file.id, pBlob)) {
+        return std::nullopt;
+    }
+    std::vector<std::unique_ptr<git_blob>> parentBlobs(file.parentIds.size());
+    for (size_t i = 0; i < file.parentIds.size(); ++i) {
+        if (!lookupBlob(file.parentIds[i], parentBlobs[i])) {
+            return std::nullopt;
+        }
+    }
+
+    auto parentCount = file.parentIds.size();
+    CombinedFileDiff diff {
+        .stat = {
+            .status = git_oid_is_zero(&file.id) ? 'D' : 'M',
+            .path = file.path,
+        },
+        .patch = FormatCombinedHeader(file),
+    };
+    if (std::ranges::all_of(file.parentIds, [](const git_oid& oid) { return git_oid_is_zero(&oid); })) {
+        diff.stat.status = 'A';
+    }
+    auto isBinary = [](const std::unique_ptr<git_blob>& pBlob) { return pBlob && git_blob_is_binary(pBlob.get()); };
+    if (isBinary(pBlob) || std::ranges::any_of(parentBlobs, isBinary)) {
+        diff.stat.binary = true;
+        diff.patch += "Binary files differ\n";
+        return diff;
+    }
+    // One line past the end holds the lines lost at the end, and one more the line numbers of parents at the end.
+    auto resultLines = SplitLines(GetBlobContent(pBlob.get()));
+    std::vector<ResultLine> lines(resultLines.size() + 2);
+    for (size_t i = 0; i < resultLines.size(); ++i) {
+        lines[i].text = resultLines[i];
+    }
+    for (auto& line : lines) {
+        line.parentLines.resize(parentCount);
+    }
+
+    for (size_t parent = 0; parent < parentCount; ++parent) {
+        auto bit = uint64_t { 1 } << parent;
+        auto parentIds = std::span { file.parentIds }.first(parent);
+        auto sameParent = std::ranges::find_if(
+            parentIds, [&](const git_oid& oid) { return git_oid_equal(&oid, &file.parentIds[parent]); });
+        if (sameParent != parentIds.end()) {
+            // Like git, a parent with the same blob as an earlier parent takes its changes instead of a diff.
+            auto sameBit = uint64_t { 1 } << (sameParent - parentIds.begin());
+            for (auto& line : lines) {
+                line.flag |= line.flag & sameBit ? bit : 0;
+                for (auto& lost : line.lost) {
+                    lost.parents |= lost.parents & sameBit ? bit : 0;
+                }
+            }
+        } else {
+            auto parentLines = SplitLines(GetBlobContent(parentBlobs[parent].get()));
+            for (const auto& hunk : DiffBlobLines(parentBlobs[parent].get(), pBlob.get(), ignoreWhitespace)) {
+                for (auto i = 0; i < hunk.new_lines; ++i) {
+                    lines[hunk.new_start - 1 + i].flag |= bit;
+                }
+                if (hunk.old_lines) {
+                    auto lostIndex = hunk.new_lines ? hunk.new_start - 1 : hunk.new_start;
+                    auto lost = std::span { parentLines }.subspan(hunk.old_start - 1, hunk.old_lines);
+                    CoalesceLostLines(lines[lostIndex].lost, lost, parent, ignoreWhitespace);
+                }
+            }
+        }
+
+        size_t parentLine = 1;
+        for (size_t i = 0; i < lines.size(); ++i) {
+            lines[i].parentLines[parent] = parentLine;
+            auto isLost = [bit](const LostLine& lost) { return (lost.parents & bit) != 0; };
+            parentLine += std::ranges::count_if(lines[i].lost, isLost);
+            parentLine += i < resultLines.size() && !(lines[i].flag & bit);
+        }
+    }
+
+    auto modeDiffers = std::ranges::any_of(file.parentModes, [&file](uint32_t mode) { return mode != file.mode; });
+    if (!MarkShownLines(lines, parentCount) && !modeDiffers) {
+        return std::nullopt;
+    }
+    FormatCombinedHunks(lines, parentCount, diff);
+    return diff;
+}
+
+/// @brief Dense combined diff of a merge commit, the same as "git show --cc": files which differ from every parent,
+///        with the hunks where the result differs from more than one version of the parents' lines. Files are diffed in
+///        parallel on the shared thread pool, each worker with its own repository. pathspec is relative to the work
+///        directory, empty means all files. Return the files in path order, or what is diffed so far if the token is
+///        cancelled.
+export std::vector<CombinedFileDiff> GetCombinedDiff(git_repository* pRepo, const std::string& repoRoot,
+    git_commit* pCommit, const std::string& pathspec, bool ignoreWhitespace, CancellationToken& token)
+{
+    auto parentCount = git_commit_parentcount(pCommit);
+    std::unique_ptr<git_tree> pTree {};
+    if (parentCount < 2 || parentCount > kMaxCombinedParents || git_commit_tree(std::out_ptr(pTree), pCommit)) {
+        return {};
+    }
+
+    // A file is in the combined diff if it differs from every parent, its blob in a parent follows renames.
+    std::vector<MergedFile> files {};
+    std::unordered_map<std::string_view, size_t> pathToFile {};
+    for (auto parent = 0u; parent < parentCount; ++parent) {
+        std::unique_ptr<git_commit> pParent {};
+        std::unique_ptr<git_tree> pParentTree {};
+        if (git_commit_parent(std::out_ptr(pParent), pCommit, parent)) {
+            return {};
+        }
+        if (git_commit_tree(std::out_ptr(pParentTree), pParent.get())) {
+            return {};
+        }
+        auto pDiff = DiffTrees(pRepo, pParentTree.get(), pTree.get(), pathspec, ignoreWhitespace);
+        if (!pDiff) {
+            return {};
+        }
+
+        for (size_t i = 0; i < git_diff_num_deltas(pDiff.get()); ++i) {
+            const auto* pDelta = git_diff_get_delta(pDiff.get(), i);
+            auto path = GetDeltaPath(pDelta);
+            MergedFile* pFile {};
+            if (!parent) {
+                pFile = &files.emplace_back(MergedFile {
+                    .path = std::string { path },
+                    .id = pDelta->new_file.id,
+                    .mode = pDelta->new_file.mode,
+                    .parentIds = std::vector<git_oid>(parentCount),
+                    .parentModes = std::vector<uint32_t>(parentCount),
+                });
+            } else if (auto it = pathToFile.find(path); it != pathToFile.end()) {
+                pFile = &files[it->second];
+            }
+            if (!pFile || pFile->parentsSeen != parent) {
+                continue;
+            }
+            pFile->parentIds[parent] = pDelta->old_file.id;
+            pFile->parentModes[parent] = pDelta->old_file.mode;
+            ++pFile->parentsSeen;
+        }
+        if (!parent) {
+            for (size_t i = 0; i < files.size(); ++i) {
+                pathToFile.emplace(files[i].path, i);
+            }
+        }
+    }
+    std::erase_if(files, [parentCount](const MergedFile& file) { return file.parentsSeen != parentCount; });
+    std::ranges::sort(files, {}, &MergedFile::path);
+
+    // Workers pick the next file from a shared counter, so a big file won't hold up others.
+    auto& pool = GetSharedThreadPool();
+    std::vector<std::optional<CombinedFileDiff>> diffs(files.size());
+    std::atomic<size_t> next {};
+    auto taskCount = std::min(pool.Size(), files.size());
+    std::latch done { (std::ptrdiff_t)taskCount };
+    for (auto i = 0u; i < taskCount; ++i) {
+        pool.Enqueue([&] {
+            auto* pWorkerRepo = GetThreadLocalRepository(repoRoot);
+            for (auto j = next++; j < files.size() && !token.IsCancelled(); j = next++) {
+                if (pWorkerRepo) {
+                    diffs[j] = DiffMergedFile(pWorkerRepo, files[j], ignoreWhitespace);
+                }
+            }
+            done.count_down();
+        });
+    }
+    done.wait();
+
+    std::vector<CombinedFileDiff> result {};
+    for (auto& diff : diffs) {
+        if (diff) {
+            result.push_back(std::move(*diff));
+        }
+    }
+    return result;
+}
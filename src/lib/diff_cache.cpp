@@ -0,0 +1,240 @@
+module;
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+export module gitkf:diff_cache;
+import :platform_utils;
+
+/// @brief Diffs shared by all requests, keyed by what a diff depends on (trees, pathspec and options) rather than by
+///        repository or commit, so the same change seen by other users, through other commits or after toggling an
+///        option back is not diffed again. Entries are kept in memory up to a size limit (least recently used ones are
+///        dropped first), and optionally in a directory, which survives restarts and is bounded by size as well.
+export class DiffCache {
+public:
+    void SetLimits(size_t memoryBytes, std::string directory, size_t diskBytes)
+    {
+        std::unique_lock lock { m_mutex };
+        m_memoryLimit = memoryBytes;
+        m_diskLimit = diskBytes;
+        m_directory = std::move(directory);
+        m_diskSize = {};
+        if (!m_directory.empty()) {
+            // Entries hold file contents of the repositories, keep them from other users.
+            CreatePrivateDirectory(m_directory);
+            for (const auto& entry : std::filesystem::directory_iterator { m_directory }) {
+                m_diskSize += entry.is_regular_file() ? entry.file_size() : 0;
+            }
+        }
+        Shrink();
+    }
+
+    bool IsEnabled() const
+    {
+        std::unique_lock lock { m_mutex };
+        return m_memoryLimit;
+    }
+
+    std::shared_ptr<const std::string> Get(const std::string& key)
+    {
+        {
+            std::unique_lock lock { m_mutex };
+            if (!m_memoryLimit) {
+                return nullptr;
+            }
+            if (auto it = m_index.find(key); it != m_index.end()) {
+                m_entries.splice(m_entries.begin(), m_entries, it->second);
+                ++m_hits;
+                return it->second->second;
+            }
+        }
+
+        auto pValue = ReadFromDisk(key);
+        if (pValue) {
+            ++m_diskHits;
+            Insert(key, pValue);
+        } else {
+            ++m_misses;
+        }
+        return pValue;
+    }
+
+    void Put(const std::string& key, std::shared_ptr<const std::string> pValue)
+    {
+        if (!pValue || !IsEnabled()) {
+            return;
+        }
+        WriteToDisk(key, *pValue);
+        Insert(key, std::move(pValue));
+    }
+
+    /// @brief Format cache usage in Prometheus text format.
+    std::string FormatMetrics() const
+    {
+        std::unique_lock lock { m_mutex };
+        std::string out {};
+        auto formatValue = [&out](std::string_view name, std::string_view type, std::string_view help, auto value) {
+            out += std::format("# HELP {} {}\n# TYPE {} {}\n{} {}\n", name, help, name, type, name, value);
+        };
+        formatValue("gitkf_diff_cache_hits_total", "counter", "Diffs found in memory.", m_hits.load());
+        formatValue("gitkf_diff_cache_disk_hits_total", "counter", "Diffs found on disk.", m_diskHits.load());
+        formatValue("gitkf_diff_cache_misses_total", "counter", "Diffs not cached.", m_misses.load());
+        formatValue("gitkf_diff_cache_bytes", "gauge", "Bytes of diffs cached in memory.", m_memorySize);
+        formatValue("gitkf_diff_cache_disk_bytes", "gauge", "Bytes of diffs cached on disk.", m_diskSize);
+        return out;
+    }
+
+private:
+    using Entry = std::pair<std::string, std::shared_ptr<const std::string>>;
+
+    void Insert(const std::string& key, std::shared_ptr<const std::string> pValue)
+    {
+        std::unique_lock lock { m_mutex };
+        if (pValue->size() > m_memoryLimit) {
+            return;
+        }
+        if (auto it = m_index.find(key); it != m_index.end()) {
+            // Added by another request meanwhile.
+            m_entries.splice(m_entries.begin(), m_entries, it->second);
+            return;
+        }
+        m_memorySize += key.size() + pValue->size();
+        m_entries.emplace_front(key, std::move(pValue));
+        m_index.emplace(key, m_entries.begin());
+        Shrink();
+    }
+
+    void Shrink()
+    {
+        while (m_memorySize > m_memoryLimit && !m_entries.empty()) {
+            const auto& [key, pValue] = m_entries.back();
+            m_memorySize -= key.size() + pValue->size();
+            m_index.erase(key);
+            m_entries.pop_back();
+        }
+    }
+
+    /// @brief Files are named by the hash of their key, and start with the key, so a hash collision is a miss.
+    std::filesystem::path GetDiskPath(const std::string& key) const
+    {
+        return std::filesystem::path { m_directory } / std::format("{:016x}", std::hash<std::string> {}(key));
+    }
+
+    std::shared_ptr<const std::string> ReadFromDisk(const std::string& key) const
+    {
+        std::filesystem::path path {};
+        {
+            std::unique_lock lock { m_mutex };
+            if (m_directory.empty()) {
+                return nullptr;
+            }
+            path = GetDiskPath(key);
+        }
+
+        std::ifstream in { path, std::ios::binary };
+        std::string storedKey {};
+        if (!in || !std::getline(in, storedKey, '\0') || storedKey != key) {
+            return nullptr;
+        }
+        auto pValue = std::make_shared<std::string>(
+            std::istreambuf_iterator<char> { in }, std::istreambuf_iterator<char> {});
+        return in.bad() ? nullptr : pValue;
+    }
+
+    void WriteToDisk(const std::string& key, const std::string& value)
+    {
+        std::filesystem::path path {};
+        {
+            std::unique_lock lock { m_mutex };
+            if (m_directory.empty() || value.size() > m_diskLimit) {
+                return;
+            }
+            path = GetDiskPath(key);
+        }
+
+        // Write a temporary file first, so readers never see a partial entry.
+        auto tempPath = path;
+        tempPath += std::format(".{}.tmp", ++m_nextTempId);
+        {
+            std::ofstream out { tempPath, std::ios::binary | std::ios::trunc };
+            out.write(key.data(), key.size());
+            out.put('\0');
+            out.write(value.data(), value.size());
+            if (!out) {
+                std::error_code ec {};
+                std::filesystem::remove(tempPath, ec);
+                return;
+            }
+        }
+        std::error_code ec {};
+        std::filesystem::rename(tempPath, path, ec);
+
+        std::unique_lock lock { m_mutex };
+        m_diskSize += key.size() + 1 + value.size();
+        if (m_diskSize > m_diskLimit) {
+            ShrinkDisk();
+        }
+    }
+
+    /// @brief Remove the oldest files until the directory is down to 3/4 of its limit, so this is not done for every
+    ///        write once the limit is reached.
+    void ShrinkDisk()
+    {
+        std::vector<std::pair<std::filesystem::file_time_type, std::filesystem::path>> files {};
+        std::error_code ec {};
+        for (const auto& entry : std::filesystem::directory_iterator { m_directory, ec }) {
+            if (entry.is_regular_file(ec) && entry.path().extension() != ".tmp") {
+                files.emplace_back(entry.last_write_time(ec), entry.path());
+            }
+        }
+        std::ranges::sort(files);
+
+        m_diskSize = {};
+        for (const auto& [time, path] : files) {
+            m_diskSize += std::filesystem::file_size(path, ec);
+        }
+        for (const auto& [time, path] : files) {
+            if (m_diskSize <= m_diskLimit / 4 * 3) {
+                break;
+            }
+            auto size = std::filesystem::file_size(path, ec);
+            if (std::filesystem::remove(path, ec)) {
+                m_diskSize -= size;
+            }
+        }
+    }
+
+    mutable std::mutex m_mutex {};
+    size_t m_memoryLimit {};
+    size_t m_memorySize {};
+    std::list<Entry> m_entries {};
+    std::unordered_map<std::string, std::list<Entry>::iterator> m_index {};
+
+    std::string m_directory {};
+    size_t m_diskLimit {};
+    size_t m_diskSize {};
+    std::atomic<uint64_t> m_nextTempId {};
+
+    std::atomic<uint64_t> m_hits {};
+    std::atomic<uint64_t> m_diskHits {};
+    std::atomic<uint64_t> m_misses {};
+};
+
+export DiffCache& GetDiffCache()
+{
+    static DiffCache s_diffCache {};
+    return s_diffCache;
+}
@@ -0,0 +1,80 @@
+module;
+
+#include <memory>
+#include <string>
+#include <thirdparty/libgit2/include/git2.h>
+#include <vector>
+
+export module gitkf:diff_stat;
+import :cancellation;
+import :git_smart_pointer;
+import :tree_diff;
+
+/// @brief Change of one file in a commit. oldPath differs from path for renames and copies only.
+export struct FileStat {
+    char status {};
+    std::string path {};
+    std::string oldPath {};
+    size_t additions {};
+    size_t deletions {};
+    bool binary {};
+    int similarity {};
+};
+
+/// @brief Changed files of a diff, see DiffTrees. Lines are counted by libgit2 without formatting any patch text, so
+///        the file list of a big change is ready long before its patch. Return what is counted so far if the token is
+///        cancelled.
+export std::vector<FileStat> GetDiffStat(git_diff* pDiff, CancellationToken& token)
+{
+    std::vector<FileStat> stats {};
+    for (size_t i = 0; i < git_diff_num_deltas(pDiff) && !token.IsCancelled(); ++i) {
+        std::unique_ptr<git_patch> pPatch {};
+        size_t additions {};
+        size_t deletions {};
+        // std::out_ptr stores the patch when the call's full expression ends, so it is checked separately.
+        auto error = git_patch_from_diff(std::out_ptr(pPatch), pDiff, i);
+        if (!error && pPatch) {
+            git_patch_line_stats(nullptr, &additions, &deletions, pPatch.get());
+        }
+
+        // The binary flag is known once the patch is loaded.
+        const auto* pDelta = git_diff_get_delta(pDiff, i);
+        FileStat stat {
+            .status = git_diff_status_char(pDelta->status),
+            .path = std::string { GetDeltaPath(pDelta) },
+            .additions = additions,
+            .deletions = deletions,
+            .binary = (pDelta->flags & GIT_DIFF_FLAG_BINARY) != 0,
+        };
+        if (pDelta->status == GIT_DELTA_RENAMED || pDelta->status == GIT_DELTA_COPIED) {
+            stat.oldPath = pDelta->old_file.path;
+            stat.similarity = pDelta->similarity;
+        }
+        stats.push_back(std::move(stat));
+    }
+    return stats;
+}
+
+/// @brief Changed files of a commit against its first parent. pathspec is relative to the work directory, empty means
+///        all files.
+export std::vector<FileStat> GetDiffStat(git_repository* pRepo, git_commit* pCommit, const std::string& pathspec,
+    bool ignoreWhitespace, CancellationToken& token)
+{
+    std::unique_ptr<git_tree> pTree {};
+    std::unique_ptr<git_tree> pParentTree {};
+    if (git_commit_tree(std::out_ptr(pTree), pCommit)) {
+        return {};
+    }
+    if (git_commit_parentcount(pCommit)) {
+        std::unique_ptr<git_commit> pParent {};
+        if (git_commit_parent(std::out_ptr(pParent), pCommit, 0)) {
+            return {};
+        }
+        if (git_commit_tree(std::out_ptr(pParentTree), pParent.get())) {
+            return {};
+        }
+    }
+
+    auto pDiff = DiffTrees(pRepo, pParentTree.get(), pTree.get(), pathspec, ignoreWhitespace);
+    return pDiff ? GetDiffStat(pDiff.get(), token) : std::vector<FileStat> {};
+}
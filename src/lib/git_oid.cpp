@@ -0,0 +1,22 @@
+module;
+
+#include <cstring>
+#include <functional>
+#include <thirdparty/libgit2/include/git2.h>
+
+export module gitkf:git_oid;
+
+/// @brief Hash functor for git_oid, so that oids can be used as keys of unordered containers directly instead of
+///        converting them to hex strings first. The oid is already a cryptographic hash, use its first bytes.
+export struct GitOidHash {
+    size_t operator()(const git_oid& oid) const noexcept
+    {
+        size_t hash {};
+        memcpy(&hash, oid.id, sizeof(hash));
+        return hash;
+    }
+};
+
+export struct GitOidEqual {
+    bool operator()(const git_oid& a, const git_oid& b) const noexcept { return git_oid_equal(&a, &b); }
+};
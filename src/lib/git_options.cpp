@@ -0,0 +1,103 @@
+module;
+
+#include "thirdparty/libgit2/include/git2.h"
+#include <cstddef>
+#include <format>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+export module gitkf:git_options;
+
+constexpr size_t kMiB = 1024 * 1024;
+
+/// @brief Global libgit2 options of the server. libgit2 defaults suit a short-lived command which writes objects, the
+///        server only reads, keeps repositories open for hours and walks packs with millions of objects.
+export struct GitOptions {
+    // Object cache, shared by all repositories. Objects bigger than the limit of their type are not cached.
+    size_t cacheMaxSize { 256 * kMiB };
+    size_t cacheCommitLimit { 4096 };
+    size_t cacheTreeLimit { 4096 };
+    size_t cacheTagLimit { 4096 };
+    size_t cacheBlobLimit { 0 };
+
+    // Pack files are mmapped in windows of mwindowSize, unused windows are unmapped once mwindowMappedLimit is reached,
+    // and pack files are closed once more than mwindowFileLimit are open (0 means no limit).
+    size_t mwindowSize { sizeof(void*) >= 8 ? 1024 * kMiB : 32 * kMiB };
+    size_t mwindowMappedLimit { sizeof(void*) >= 8 ? 8192 * kMiB : 256 * kMiB };
+    size_t mwindowFileLimit { 0 };
+
+    // Checks which only matter when objects are written, or the object database is not trusted.
+    bool strictObjectCreation {};
+    bool verifyObjectHashes {};
+
+    /// @brief Options of a deployment profile: "default" (libgit2 defaults, without the checks), "laptop" (low memory)
+    ///        or "server" (big shared server).
+    static GitOptions FromProfile(std::string_view profile)
+    {
+        GitOptions options {};
+        if (profile == "laptop") {
+            options.cacheMaxSize = 64 * kMiB;
+            options.mwindowSize = 32 * kMiB;
+            options.mwindowMappedLimit = 256 * kMiB;
+            options.mwindowFileLimit = 64;
+        } else if (profile == "server") {
+            // Layout of big histories looks up every commit, and monorepo trees are big.
+            options.cacheMaxSize = 2048 * kMiB;
+            options.cacheCommitLimit = 16 * 1024;
+            options.cacheTreeLimit = 256 * 1024;
+            options.mwindowMappedLimit = 32768 * kMiB;
+        } else if (profile != "default") {
+            throw std::runtime_error { std::format(
+                "Unknown git profile: {}, it must be default, laptop or server.", profile) };
+        }
+        return options;
+    }
+
+    void Apply() const
+    {
+        auto check = [](int error, std::string_view name) {
+            if (error) {
+                throw std::runtime_error { std::format("Set libgit2 option {} failed, error code: {}.", name, error) };
+            }
+        };
+        check(git_libgit2_opts(GIT_OPT_SET_CACHE_MAX_SIZE, (std::ptrdiff_t)cacheMaxSize), "cache max size");
+        check(git_libgit2_opts(GIT_OPT_SET_CACHE_OBJECT_LIMIT, GIT_OBJECT_COMMIT, cacheCommitLimit), "commit limit");
+        check(git_libgit2_opts(GIT_OPT_SET_CACHE_OBJECT_LIMIT, GIT_OBJECT_TREE, cacheTreeLimit), "tree limit");
+        check(git_libgit2_opts(GIT_OPT_SET_CACHE_OBJECT_LIMIT, GIT_OBJECT_TAG, cacheTagLimit), "tag limit");
+        check(git_libgit2_opts(GIT_OPT_SET_CACHE_OBJECT_LIMIT, GIT_OBJECT_BLOB, cacheBlobLimit), "blob limit");
+        check(git_libgit2_opts(GIT_OPT_SET_MWINDOW_SIZE, mwindowSize), "mwindow size");
+        check(git_libgit2_opts(GIT_OPT_SET_MWINDOW_MAPPED_LIMIT, mwindowMappedLimit), "mwindow mapped limit");
+        check(git_libgit2_opts(GIT_OPT_SET_MWINDOW_FILE_LIMIT, mwindowFileLimit), "mwindow file limit");
+        check(git_libgit2_opts(GIT_OPT_ENABLE_STRICT_OBJECT_CREATION, (int)strictObjectCreation), "strict objects");
+        check(git_libgit2_opts(GIT_OPT_ENABLE_STRICT_HASH_VERIFICATION, (int)verifyObjectHashes), "verify hashes");
+    }
+};
+
+/// @brief Format libgit2 options and cache usage in Prometheus text format. Values are read back from libgit2, so they
+///        are what is really in effect.
+export std::string FormatGitOptionMetrics()
+{
+    std::ptrdiff_t cachedMemory {};
+    std::ptrdiff_t cacheMaxSize {};
+    git_libgit2_opts(GIT_OPT_GET_CACHED_MEMORY, &cachedMemory, &cacheMaxSize);
+    size_t mwindowSize {};
+    size_t mwindowMappedLimit {};
+    size_t mwindowFileLimit {};
+    git_libgit2_opts(GIT_OPT_GET_MWINDOW_SIZE, &mwindowSize);
+    git_libgit2_opts(GIT_OPT_GET_MWINDOW_MAPPED_LIMIT, &mwindowMappedLimit);
+    git_libgit2_opts(GIT_OPT_GET_MWINDOW_FILE_LIMIT, &mwindowFileLimit);
+
+    std::string out {};
+    out += "# HELP gitkf_libgit2_cached_bytes Bytes of objects in the libgit2 object cache.\n";
+    out += std::format("# TYPE gitkf_libgit2_cached_bytes gauge\ngitkf_libgit2_cached_bytes {}\n", cachedMemory);
+    out += "# HELP gitkf_libgit2_option Global libgit2 options in effect.\n# TYPE gitkf_libgit2_option gauge\n";
+    auto formatOption = [&out](std::string_view name, auto value) {
+        out += std::format("gitkf_libgit2_option{{name=\"{}\"}} {}\n", name, value);
+    };
+    formatOption("cache_max_size", cacheMaxSize);
+    formatOption("mwindow_size", mwindowSize);
+    formatOption("mwindow_mapped_limit", mwindowMappedLimit);
+    formatOption("mwindow_file_limit", mwindowFileLimit);
+    return out;
+}
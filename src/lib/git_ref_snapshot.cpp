@@ -0,0 +1,205 @@
+module;
+
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thirdparty/libgit2/include/git2.h>
+#include <tuple>
+#include <unordered_map>
+
+export module gitkf:git_ref_snapshot;
+import :git_oid;
+import :git_smart_pointer;
+import :string_utils;
+
+export struct GitRef {
+    std::string name {};
+    git_oid id {};
+    bool isTag {};
+    bool isBranch {};
+    bool isRemote {};
+};
+
+/// @brief All refs of a repository at some point, keyed by the id of the commit they point to (annotated tags are
+///        peeled). A snapshot is immutable once built, so it can be shared by concurrent requests.
+export struct GitRefSnapshot {
+    std::unordered_multimap<git_oid, GitRef, GitOidHash, GitOidEqual> refs {};
+    uint64_t signature {};
+};
+
+static uint64_t HashCombine(uint64_t seed, uint64_t value)
+{
+    return seed ^ (value + 0x9e3779b97f4a7c15ull + (seed << 6) + (seed >> 2));
+}
+
+static int64_t GetLastWriteTime(const std::filesystem::path& path)
+{
+    std::error_code ec {};
+    auto time = std::filesystem::last_write_time(path, ec);
+    return ec ? 0 : (int64_t)time.time_since_epoch().count();
+}
+
+/// @brief Get a signature of the ref store under commonDir, it changes whenever a ref is created, updated or deleted.
+///        Loose refs are always updated by renaming a lock file, which touches the mtime of the containing directory,
+///        so only packed-refs and directories under refs/ need to be checked, no ref file is read.
+export uint64_t GetRefStoreSignature(const std::string& commonDir)
+{
+    auto root = std::filesystem::path { commonDir };
+    std::error_code ec {};
+    auto packedRefs = root / "packed-refs";
+    uint64_t signature = HashCombine(GetLastWriteTime(packedRefs), std::filesystem::file_size(packedRefs, ec));
+
+    auto refsDir = root / "refs";
+    signature = HashCombine(signature, GetLastWriteTime(refsDir));
+    for (auto it = std::filesystem::recursive_directory_iterator { refsDir, ec };
+        it != std::filesystem::recursive_directory_iterator {}; it.increment(ec)) {
+        if (ec) {
+            break;
+        }
+        if (it->is_directory(ec)) {
+            signature = HashCombine(signature, std::hash<std::string> {}(it->path().generic_string()));
+            signature = HashCombine(signature, GetLastWriteTime(it->path()));
+        }
+    }
+    return signature;
+}
+
+static void AddRef(GitRefSnapshot& snapshot, std::string_view name, const git_oid& id)
+{
+    GitRef ref {};
+    ref.name = TrimLeft(std::string { name }, { "refs/heads/", "refs/remotes/", "refs/tags/" });
+    ref.id = id;
+    ref.isTag = name.starts_with("refs/tags/");
+    ref.isBranch = name.starts_with("refs/heads/");
+    ref.isRemote = name.starts_with("refs/remotes/");
+    snapshot.refs.emplace(id, std::move(ref));
+}
+
+/// @brief Peel annotated tag to the object it points to. Only the object header is read for non-tag objects.
+static git_oid Peel(git_repository* pRepo, git_odb* pOdb, const git_oid& id)
+{
+    size_t size {};
+    git_object_t type {};
+    if (!pOdb || git_odb_read_header(&size, &type, pOdb, &id) || type != GIT_OBJECT_TAG) {
+        return id;
+    }
+
+    std::unique_ptr<git_object> pObject {};
+    std::unique_ptr<git_object> pPeeled {};
+    if (git_object_lookup(std::out_ptr(pObject), pRepo, &id, GIT_OBJECT_TAG)) {
+        return id;
+    }
+    if (git_object_peel(std::out_ptr(pPeeled), pObject.get(), GIT_OBJECT_ANY)) {
+        return id;
+    }
+    return *git_object_id(pPeeled.get());
+}
+
+/// @brief Fallback for ref backends other than files (e.g. reftable).
+static void ReadRefsFromLibgit2(GitRefSnapshot& snapshot, git_repository* pRepo, git_odb* pOdb)
+{
+    auto payload = std::make_tuple(&snapshot, pRepo, pOdb);
+    git_reference_foreach(
+        pRepo,
+        [](git_reference* pReference, void* payload) {
+            auto& [pSnapshot, pRepo, pOdb] = *(std::tuple<GitRefSnapshot*, git_repository*, git_odb*>*)payload;
+            auto name = git_reference_name(pReference);
+            git_oid oid {};
+            if (!git_reference_name_to_id(&oid, pRepo, name)) {
+                AddRef(*pSnapshot, name, Peel(pRepo, pOdb, oid));
+            }
+            git_reference_free(pReference);
+            return 0;
+        },
+        &payload);
+}
+
+/// @brief Build ref snapshot by reading packed-refs in a single pass, then overlaying loose refs found under refs/.
+export std::shared_ptr<const GitRefSnapshot> BuildGitRefSnapshot(git_repository* pRepo, uint64_t signature)
+{
+    auto pSnapshot = std::make_shared<GitRefSnapshot>();
+    pSnapshot->signature = signature;
+
+    std::unique_ptr<git_odb> pOdbHolder {};
+    git_repository_odb(std::out_ptr(pOdbHolder), pRepo);
+    auto* pOdb = pOdbHolder.get();
+
+    auto root = std::filesystem::path { git_repository_commondir(pRepo) };
+    std::error_code ec {};
+    if (std::filesystem::exists(root / "reftable", ec)) {
+        ReadRefsFromLibgit2(*pSnapshot, pRepo, pOdb);
+        return pSnapshot;
+    }
+
+    // Read packed-refs. Line format is "<id> <name>", optionally followed by "^<peeled id>" if the ref is a tag.
+    std::unordered_map<std::string, std::pair<git_oid, bool>> refs {};
+    std::string packedRefs {};
+    if (std::ifstream in { root / "packed-refs", std::ios::binary }) {
+        std::ostringstream buffer {};
+        buffer << in.rdbuf();
+        packedRefs = std::move(buffer).str();
+    }
+
+    bool fullyPeeled {};
+    std::pair<git_oid, bool>* pLastRef {};
+    auto content = std::string_view { packedRefs };
+    while (!content.empty()) {
+        auto end = content.find('\n');
+        auto line = content.substr(0, end);
+        content = end == std::string_view::npos ? std::string_view {} : content.substr(end + 1);
+
+        git_oid oid {};
+        if (line.starts_with('#')) {
+            fullyPeeled = line.find(" fully-peeled") != std::string_view::npos;
+        } else if (line.starts_with('^') && line.size() >= 41 && pLastRef) {
+            if (!git_oid_fromstrn(&oid, line.data() + 1, 40)) {
+                *pLastRef = { oid, /*peeled=*/true };
+            }
+        } else if (line.size() > 41 && line[40] == ' ' && !git_oid_fromstrn(&oid, line.data(), 40)) {
+            auto name = line.substr(41);
+            auto& ref = refs[std::string { name }];
+            ref = { oid, /*peeled=*/fullyPeeled || !name.starts_with("refs/tags/") };
+            pLastRef = &ref;
+            continue;
+        }
+        pLastRef = nullptr;
+    }
+
+    // Loose refs override packed ones.
+    for (auto it = std::filesystem::recursive_directory_iterator { root / "refs", ec };
+        it != std::filesystem::recursive_directory_iterator {}; it.increment(ec)) {
+        if (ec) {
+            break;
+        }
+        if (!it->is_regular_file(ec) || it->path().extension() == ".lock") {
+            continue;
+        }
+
+        auto name = std::filesystem::relative(it->path(), root, ec).generic_string();
+        std::string line {};
+        if (std::ifstream in { it->path(), std::ios::binary }; !std::getline(in, line)) {
+            continue;
+        }
+
+        git_oid oid {};
+        if (line.starts_with("ref: ")) {
+            // Symbolic ref, e.g. refs/remotes/origin/HEAD, let libgit2 resolve it.
+            if (!git_reference_name_to_id(&oid, pRepo, name.c_str())) {
+                refs[name] = { oid, /*peeled=*/!name.starts_with("refs/tags/") };
+            }
+        } else if (line.size() >= 40 && !git_oid_fromstrn(&oid, line.data(), 40)) {
+            refs[name] = { oid, /*peeled=*/!name.starts_with("refs/tags/") };
+        }
+    }
+
+    pSnapshot->refs.reserve(refs.size());
+    for (auto& [name, ref] : refs) {
+        AddRef(*pSnapshot, name, ref.second ? ref.first : Peel(pRepo, pOdb, ref.first));
+    }
+    return pSnapshot;
+}
@@ -1,5 +1,6 @@
 module;
 
+#include <algorithm>
 #include <filesystem>
 #include <format>
 #include <memory>
@@ -9,20 +10,17 @@ module;
 #include <string_view>
 #include <thirdparty/libgit2/include/git2.h>
 #include <unordered_map>
+#include <utility>
+#include <vector>
 
 export module gitkf:git_repository;
 import :client_exception;
+import :git_ref_snapshot;
 import :git_smart_pointer;
+import :metrics;
+import :repository_watcher;
 import :ring_buffer;
-import :string_utils;
-
-export struct GitRef {
-    std::string name {};
-    std::string id {};
-    bool isTag {};
-    bool isBranch {};
-    bool isRemote {};
-};
+import :search_index;
 
 export template <size_t N>
 std::string GitHashToString(const unsigned char (&hash)[N])
@@ -64,52 +62,98 @@ public:
     const std::string& GetRepoRoot() const { return m_repoPath; }
     const std::string& GetRepoWorkDir() const { return m_workDir; }
 
-    std::unordered_multimap<std::string, GitRef> GetRefs()
+    /// @brief Get the watcher of this repository, it is started when it is first used and stopped when the repository
+    ///        is evicted from the cache.
+    RepositoryWatcher& GetWatcher()
     {
-        std::unordered_multimap<std::string, GitRef> refs {};
-        auto payload = std::make_pair(&refs, m_pRepo.get());
-        git_reference_foreach(
-            m_pRepo.get(),
-            [](git_reference* pReference, void* payload) {
-                auto pPair = (std::pair<std::unordered_multimap<std::string, GitRef>*, git_repository*>*)payload;
-                auto* pRefs = pPair->first;
-                auto* pRepo = pPair->second;
-                auto name = git_reference_name(pReference);
-                git_oid oid {};
-                git_reference_name_to_id(&oid, pRepo, name);
-                auto id = GitHashToString(oid.id);
-                GitRef ref {};
-                ref.name = TrimLeft(name, { "refs/heads/", "refs/remotes/", "refs/tags/" });
-                ref.id = id;
-                ref.isTag = git_reference_is_tag(pReference);
-                ref.isBranch = git_reference_is_branch(pReference);
-                ref.isRemote = git_reference_is_remote(pReference);
-                pRefs->emplace(std::move(id), std::move(ref));
-                git_reference_free(pReference);
-                return 0;
-            },
-            &payload);
-        return refs;
+        std::call_once(m_watcherOnce, [this] {
+            auto commonDir = std::string { git_repository_commondir(m_pRepo.get()) };
+            while (commonDir.ends_with('/')) {
+                commonDir.pop_back();
+            }
+            m_pWatcher = std::make_unique<RepositoryWatcher>(m_repoPath, std::move(commonDir));
+        });
+        return *m_pWatcher;
+    }
+
+    /// @brief Get the full-text search index of this repository, it is stored under "<git dir>/gitkf/" and loaded when
+    ///        it is first used.
+    SearchIndex& GetSearchIndex()
+    {
+        std::call_once(m_searchIndexOnce, [this] {
+            m_pSearchIndex = std::make_unique<SearchIndex>(
+                (std::filesystem::path { m_repoPath } / "gitkf" / "search-index").string());
+        });
+        return *m_pSearchIndex;
+    }
+
+    /// @brief Get the refs of the repository. The snapshot is rebuilt only when the ref store changed since last time
+    ///        (see GetRefStoreSignature), otherwise the cached one is returned. While the watcher is watching, the
+    ///        snapshot is reused as long as its generation is the same, and refs/ is not walked at all.
+    std::shared_ptr<const GitRefSnapshot> GetRefSnapshot()
+    {
+        auto& watcher = GetWatcher();
+        auto generation = watcher.GetGeneration();
+        if (watcher.IsWatching()) {
+            std::shared_lock read_lock { m_refSnapshotMutex };
+            if (m_pRefSnapshot && m_refSnapshotGeneration == generation) {
+                return m_pRefSnapshot;
+            }
+        }
+
+        // The generation is read first, a change made meanwhile is caught by the signature next time.
+        auto signature = GetRefStoreSignature(git_repository_commondir(m_pRepo.get()));
+        {
+            std::shared_lock read_lock { m_refSnapshotMutex };
+            if (m_pRefSnapshot && m_pRefSnapshot->signature == signature && m_refSnapshotGeneration == generation) {
+                return m_pRefSnapshot;
+            }
+        }
+
+        std::unique_lock write_lock { m_refSnapshotMutex };
+        if (!m_pRefSnapshot || m_pRefSnapshot->signature != signature) {
+            m_pRefSnapshot = BuildGitRefSnapshot(m_pRepo.get(), signature);
+        }
+        m_refSnapshotGeneration = generation;
+        return m_pRefSnapshot;
     }
 
 private:
     std::string m_repoPath {};
     std::string m_workDir {};
     std::unique_ptr<git_repository> m_pRepo {};
+    std::shared_mutex m_refSnapshotMutex {};
+    std::shared_ptr<const GitRefSnapshot> m_pRefSnapshot {};
+    uint64_t m_refSnapshotGeneration {};
+    std::once_flag m_searchIndexOnce {};
+    std::unique_ptr<SearchIndex> m_pSearchIndex {};
+    std::once_flag m_watcherOnce {};
+    std::unique_ptr<RepositoryWatcher> m_pWatcher {};
 };
 
-export std::shared_ptr<GitRepository> GetSharedGitRepository(const std::string& repoPath)
+/// @brief Get the repository shared by all requests. Pinned repositories (pin is true) are kept open for good, others
+///        are kept in a cache of the most recently opened ones.
+export std::shared_ptr<GitRepository> GetSharedGitRepository(const std::string& repoPath, bool pin = false)
 {
     static std::shared_mutex s_repository_cache_mutex {};
+    static std::unordered_map<std::string, std::shared_ptr<GitRepository>> s_pinned_repos {};
     static ring_buffer<std::pair<std::string, std::shared_ptr<GitRepository>>, 50> s_repo_cache;
 
-    // If the repository existed in the cache, return it.
-    {
-        std::shared_lock read_lock { s_repository_cache_mutex };
+    auto find = [&repoPath]() -> std::shared_ptr<GitRepository> {
+        if (auto it = s_pinned_repos.find(repoPath); it != s_pinned_repos.end()) {
+            return it->second;
+        }
         auto it = std::find_if(
             s_repo_cache.begin(), s_repo_cache.end(), [&repoPath](const auto& pair) { return pair.first == repoPath; });
-        if (it != s_repo_cache.end()) {
-            return it->second;
+        return it != s_repo_cache.end() ? it->second : nullptr;
+    };
+
+    // If the repository existed in the cache, return it.
+    if (!pin) {
+        std::shared_lock read_lock { s_repository_cache_mutex };
+        if (auto pRepo = find()) {
+            ++GetMetrics().repositoryCacheHits;
+            return pRepo;
         }
     }
 
@@ -117,14 +161,44 @@ export std::shared_ptr<GitRepository> GetSharedGitRepository(const std::string&
     std::unique_lock write_lock { s_repository_cache_mutex };
 
     // Maybe added by other thread already, let's double check.
-    auto it = std::find_if(
-        s_repo_cache.begin(), s_repo_cache.end(), [&repoPath](const auto& pair) { return pair.first == repoPath; });
-    if (it != s_repo_cache.end()) {
-        return it->second;
+    auto pRepo = find();
+    if (pRepo) {
+        ++GetMetrics().repositoryCacheHits;
+    } else {
+        // Really create a new one.
+        ++GetMetrics().repositoryCacheMisses;
+        pRepo = std::make_shared<GitRepository>(repoPath);
+        if (!pin) {
+            s_repo_cache.push_front(std::make_pair(repoPath, pRepo));
+        }
+    }
+    if (pin) {
+        s_pinned_repos.emplace(repoPath, pRepo);
     }
-
-    // Really create a new one.
-    auto pRepo = std::make_shared<GitRepository>(repoPath);
-    s_repo_cache.push_front(std::make_pair(repoPath, pRepo));
     return pRepo;
-}
\ No newline at end of file
+}
+
+/// @brief libgit2 objects can't be shared between threads safely, every worker thread opens its own repository. Only
+///        the few most recently used ones are kept open per thread, pool threads outlive the repositories they served.
+///        Return nullptr if the repository can't be opened.
+export git_repository* GetThreadLocalRepository(const std::string& repoRoot)
+{
+    constexpr size_t kMaxRepositoriesPerThread = 4;
+    thread_local std::vector<std::pair<std::string, std::unique_ptr<git_repository>>> s_repos {};
+
+    auto it = std::ranges::find_if(s_repos, [&repoRoot](const auto& pair) { return pair.first == repoRoot; });
+    if (it != s_repos.end()) {
+        std::rotate(s_repos.begin(), it, it + 1);
+        return s_repos.front().second.get();
+    }
+
+    std::unique_ptr<git_repository> pRepo {};
+    if (git_repository_open(std::out_ptr(pRepo), repoRoot.c_str())) {
+        return nullptr;
+    }
+    if (s_repos.size() == kMaxRepositoriesPerThread) {
+        s_repos.pop_back();
+    }
+    s_repos.emplace(s_repos.begin(), repoRoot, std::move(pRepo));
+    return s_repos.front().second.get();
+}
@@ -5,6 +5,11 @@ module;
 
 export module gitkf:git_smart_pointer;
 
+template <>
+struct std::default_delete<git_blob> {
+    void operator()(git_blob* p) const { git_blob_free(p); }
+};
+
 template <>
 struct std::default_delete<git_buf> {
     void operator()(git_buf* p) const { git_buf_dispose(p); }
@@ -20,12 +25,37 @@ struct std::default_delete<git_diff> {
     void operator()(git_diff* p) const { git_diff_free(p); }
 };
 
+template <>
+struct std::default_delete<git_object> {
+    void operator()(git_object* p) const { git_object_free(p); }
+};
+
+template <>
+struct std::default_delete<git_odb> {
+    void operator()(git_odb* p) const { git_odb_free(p); }
+};
+
+template <>
+struct std::default_delete<git_patch> {
+    void operator()(git_patch* p) const { git_patch_free(p); }
+};
+
 template <>
 struct std::default_delete<git_repository> {
     void operator()(git_repository* p) const { git_repository_free(p); }
 };
 
+template <>
+struct std::default_delete<git_revwalk> {
+    void operator()(git_revwalk* p) const { git_revwalk_free(p); }
+};
+
 template <>
 struct std::default_delete<git_tree> {
     void operator()(git_tree* p) const { git_tree_free(p); }
 };
+
+template <>
+struct std::default_delete<git_tree_entry> {
+    void operator()(git_tree_entry* p) const { git_tree_entry_free(p); }
+};
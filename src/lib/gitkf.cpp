@@ -4,10 +4,23 @@ module;
 #include "thirdparty/httplib.h"
 #include "thirdparty/json.hpp"
 #include "thirdparty/libgit2/include/git2.h"
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <chrono>
 #include <cstdio>
+#include <cstring>
 #include <ctime>
+#include <exception>
 #include <filesystem>
 #include <format>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <regex>
+#include <thread>
 #include <unordered_map>
 
 #define const const char*
@@ -15,25 +28,47 @@ module;
 #undef const
 
 export module gitkf:gitkf;
+import :blame;
+import :cancellation;
 import :client_exception;
+import :combined_diff;
+import :control_socket;
+import :diff_cache;
+import :diff_stat;
+import :event_stream_server;
+import :git_options;
+import :git_ref_snapshot;
 import :git_smart_pointer;
 import :git_repository;
 import :line_reader;
+import :memory_budget;
+import :metrics;
 import :option;
+import :pickaxe;
 import :platform_utils;
+import :server_task_queue;
+import :spill_buffer;
+import :thread_pool;
+import :tracing;
+import :tree_diff;
+import :warmup;
+import :word_diff;
 
 using json = nlohmann::json;
 
 const int kNoParent = -1;
 const int kNotInTheRange = -2;
-const std::string_view kPatchFileDiffHeaderLine = "diff --git a/";
+constexpr std::string_view kPatchFileDiffSeparator = "\ndiff --git a/";
+constexpr std::string_view kPatchFileDiffHeaderLine = kPatchFileDiffSeparator.substr(1);
+constexpr std::string_view kPatchCombinedDiffSeparator = "\ndiff --cc ";
+constexpr std::string_view kPatchCombinedDiffHeaderLine = kPatchCombinedDiffSeparator.substr(1);
 
 struct GitCommit {
     std::string id {};
-    std::vector<GitRef*> refs {};
+    std::vector<const GitRef*> refs {};
     git_commit* commit {};
     int column { -1 };
-    int parentIndexes[2] = { kNoParent, kNoParent };
+    std::vector<int> parentIndexes {};
     int minReservedColumn {};
     int maxReservedColumn { -1 };
 };
@@ -88,7 +123,7 @@ json serialize(const GitCommit& commit, bool graphInfoOnly)
     auto r = graphInfoOnly ? json {} : serialize(commit.commit);
     r["id"] = commit.id;
     r["column"] = commit.column;
-    r["parentIndexes"] = { commit.parentIndexes[0], commit.parentIndexes[1] };
+    r["parentIndexes"] = commit.parentIndexes;
     r["minReservedColumn"] = commit.minReservedColumn;
     r["maxReservedColumn"] = commit.maxReservedColumn;
 
@@ -118,31 +153,161 @@ std::string serialize(
     return dump(j);
 }
 
-json parse_patch(std::string filename, std::vector<std::string> diffs)
+/// @brief Options of a parsed patch. Diff lines of a file beyond maxFileLines or maxFileBytes are dropped, and so are
+///        the rest of a file once the reservation can't grow for its next chunk. Such files are marked with the number
+///        of dropped lines in "truncated", and where to go on in "continuation", which the client passes back with the
+///        file name to get the next part. If summarizeMinified is set, files with very long lines only get their
+///        header, and are marked "minified". If split is set, hunks are parsed into aligned rows for a side-by-side
+///        view, see parse_split_patch().
+struct PatchOptions {
+    size_t maxFileBytes { std::numeric_limits<size_t>::max() };
+    size_t maxFileLines { std::numeric_limits<size_t>::max() };
+    bool summarizeMinified {};
+    MemoryReservation* pReservation {};
+    bool split {};
+
+    // If file is set, other files are skipped, and the diff of file starts from continuation.
+    std::string_view file {};
+    size_t continuation {};
+};
+
+/// @brief Split the first line (with its '\n') off text.
+static std::string_view TakeLine(std::string_view& text)
 {
-    auto header = std::format("-------------------------------- {} --------------------------------\n", filename);
+    auto pEnd = (const char*)std::memchr(text.data(), '\n', text.size());
+    auto line = text.substr(0, pEnd ? pEnd - text.data() + 1 : text.size());
+    text.remove_prefix(line.size());
+    return line;
+}
 
-    auto i = 0u;
+/// @brief Position of the first hunk in the diff of a file, the lines before it are the header. Hunks of combined
+///        diffs of merges start with "@@@".
+static size_t find_first_hunk(std::string_view diff)
+{
+    auto pos = diff.starts_with("@@") ? 0 : diff.find("\n@@");
+    return pos == std::string_view::npos ? diff.size() : pos + (pos != 0);
+}
 
-    // Parse header.
-    for (; i < diffs.size(); ++i) {
-        if (diffs[i].starts_with("@@ ")) {
-            break;
+/// @brief Number of columns of +/- marks of the lines of a file diff, one per parent in a combined diff of a merge,
+///        whose hunks start with one '@' more than there are parents.
+static size_t count_patch_columns(std::string_view diff)
+{
+    auto markers = diff.substr(find_first_hunk(diff)).find_first_not_of('@');
+    return markers == std::string_view::npos || markers < 3 ? 1 : markers - 1;
+}
+
+/// @brief Position of the '\n' before the next file patch from pos on, "diff --git" or "diff --cc" of a merge.
+static size_t find_next_file_patch(std::string_view output, size_t pos)
+{
+    return std::min(output.find(kPatchFileDiffSeparator, pos), output.find(kPatchCombinedDiffSeparator, pos));
+}
+
+static json create_header_chunk(std::string_view filename, std::string_view header)
+{
+    auto content = std::format("-------------------------------- {} --------------------------------\n", filename);
+    content += header;
+    if (!content.ends_with('\n')) {
+        content += '\n';
+    }
+
+    json chunk {};
+    chunk["type"] = "header";
+    chunk["content"] = std::move(content);
+    return chunk;
+}
+
+static size_t count_lines(std::string_view text)
+{
+    return std::count(text.begin(), text.end(), '\n') + (!text.empty() && !text.ends_with('\n'));
+}
+
+/// @brief End of the part of a file diff which is sent from begin, within maxFileLines and maxFileBytes. There is at
+///        least one line, so every continuation makes progress.
+static size_t find_patch_end(std::string_view diff, size_t begin, const PatchOptions& options)
+{
+    auto rest = diff.substr(begin);
+    for (size_t lines {}; !rest.empty() && lines < options.maxFileLines; ++lines) {
+        auto pos = diff.size() - rest.size();
+        auto line = TakeLine(rest);
+        if (lines && pos + line.size() - begin > options.maxFileBytes) {
+            return pos;
         }
+    }
+    return diff.size() - rest.size();
+}
+
+/// @brief Whether lines of a diff are so long (minified or generated code) that showing them is slow and pointless.
+static bool is_minified(std::string_view lines)
+{
+    constexpr size_t kMinifiedLineBytes = 500;
+    return lines.size() > count_lines(lines) * kMinifiedLineBytes;
+}
+
+/// @brief Whether the header of a file diff says it is binary, git doesn't show the diff of binary files then.
+static bool is_binary(std::string_view header)
+{
+    return header.starts_with("Binary files ") || header.find("\nBinary files ") != std::string_view::npos;
+}
 
-        header += diffs[i];
-        header += '\n';
+/// @brief Parse "@@ -oldLine[,count] +newLine[,count] @@ context".
+static void parse_hunk_header(std::string_view line, int& oldLine, int& newLine)
+{
+    auto oldPos = line.find(" -");
+    auto newPos = line.find(" +");
+    oldLine = newLine = 1;
+    if (oldPos != std::string_view::npos && newPos != std::string_view::npos) {
+        std::from_chars(line.data() + oldPos + 2, line.data() + line.size(), oldLine);
+        std::from_chars(line.data() + newPos + 2, line.data() + line.size(), newLine);
     }
+}
 
-    json patch {};
-    patch["filename"] = std::move(filename);
+/// @brief Pair the lines of a delete chunk with the lines of the add chunk after it, and mark the changed words of each
+///        pair in "spans" of the chunks: [begin, end, begin, end, ...] in UTF-16 code units of the content, so the
+///        browser only has to wrap them.
+void add_word_spans(json& deleteChunk, json& addChunk, std::string_view deleteContent, std::string_view addContent,
+    size_t& budget)
+{
+    // Skip the '-' or '+', and the '\n'.
+    auto lineText = [](std::string_view line) {
+        line.remove_prefix(1);
+        return line.ends_with('\n') ? line.substr(0, line.size() - 1) : line;
+    };
+
+    std::vector<size_t> deleteSpans {};
+    std::vector<size_t> addSpans {};
+    auto deleteRest = deleteContent;
+    auto addRest = addContent;
+    while (!deleteRest.empty() && !addRest.empty() && budget) {
+        auto deletePos = deleteContent.size() - deleteRest.size() + 1;
+        auto addPos = addContent.size() - addRest.size() + 1;
+        auto wordDiff = DiffWords(lineText(TakeLine(deleteRest)), lineText(TakeLine(addRest)), budget);
+        if (!wordDiff) {
+            continue;
+        }
+        for (auto [begin, end] : wordDiff->oldRanges) {
+            deleteSpans.insert(deleteSpans.end(), { deletePos + begin, deletePos + end });
+        }
+        for (auto [begin, end] : wordDiff->newRanges) {
+            addSpans.insert(addSpans.end(), { addPos + begin, addPos + end });
+        }
+    }
 
-    json chunks {};
-    json headerChunk {};
-    headerChunk["type"] = "header";
-    headerChunk["content"] = std::move(header);
-    chunks.push_back(std::move(headerChunk));
+    if (!deleteSpans.empty()) {
+        ToUtf16Offsets(deleteContent, deleteSpans);
+        deleteChunk["spans"] = std::move(deleteSpans);
+    }
+    if (!addSpans.empty()) {
+        ToUtf16Offsets(addContent, addSpans);
+        addChunk["spans"] = std::move(addSpans);
+    }
+}
 
+/// @brief Parse lines [begin, end) of the diff of one file, i.e. the lines after its "diff --git" line, the rest are
+///        truncated. Lines are classified in one pass, and every chunk is a slice of diff which is copied once, into
+///        the json. The header of the file is only added to its first part.
+json parse_patch(
+    std::string_view filename, std::string_view diff, size_t begin, size_t end, const PatchOptions& options)
+{
     enum class ChunkType {
         Default,
         Statistics,
@@ -168,68 +333,314 @@ json parse_patch(std::string filename, std::vector<std::string> diffs)
     };
 
     auto createChunk = [&chunkTypeToString](ChunkType type, std::string content) {
+        if (!content.ends_with('\n')) {
+            content += '\n';
+        }
         json chunk {};
         chunk["type"] = chunkTypeToString(type);
         chunk["content"] = std::move(content);
         return chunk;
     };
 
-    ChunkType currentChunkType {};
-    std::string currentContent {};
-    for (; i < diffs.size(); ++i) {
-        ChunkType type {};
-        if (diffs[i].starts_with("@@ ")) {
-            type = ChunkType::Statistics;
-        } else {
-            auto ch = *diffs[i].c_str();
-            type = ch == '+' ? ChunkType::Add : (ch == '-' ? ChunkType::Delete : ChunkType::Default);
+    json chunks = json::array();
+    if (!options.continuation) {
+        chunks.push_back(create_header_chunk(filename, diff.substr(0, find_first_hunk(diff))));
+    }
+
+    // Lines of a combined diff have a column per parent, they are added or deleted if any column says so.
+    auto columns = count_patch_columns(diff);
+
+    size_t truncatedLines {};
+    size_t continuation {};
+    auto truncate = [&](size_t pos) {
+        truncatedLines = count_lines(diff.substr(pos));
+        continuation = pos;
+    };
+
+    // Changed words are marked for delete chunks followed by add chunks, the cost of it is bounded per hunk.
+    constexpr size_t kWordDiffBudget = 20000;
+    size_t wordDiffBudget { kWordDiffBudget };
+    std::optional<size_t> deleteChunkIndex {};
+    std::string_view deleteContent {};
+
+    // Lines of a chunk are adjacent in diff, a chunk ends where the type of a line changes.
+    auto pushChunk = [&](ChunkType type, size_t begin, size_t end) {
+        if (options.pReservation && !options.pReservation->TryGrow(end - begin)) {
+            truncate(begin);
+            return false;
+        }
+        auto content = diff.substr(begin, end - begin);
+        chunks.push_back(createChunk(type, std::string { content }));
+        if (type == ChunkType::Statistics) {
+            wordDiffBudget = kWordDiffBudget;
+        } else if (type == ChunkType::Add && deleteChunkIndex && columns == 1) {
+            add_word_spans(chunks[*deleteChunkIndex], chunks.back(), deleteContent, content, wordDiffBudget);
         }
-        if (type != currentChunkType) {
-            if (!currentContent.empty()) {
-                chunks.push_back(createChunk(currentChunkType, std::move(currentContent)));
-                assert(currentContent.empty());
+        deleteChunkIndex = type == ChunkType::Delete ? std::optional { chunks.size() - 1 } : std::nullopt;
+        deleteContent = content;
+        return true;
+    };
+
+    auto rest = diff.substr(begin, end - begin);
+    auto chunkType = ChunkType::Default;
+    auto chunkBegin = begin;
+    while (!rest.empty()) {
+        auto pos = end - rest.size();
+        auto line = TakeLine(rest);
+        auto marks = line.substr(0, columns);
+        auto type = line.starts_with("@@") ? ChunkType::Statistics
+            : marks.find('+') != std::string_view::npos ? ChunkType::Add
+            : marks.find('-') != std::string_view::npos ? ChunkType::Delete
+                                                        : ChunkType::Default;
+        if (type != chunkType) {
+            if (pos != chunkBegin && !pushChunk(chunkType, chunkBegin, pos)) {
+                chunkBegin = end;
+                break;
             }
-            currentChunkType = type;
+            chunkType = type;
+            chunkBegin = pos;
         }
-        currentContent += diffs[i];
-        currentContent += '\n';
     }
-
-    if (!currentContent.empty()) {
-        chunks.push_back(createChunk(currentChunkType, std::move(currentContent)));
+    if (chunkBegin != end) {
+        pushChunk(chunkType, chunkBegin, end);
+    }
+    if (!truncatedLines && end < diff.size()) {
+        truncate(end);
     }
+
+    json patch {};
+    patch["filename"] = filename;
     patch["chunks"] = std::move(chunks);
+    if (truncatedLines) {
+        patch["truncated"] = truncatedLines;
+        patch["continuation"] = continuation;
+        ++GetMetrics().truncatedFiles;
+    }
     return patch;
 }
 
-json parse_patch(const std::string& str)
+/// @brief Parse the diff of one file into rows of a side-by-side view, so the browser does no alignment. Every hunk is
+///        {"header": "@@ ... @@", "rows": [...]}, and a row is one of:
+///          [" ", oldLine, newLine, text]                                  unchanged line
+///          ["~", oldLine, newLine, oldText, newText, oldSpans, newSpans]  replaced line, spans as in add_word_spans()
+///          ["-", oldLine, text]                                           deleted line
+///          ["+", newLine, text]                                           added line
+///        Deleted lines are paired with the added lines after them in order, the rest are shown alone. Lines [begin,
+///        end) are parsed as in parse_patch(), a part which starts inside a hunk repeats the header of the hunk.
+json parse_split_patch(
+    std::string_view filename, std::string_view diff, size_t begin, size_t end, const PatchOptions& options)
 {
-    json patch {};
-    std::istringstream in { str };
-    std::string line;
-    while (!line.empty() || std::getline(in, line)) {
-        while (!line.starts_with(kPatchFileDiffHeaderLine)) {
-            if (!std::getline(in, line)) {
-                return patch;
+    constexpr size_t kWordDiffBudget = 20000;
+
+    json chunks = json::array();
+    if (!options.continuation) {
+        chunks.push_back(create_header_chunk(filename, diff.substr(0, find_first_hunk(diff))));
+    }
+
+    // Skip the '-', '+' or ' ', and the '\n'.
+    auto lineText = [](std::string_view line) {
+        line.remove_prefix(1);
+        return line.ends_with('\n') ? line.substr(0, line.size() - 1) : line;
+    };
+
+    json hunks = json::array();
+    json rows = json::array();
+    std::string_view hunkHeader {};
+    std::vector<std::string_view> deletes {};
+    std::vector<std::string_view> adds {};
+    int oldLine {};
+    int newLine {};
+    size_t wordDiffBudget { kWordDiffBudget };
+    auto flushChanges = [&]() {
+        for (size_t i = 0; i < std::max(deletes.size(), adds.size()); ++i) {
+            if (i >= adds.size()) {
+                rows.push_back({ "-", oldLine++, lineText(deletes[i]) });
+            } else if (i >= deletes.size()) {
+                rows.push_back({ "+", newLine++, lineText(adds[i]) });
+            } else {
+                auto oldText = lineText(deletes[i]);
+                auto newText = lineText(adds[i]);
+                std::vector<size_t> oldSpans {};
+                std::vector<size_t> newSpans {};
+                if (auto wordDiff = wordDiffBudget ? DiffWords(oldText, newText, wordDiffBudget) : std::nullopt) {
+                    for (auto [begin, end] : wordDiff->oldRanges) {
+                        oldSpans.insert(oldSpans.end(), { begin, end });
+                    }
+                    for (auto [begin, end] : wordDiff->newRanges) {
+                        newSpans.insert(newSpans.end(), { begin, end });
+                    }
+                    ToUtf16Offsets(oldText, oldSpans);
+                    ToUtf16Offsets(newText, newSpans);
+                }
+                rows.push_back({ "~", oldLine++, newLine++, oldText, newText, oldSpans, newSpans });
             }
         }
+        deletes.clear();
+        adds.clear();
+    };
+    auto flushHunk = [&]() {
+        flushChanges();
+        if (!rows.empty()) {
+            json hunk {};
+            hunk["header"] = hunkHeader;
+            hunk["rows"] = std::move(rows);
+            hunks.push_back(std::move(hunk));
+            rows = json::array();
+        }
+    };
 
-        // Find a file patch, get file name first.
-        auto spacePos = line.find(' ', kPatchFileDiffHeaderLine.size());
-        if (spacePos == std::string::npos) {
-            // Invalid diff format.
-            continue;
+    // Line numbers of a part which starts inside a hunk are counted from the header of the hunk.
+    if (begin < end && !diff.substr(begin).starts_with("@@ ")) {
+        auto hunkBegin = diff.substr(0, begin).rfind("\n@@ ");
+        auto lines = diff.substr(hunkBegin == std::string_view::npos ? 0 : hunkBegin + 1);
+        lines = lines.substr(0, begin - (diff.size() - lines.size()));
+        auto line = TakeLine(lines);
+        hunkHeader = line.substr(0, line.size() - line.ends_with('\n'));
+        parse_hunk_header(line, oldLine, newLine);
+        while (!lines.empty()) {
+            line = TakeLine(lines);
+            oldLine += line[0] == '-' || line[0] == ' ';
+            newLine += line[0] == '+' || line[0] == ' ';
+        }
+    }
+
+    size_t truncatedLines {};
+    size_t continuation {};
+    auto rest = diff.substr(begin, end - begin);
+    while (!rest.empty()) {
+        auto pos = end - rest.size();
+        auto line = TakeLine(rest);
+        if (options.pReservation && !options.pReservation->TryGrow(line.size())) {
+            truncatedLines = count_lines(diff.substr(pos));
+            continuation = pos;
+            break;
+        }
+
+        if (line.starts_with("@@ ")) {
+            flushHunk();
+            hunkHeader = line.substr(0, line.size() - line.ends_with('\n'));
+            parse_hunk_header(line, oldLine, newLine);
+            wordDiffBudget = kWordDiffBudget;
+        } else if (line[0] == '-') {
+            if (!adds.empty()) {
+                flushChanges();
+            }
+            deletes.push_back(line);
+        } else if (line[0] == '+') {
+            adds.push_back(line);
+        } else if (line[0] == ' ') {
+            flushChanges();
+            rows.push_back({ " ", oldLine++, newLine++, lineText(line) });
+        }
+    }
+    flushHunk();
+    if (!truncatedLines && end < diff.size()) {
+        truncatedLines = count_lines(diff.substr(end));
+        continuation = end;
+    }
+
+    json patch {};
+    patch["filename"] = filename;
+    patch["chunks"] = std::move(chunks);
+    patch["hunks"] = std::move(hunks);
+    if (truncatedLines) {
+        patch["truncated"] = truncatedLines;
+        patch["continuation"] = continuation;
+        ++GetMetrics().truncatedFiles;
+    }
+    return patch;
+}
+
+/// @brief Name of the file of a patch. "diff --git a/<old> b/<new>" is ambiguous if names have spaces, so the name is
+///        taken from the "+++ b/", "rename to" or "copy to" line of the header, or "--- a/" for deleted files. Without
+///        them (mode changes, binary files) both names are the same, so the first line is split in the middle.
+static std::string_view get_patch_filename(std::string_view headerLine, std::string_view diff)
+{
+    // Combined diffs of merges have no old name, "diff --cc <name>".
+    if (headerLine.starts_with(kPatchCombinedDiffHeaderLine)) {
+        auto name = headerLine.substr(kPatchCombinedDiffHeaderLine.size());
+        return name.substr(0, name.find_last_not_of("\r\n") + 1);
+    }
+
+    std::string_view deletedName {};
+    for (auto header = diff.substr(0, find_first_hunk(diff)); !header.empty();) {
+        auto line = TakeLine(header);
+        line = line.substr(0, line.find_last_not_of("\r\n") + 1);
+        for (std::string_view prefix : { "+++ b/", "rename to ", "copy to " }) {
+            if (line.starts_with(prefix)) {
+                // Git ends "+++" lines of names with spaces with a tab.
+                line.remove_prefix(prefix.size());
+                return line.ends_with('\t') ? line.substr(0, line.size() - 1) : line;
+            }
+        }
+        if (line.starts_with("--- a/")) {
+            deletedName = line.substr(6, line.size() - 6 - line.ends_with('\t'));
         }
+    }
+    if (!deletedName.empty()) {
+        return deletedName;
+    }
+
+    // "<name> b/<name>"
+    auto names = headerLine.substr(kPatchFileDiffHeaderLine.size());
+    names = names.substr(0, names.find_last_not_of("\r\n") + 1);
+    auto half = names.size() >= 3 ? (names.size() - 3) / 2 : 0;
+    if (names.size() % 2 && names.substr(half, 3) == " b/" && names.substr(0, half) == names.substr(half + 3)) {
+        return names.substr(0, half);
+    }
+    return names.substr(0, names.find(' '));
+}
+
+/// @brief Parse the patch of a file, without its "diff --git" line. Minified files are summarized by their header, the
+///        client asks for them if it wants to see them. Combined diffs of merges have no side-by-side view, they are
+///        always parsed into chunks.
+json parse_file_patch(std::string_view filename, std::string_view filePatch, const PatchOptions& options)
+{
+    auto hunkPos = find_first_hunk(filePatch);
+    auto begin = options.continuation ? std::clamp(options.continuation, hunkPos, filePatch.size()) : hunkPos;
+    auto end = find_patch_end(filePatch, begin, options);
+    auto minified = options.summarizeMinified && is_minified(filePatch.substr(begin, end - begin));
+    end = minified ? begin : end;
+    auto split = options.split && count_patch_columns(filePatch) == 1;
+    auto filePatchJson = split ? parse_split_patch(filename, filePatch, begin, end, options)
+                               : parse_patch(filename, filePatch, begin, end, options);
+    if (minified) {
+        filePatchJson["minified"] = true;
+    }
+    if (is_binary(filePatch.substr(0, hunkPos))) {
+        filePatchJson["binary"] = true;
+    }
+    return filePatchJson;
+}
 
-        auto filename = line.substr(kPatchFileDiffHeaderLine.size(), spacePos - kPatchFileDiffHeaderLine.size());
-        line.clear();
+/// @brief Parse the file patches in "git show" output, or a combined diff of a merge, and append them to patch.
+void parse_patch(std::string_view output, const PatchOptions& options, json& patch)
+{
+    // Anything before the first file patch is the commit header.
+    auto pos = output.starts_with(kPatchFileDiffHeaderLine) || output.starts_with(kPatchCombinedDiffHeaderLine)
+        ? 0
+        : find_next_file_patch(output, 0);
+    while (pos != std::string_view::npos) {
+        pos += output[pos] == '\n';
+        auto next = find_next_file_patch(output, pos);
+        auto filePatch = output.substr(pos, next == std::string_view::npos ? std::string_view::npos : next + 1 - pos);
+        pos = next;
 
-        std::vector<std::string> diffs;
-        while (std::getline(in, line) && !line.starts_with(kPatchFileDiffHeaderLine)) {
-            diffs.emplace_back(std::move(line));
+        // Find a file patch, get file name first.
+        auto headerLine = TakeLine(filePatch);
+        auto filename = get_patch_filename(headerLine, filePatch);
+        if (filename.empty() || (!options.file.empty() && filename != options.file)) {
+            // Invalid diff format, or another file than the one continued.
+            continue;
         }
-        patch.push_back(parse_patch(std::move(filename), std::move(diffs)));
+        patch.push_back(parse_file_patch(filename, filePatch, options));
     }
+}
+
+export json parse_patch(const std::string& str)
+{
+    json patch {};
+    parse_patch(str, {}, patch);
     return patch;
 }
 
@@ -280,11 +691,10 @@ void create_detail_header(json& j, git_commit* pCommit)
     }
 
     json parents;
-    if (auto node = create_parent_node(pCommit, 0); !node.empty()) {
-        parents.push_back(std::move(node));
-    }
-    if (auto node = create_parent_node(pCommit, 1); !node.empty()) {
-        parents.push_back(std::move(node));
+    for (auto i = 0u; i < git_commit_parentcount(pCommit); ++i) {
+        if (auto node = create_parent_node(pCommit, i); !node.empty()) {
+            parents.push_back(std::move(node));
+        }
     }
     if (!parents.empty()) {
         j["parents"] = std::move(parents);
@@ -293,54 +703,223 @@ void create_detail_header(json& j, git_commit* pCommit)
     j["message"] = create_message_lines(pCommit);
 }
 
-std::string get_git_commit(
-    const std::string& repoPath, const std::string& follow, const std::string& commitId, bool ignoreWhitespace)
+json serialize(const FileStat& stat)
+{
+    json r {};
+    r["status"] = std::string(1, stat.status);
+    r["path"] = stat.path;
+    if (!stat.oldPath.empty()) {
+        r["oldPath"] = stat.oldPath;
+        r["similarity"] = stat.similarity;
+    }
+    r["additions"] = stat.additions;
+    r["deletions"] = stat.deletions;
+    if (stat.binary) {
+        r["binary"] = true;
+    }
+    return r;
+}
+
+/// @brief Key of the diffs of a commit in the diff cache: its tree, the trees of its parents (merges are diffed against
+///        all of them), the pathspec and the options.
+std::string get_diff_cache_key(git_commit* pCommit, const std::string& pathspec, bool ignoreWhitespace)
+{
+    auto key = GitHashToString(git_commit_tree_id(pCommit)->id);
+    for (auto i = 0u; i < git_commit_parentcount(pCommit); ++i) {
+        std::unique_ptr<git_commit> pParent {};
+        if (!git_commit_parent(std::out_ptr(pParent), pCommit, i)) {
+            key += ' ' + GitHashToString(git_commit_tree_id(pParent.get())->id);
+        }
+    }
+    return std::format("{}\n{}\n{}", key, ignoreWhitespace, pathspec);
+}
+
+// Limits of the diff of a file in a commit request, see --max-file-diff-lines and --max-file-diff-kb.
+static size_t s_maxFileDiffLines { 5000 };
+static size_t s_maxFileDiffBytes { 1024 * 1024 };
+
+/// @brief Get metadata, changed files and patch of a commit as json. The diff of a file is truncated beyond
+///        s_maxFileDiffLines or s_maxFileDiffBytes and minified files are summarized unless full is set, and all files
+///        are truncated once the memory budget is used up. "git show" output beyond 8MB is spilled to disk and parsed
+///        from there. If split is set, file patches have aligned rows for a side-by-side view. If statOnly is set,
+///        there is no patch, which makes it quick for any commit. If file is set, only the patch of file is returned,
+///        from continuation of its truncated patch on.
+export std::string get_git_commit(CancellationToken& token, const std::string& repoPath, const std::string& follow,
+    const std::string& commitId, bool ignoreWhitespace, bool full = false, bool split = false, bool statOnly = false,
+    const std::string& file = {}, size_t continuation = 0)
 {
+    constexpr size_t kMinReservation = 64 * 1024;
+    constexpr size_t kMaxInMemoryOutput = 8 * 1024 * 1024;
+
+    auto& metrics = GetMetrics();
+    StageTimer total { metrics.gitCommitTotal, "get_git_commit" };
+    total.Start();
+
+    // Reject the request at once if there is no memory left for even a small commit.
+    MemoryReservation reservation {};
+    reservation.Grow(kMinReservation);
+
     auto pGit = GetSharedGitRepository(repoPath);
 
     auto oid = StringToGitHash(commitId);
     std::unique_ptr<git_commit> pCommit {};
-    if (git_commit_lookup(std::out_ptr(pCommit), pGit->GetRepo(), &oid)) {
-        return "{}";
+    json j;
+    {
+        StageTimer lookup { metrics.gitCommitLookup, "commit_lookup" };
+        lookup.Start();
+        if (git_commit_lookup(std::out_ptr(pCommit), pGit->GetRepo(), &oid)) {
+            return "{}";
+        }
+        assert(pCommit);
+
+        j["id"] = commitId;
+
+        // Get metadata
+        create_detail_header(j, pCommit.get());
     }
-    assert(pCommit);
 
-    json j;
-    j["id"] = commitId;
+    // Diffs only depend on trees, pathspec and options, so they are shared with other commits and users.
+    auto pathspec
+        = follow.empty() ? std::string {} : std::filesystem::relative(follow, pGit->GetRepoWorkDir()).generic_string();
+    auto cacheKey = get_diff_cache_key(pCommit.get(), pathspec, ignoreWhitespace);
+
+    // Merges are shown as the dense combined diff against all parents, the file list included. Their file list is
+    // cached apart from the first parent file list.
+    auto merge = git_commit_parentcount(pCommit.get()) > 1;
+    auto statKey = (merge ? "combined-stat\n" : "stat\n") + cacheKey;
+    std::optional<std::vector<CombinedFileDiff>> combinedDiff {};
+    auto getCombinedDiff = [&]() -> std::vector<CombinedFileDiff>& {
+        if (!combinedDiff) {
+            combinedDiff = StageTimer { metrics.gitCommitProcess, "combined_diff" }.Measure([&] {
+                return GetCombinedDiff(
+                    pGit->GetRepo(), pGit->GetRepoRoot(), pCommit.get(), pathspec, ignoreWhitespace, token);
+            });
+        }
+        return *combinedDiff;
+    };
 
-    // Get metadata
-    create_detail_header(j, pCommit.get());
+    // Get changed files, they make the file list of the commit. Continued file patches don't need them.
+    if (file.empty()) {
+        j["files"] = StageTimer { metrics.gitCommitStat, "diff_stat" }.Measure([&] {
+            if (auto pCached = GetDiffCache().Get(statKey)) {
+                return json::parse(*pCached);
+            }
+            json files = json::array();
+            if (merge) {
+                for (const auto& fileDiff : getCombinedDiff()) {
+                    files.push_back(serialize(fileDiff.stat));
+                }
+            } else {
+                for (const auto& stat :
+                    GetDiffStat(pGit->GetRepo(), pCommit.get(), pathspec, ignoreWhitespace, token)) {
+                    files.push_back(serialize(stat));
+                }
+            }
+            if (!token.IsCancelled()) {
+                GetDiffCache().Put(statKey, std::make_shared<const std::string>(dump(files)));
+            }
+            return files;
+        });
+    }
+    if (statOnly || token.IsCancelled()) {
+        return StageTimer { metrics.gitCommitSerialize, "serialize" }.Measure([&] { return dump(j); });
+    }
 
-    // Get diff
-    auto cmd = std::format("git show --pretty=format: {}", commitId);
+    // Get diff, names are not quoted so names with non-ASCII characters are found like any other.
+    auto cmd = std::format("git -c core.quotePath=false show --pretty=format: {}", commitId);
     if (ignoreWhitespace) {
         cmd += " -w";
     }
     if (!follow.empty()) {
         cmd += " -- " + follow;
     }
-    j["patch"] = parse_patch(ExternRun(cmd, repoPath.c_str()));
+    SpillBuffer output { reservation, kMaxInMemoryOutput };
+    auto pPatchText = GetDiffCache().Get("patch\n" + cacheKey);
+    if (!pPatchText && merge) {
+        getCombinedDiff();
+        if (token.IsCancelled()) {
+            return "{}";
+        }
+    } else if (!pPatchText) {
+        StageTimer { metrics.gitCommitProcess, "git_show" }.Measure([&] {
+            ExternRun(
+                cmd, repoPath.c_str(),
+                [&output](char* data, size_t size) {
+                    output.Append(data, size);
+                    return true;
+                },
+                &token);
+        });
+        if (token.IsCancelled()) {
+            return "{}";
+        }
 
-    return dump(j);
+        // Spilled output is too big to be cached.
+        if (output.IsSpilled()) {
+            metrics.spilledBytes += output.GetSize();
+        } else {
+            pPatchText = std::make_shared<const std::string>(output.TakeMemory());
+            GetDiffCache().Put("patch\n" + cacheKey, pPatchText);
+        }
+    }
+    j["patch"] = StageTimer { metrics.gitCommitParse, "parse_patch" }.Measure([&] {
+        PatchOptions options {
+            .maxFileBytes = full ? std::numeric_limits<size_t>::max() : s_maxFileDiffBytes,
+            .maxFileLines = full ? std::numeric_limits<size_t>::max() : s_maxFileDiffLines,
+            .summarizeMinified = !full && file.empty(),
+            .pReservation = &reservation,
+            .split = split,
+            .file = file,
+            .continuation = continuation,
+        };
+        json patch {};
+        auto parse = [&](std::string_view data, bool last) {
+            // Spilled output comes in blocks, leave the last file patch of a block to the next one.
+            auto end = last ? data.size() : data.rfind(kPatchFileDiffSeparator);
+            end = end == std::string_view::npos ? 0 : end + !last;
+            parse_patch(data.substr(0, end), options, patch);
+            return end;
+        };
+        if (pPatchText) {
+            parse(*pPatchText, /*last=*/true);
+        } else if (merge) {
+            // Each file is parsed (and truncated) like a file of "git show" output. The concatenation is the same text
+            // as "git show --cc", so it is cached the same way, unless it is too big.
+            std::string patchText {};
+            auto cacheable = true;
+            for (auto& fileDiff : getCombinedDiff()) {
+                parse_patch(fileDiff.patch, options, patch);
+                cacheable = cacheable && patchText.size() + fileDiff.patch.size() <= kMaxInMemoryOutput
+                    && reservation.TryGrow(fileDiff.patch.size());
+                if (cacheable) {
+                    patchText += fileDiff.patch;
+                }
+                fileDiff.patch = {};
+            }
+            if (cacheable && !token.IsCancelled()) {
+                GetDiffCache().Put("patch\n" + cacheKey, std::make_shared<const std::string>(std::move(patchText)));
+            }
+        } else {
+            output.Consume(parse);
+        }
+        return patch;
+    });
+    if (!file.empty()) {
+        j = j["patch"].empty() ? json::object() : std::move(j["patch"][0]);
+    }
+
+    return StageTimer { metrics.gitCommitSerialize, "serialize" }.Measure([&] { return dump(j); });
 }
 
-void get_git_log(httplib::DataSink& sink, GitRepository& repo, const std::string& repoPath, const std::string& follow,
-    bool noMerges, const std::string& commitId, const std::vector<std::string>& authors)
+std::string create_git_log_command(int count, bool noMerges, const std::string& revision,
+    const std::vector<std::string>& authors, const std::string& follow)
 {
-    // Read all refs.
-    auto refs = repo.GetRefs();
-
-    std::vector<GitCommit> commits;
-    std::unordered_map<std::string, int> hashToCommitIndex;
-
-    auto count = 500;
-    commits.reserve(count);
     auto cmd = std::format("git log -n {} --pretty=format:%H", count);
     if (noMerges) {
         cmd += " --no-merges";
     }
-    if (!commitId.empty()) {
-        cmd += " " + commitId;
+    if (!revision.empty()) {
+        cmd += " " + revision;
     }
     for (const auto& author : authors) {
         cmd += std::format(" --author \"{}\"", author);
@@ -348,11 +927,31 @@ void get_git_log(httplib::DataSink& sink, GitRepository& repo, const std::string
     if (!follow.empty()) {
         cmd += " -- " + follow;
     }
+    return cmd;
+}
+
+GitCommit create_git_commit(GitRepository& repo, const GitRefSnapshot& refs, const std::string& commitId)
+{
+    git_commit* commit {};
+    auto oid = StringToGitHash(commitId);
+    git_commit_lookup(&commit, repo.Get(), &oid);
+    GitCommit v {};
+    auto* poid = git_commit_id(commit);
+    v.id = GitHashToString(poid->id);
+    v.commit = commit;
+    auto refsIt = refs.refs.equal_range(*poid);
+    for (auto it = refsIt.first; it != refsIt.second; ++it) {
+        v.refs.emplace_back(&it->second);
+    }
+    return v;
+}
 
+/// @brief Assign graph columns to all commits, commits must be in history order.
+void layout_commits(std::vector<GitCommit>& commits, const std::unordered_map<std::string, int>& hashToCommitIndex)
+{
     std::vector<int> avaliable_columns;
     int next_avaliable_columnt {};
     int max_possible_columnt {};
-    auto lineReader = LineReader {};
     auto get_avaliable_column = [&] {
         if (avaliable_columns.empty()) {
             auto column = next_avaliable_columnt++;
@@ -373,139 +972,835 @@ void get_git_log(httplib::DataSink& sink, GitRepository& repo, const std::string
         }
     };
 
-    auto processLines = [&]() {
-        size_t startPos = commits.size();
-        while (auto pLine = lineReader.GetLine()) {
-            if (pLine->empty()) {
-                continue;
-            }
+    // Whether a parent has been given the column of the commit, merges can have any number of parents.
+    auto is_column_continued = [&commits](const GitCommit& commit) {
+        return std::ranges::any_of(commit.parentIndexes,
+            [&](int parentIndex) { return parentIndex >= 0 && commits[parentIndex].column == commit.column; });
+    };
 
-            git_commit* commit {};
-            auto oid = StringToGitHash(*pLine);
-            git_commit_lookup(&commit, repo.Get(), &oid);
-            GitCommit v {};
-            auto* poid = git_commit_id(commit);
-            v.id = GitHashToString(poid->id);
-            v.commit = commit;
-            auto refsIt = refs.equal_range(v.id);
-            for (auto it = refsIt.first; it != refsIt.second; ++it) {
-                v.refs.emplace_back(&it->second);
-            }
-            commits.emplace_back(std::move(v));
-            hashToCommitIndex.emplace(commits.rbegin()->id, (int)commits.size() - 1);
-        }
-
-        avaliable_columns.clear();
-        next_avaliable_columnt = 0;
-        for (auto& commit : commits) {
-            commit.column = -1;
-            commit.parentIndexes[0] = kNoParent;
-            commit.parentIndexes[1] = kNoParent;
-            commit.minReservedColumn = 0;
-            commit.maxReservedColumn = -1;
-        }
-        for (auto& commit : commits) {
-            if (commit.column < 0) {
-                commit.column = get_avaliable_column();
-            }
-            auto parentCount = git_commit_parentcount(commit.commit);
-            for (auto i = 0u; i < parentCount; ++i) {
-                auto parentOid = git_commit_parent_id(commit.commit, i);
-                auto it = hashToCommitIndex.find(GitHashToString(parentOid->id));
-                if (it != hashToCommitIndex.end()) {
-                    auto& parent = commits[it->second];
-                    if (parent.column == -1) {
-                        if (commit.parentIndexes[0] < 0 || commits[commit.parentIndexes[0]].column != commit.column) {
-                            parent.column = commit.column;
-                        } else {
-                            parent.column = get_avaliable_column();
-                        }
+    for (auto& commit : commits) {
+        commit.column = -1;
+        commit.parentIndexes.assign(git_commit_parentcount(commit.commit), kNoParent);
+        commit.minReservedColumn = 0;
+        commit.maxReservedColumn = -1;
+    }
+    for (auto& commit : commits) {
+        if (commit.column < 0) {
+            commit.column = get_avaliable_column();
+        }
+        for (auto i = 0u; i < commit.parentIndexes.size(); ++i) {
+            auto parentOid = git_commit_parent_id(commit.commit, i);
+            auto it = hashToCommitIndex.find(GitHashToString(parentOid->id));
+            if (it != hashToCommitIndex.end()) {
+                auto& parent = commits[it->second];
+                if (parent.column == -1) {
+                    if (!is_column_continued(commit)) {
+                        parent.column = commit.column;
+                    } else {
+                        parent.column = get_avaliable_column();
                     }
-                    commit.parentIndexes[i] = it->second;
-                } else {
-                    commit.parentIndexes[i] = kNotInTheRange;
                 }
+                commit.parentIndexes[i] = it->second;
+            } else {
+                commit.parentIndexes[i] = kNotInTheRange;
+            }
+        }
+        commit.maxReservedColumn = next_avaliable_columnt - 1;
+
+        if (!is_column_continued(commit)) {
+            free_column(commit.column);
+        }
+    }
+
+    std::vector<int> maxReservedColumnTracker(max_possible_columnt + 1);
+    for (auto i = 0u; i < commits.size(); ++i) {
+        maxReservedColumnTracker[commits[i].column] = i;
+    }
+
+    for (auto i = 0u; i < commits.size(); ++i) {
+        auto& commit = commits[i];
+        while (commit.minReservedColumn < commit.column) {
+            if (maxReservedColumnTracker[commit.minReservedColumn] < i) {
+                ++commit.minReservedColumn;
+            } else {
+                break;
             }
-            commit.maxReservedColumn = next_avaliable_columnt - 1;
+        }
+        while (commit.maxReservedColumn > commit.column) {
+            if (maxReservedColumnTracker[commit.maxReservedColumn] < i) {
+                --commit.maxReservedColumn;
+            } else {
+                break;
+            }
+        }
+    }
+}
+
+/// @brief History which is kept up to date after it is sent, commits point into the ref snapshot.
+struct LiveHistory {
+    GitRepository* pRepo {};
+    std::string repoPath {};
+    std::string follow {};
+    bool noMerges {};
+    std::vector<std::string> authors {};
+    git_oid head {};
+    uint64_t generation {};
+    std::shared_ptr<const GitRefSnapshot> pRefs {};
+    std::vector<GitCommit> commits {};
+    std::unordered_map<std::string, int> hashToCommitIndex {};
+    bool ended {};
+};
+
+/// @brief Bring the history up to the latest generation of the repository watcher, return the event to send if
+///        anything may have changed. Only the new commits are walked, the layout of the whole list is recomputed
+///        (which is cheap, no object lookup). If HEAD is moved to a commit which is not a descendant of the old one,
+///        ask the client to reload, the history is ended then.
+std::optional<std::string> update_live_history(LiveHistory& history, CancellationToken& token)
+{
+    constexpr size_t kMaxNewCommits = 500;
+    auto& repo = *history.pRepo;
+    auto generation = repo.GetWatcher().GetGeneration();
+    if (history.ended || generation == history.generation) {
+        return std::nullopt;
+    }
+    history.generation = generation;
+
+    git_oid newHead {};
+    if (git_reference_name_to_id(&newHead, repo.Get(), "HEAD")) {
+        return std::nullopt;
+    }
 
-            if ((commit.parentIndexes[0] < 0 || commits[commit.parentIndexes[0]].column != commit.column)
-                && (commit.parentIndexes[1] < 0 || commits[commit.parentIndexes[1]].column != commit.column)) {
-                free_column(commit.column);
+    std::vector<std::string> newIds {};
+    if (!git_oid_equal(&newHead, &history.head)) {
+        if (git_graph_descendant_of(repo.Get(), &newHead, &history.head) != 1) {
+            history.ended = true;
+            return std::string { "data: {\"reload\": true}\n\n" };
+        }
+
+        auto range = std::format("{}..{}", GitHashToString(history.head.id), GitHashToString(newHead.id));
+        auto lineReader = LineReader {};
+        auto output = ExternRun(
+            create_git_log_command(kMaxNewCommits, history.noMerges, range, history.authors, history.follow),
+            history.repoPath.c_str(), &token);
+        if (token.IsCancelled()) {
+            history.ended = true;
+            return std::nullopt;
+        }
+        lineReader.Append(output.c_str(), output.size());
+        lineReader.Append("\n", 1);
+        while (auto pLine = lineReader.GetLine()) {
+            // The walk of the initial history may have seen some of them already.
+            if (!pLine->empty() && !history.hashToCommitIndex.contains(*pLine)) {
+                newIds.emplace_back(std::move(*pLine));
             }
         }
+        if (newIds.size() >= kMaxNewCommits) {
+            history.ended = true;
+            return std::string { "data: {\"reload\": true}\n\n" };
+        }
+        history.head = newHead;
+    }
 
-        std::vector<int> maxReservedColumnTracker(max_possible_columnt + 1);
-        for (auto i = 0u; i < commits.size(); ++i) {
-            maxReservedColumnTracker[commits[i].column] = i;
+    // Refs may be moved even if there is no new commit, refresh them for all commits.
+    auto& commits = history.commits;
+    auto& pRefs = history.pRefs;
+    pRefs = repo.GetRefSnapshot();
+    std::vector<GitCommit> newCommits {};
+    for (const auto& id : newIds) {
+        newCommits.emplace_back(create_git_commit(repo, *pRefs, id));
+    }
+    for (auto& commit : commits) {
+        commit.refs.clear();
+        auto oid = StringToGitHash(commit.id);
+        auto refsIt = pRefs->refs.equal_range(oid);
+        for (auto it = refsIt.first; it != refsIt.second; ++it) {
+            commit.refs.emplace_back(&it->second);
         }
+    }
+    commits.insert(
+        commits.begin(), std::make_move_iterator(newCommits.begin()), std::make_move_iterator(newCommits.end()));
+    history.hashToCommitIndex.clear();
+    for (auto i = 0u; i < commits.size(); ++i) {
+        history.hashToCommitIndex.emplace(commits[i].id, (int)i);
+    }
+    layout_commits(commits, history.hashToCommitIndex);
+
+    auto commitsData = serialize(commits.begin(), commits.begin() + newIds.size(), /*graphInfoOnly=*/false);
+    auto graphData = serialize(commits.begin(), commits.end(), /*graphInfoOnly=*/true);
+    return std::format("data: {{\"prepend\": {}, \"graphs\": {}}}\n\n", commitsData, graphData);
+}
 
-        for (auto i = 0u; i < commits.size(); ++i) {
-            auto& commit = commits[i];
-            while (commit.minReservedColumn < commit.column) {
-                if (maxReservedColumnTracker[commit.minReservedColumn] < i) {
-                    ++commit.minReservedColumn;
-                } else {
-                    break;
+/// @brief After the history is sent, keep the stream open and push commits which become reachable from HEAD.
+void watch_git_log(httplib::DataSink& sink, CancellationToken& token, LiveHistory& history)
+{
+    constexpr auto kCancellationCheckInterval = std::chrono::seconds { 1 };
+    constexpr auto kKeepAliveInterval = 15;
+    auto& watcher = history.pRepo->GetWatcher();
+    auto idleCount = 0;
+    while (!token.IsCancelled() && !history.ended) {
+        if (watcher.WaitForChange(history.generation, kCancellationCheckInterval) == history.generation) {
+            if (++idleCount == kKeepAliveInterval) {
+                // Comment line, ignored by EventSource, just to find out whether the client is gone.
+                idleCount = 0;
+                auto event = std::string { ": keep-alive\n\n" };
+                if (!sink.write(event.c_str(), event.size())) {
+                    return;
                 }
             }
-            while (commit.maxReservedColumn > commit.column) {
-                if (maxReservedColumnTracker[commit.maxReservedColumn] < i) {
-                    --commit.maxReservedColumn;
-                } else {
-                    break;
+            continue;
+        }
+        idleCount = 0;
+
+        auto event = update_live_history(history, token);
+        if (event && !sink.write(event->c_str(), event->size())) {
+            return;
+        }
+    }
+}
+
+/// @brief Send the history, return the state to keep it up to date if live updates are requested and possible.
+std::unique_ptr<LiveHistory> send_git_log(httplib::DataSink& sink, CancellationToken& token, GitRepository& repo,
+    const std::string& repoPath, const std::string& follow, bool noMerges, const std::string& commitId,
+    const std::vector<std::string>& authors, bool live)
+{
+    // Remember where HEAD and refs are before walking, live updates only need to walk commits created after it.
+    git_oid head {};
+    live = live && commitId.empty() && !git_reference_name_to_id(&head, repo.Get(), "HEAD");
+    auto generation = live ? repo.GetWatcher().GetGeneration() : 0;
+
+    // Read all refs, the snapshot is kept alive until the request is done since commits point into it.
+    auto pRefs = repo.GetRefSnapshot();
+
+    std::vector<GitCommit> commits;
+    std::unordered_map<std::string, int> hashToCommitIndex;
+
+    auto count = 500;
+    commits.reserve(count);
+    auto cmd = create_git_log_command(count, noMerges, commitId, authors, follow);
+
+    {
+        // Stages are timed until the history is sent, watching for new commits afterwards is not counted.
+        auto& metrics = GetMetrics();
+        StageTimer total { metrics.gitLogTotal, "get_git_log" };
+        StageTimer process { metrics.gitLogProcess, "git_log" };
+        StageTimer lookup { metrics.gitLogLookup, "commit_lookup" };
+        StageTimer layout { metrics.gitLogLayout, "layout" };
+        StageTimer serialization { metrics.gitLogSerialize, "serialize" };
+        StageTimer write { metrics.gitLogWrite, "write" };
+        total.Start();
+
+        auto lineReader = LineReader {};
+        auto processLines = [&]() {
+            if (token.IsCancelled()) {
+                return false;
+            }
+
+            size_t startPos = commits.size();
+            TraceSpan readLines { "read_lines" };
+            while (auto pLine = lineReader.GetLine()) {
+                if (pLine->empty()) {
+                    continue;
                 }
+
+                commits.emplace_back(lookup.Measure([&] { return create_git_commit(repo, *pRefs, *pLine); }));
+                hashToCommitIndex.emplace(commits.rbegin()->id, (int)commits.size() - 1);
             }
-        }
 
-        if (startPos < commits.size()) {
-            auto commitsData = serialize(commits.begin() + startPos, commits.end(), /*graphInfoOnly=*/false);
-            auto graphData = serialize(commits.begin(), commits.end(), /*graphInfoOnly=*/true);
-            auto event = std::format("data: {{\"commits\": {}, \"graphs\": {}}}\n\n", commitsData, graphData);
-            return sink.write(event.c_str(), event.size());
-        } else {
-            return true;
+            layout.Measure([&] { layout_commits(commits, hashToCommitIndex); });
+
+            if (startPos < commits.size()) {
+                auto event = serialization.Measure([&] {
+                    auto commitsData = serialize(commits.begin() + startPos, commits.end(), /*graphInfoOnly=*/false);
+                    auto graphData = serialize(commits.begin(), commits.end(), /*graphInfoOnly=*/true);
+                    return std::format("data: {{\"commits\": {}, \"graphs\": {}}}\n\n", commitsData, graphData);
+                });
+                return write.Measure([&] { return sink.write(event.c_str(), event.size()); });
+            } else {
+                return true;
+            }
+        };
+
+        // Time between chunks of output is spent in "git log".
+        process.Start();
+        ExternRun(
+            cmd, repoPath.c_str(),
+            [&](char* data, size_t size) {
+                process.Stop();
+                lineReader.Append(data, size);
+                auto result = processLines();
+                process.Start();
+                return result;
+            },
+            &token);
+        process.Stop();
+        if (token.IsCancelled()) {
+            return nullptr;
         }
-    };
 
-    ExternRun(cmd, repoPath.c_str(), [&](char* data, size_t size) {
-        lineReader.Append(data, size);
-        return processLines();
-    });
+        // Process the last line which may not contains \n;
+        lineReader.Append("\n", 2);
+        processLines();
 
-    // Process the last line which may not contains \n;
-    lineReader.Append("\n", 2);
-    processLines();
+        // Send end data.
+        auto event = std::string { "data: {\"commits\": [], \"graphs\": []}\n\n" };
+        write.Measure([&] { sink.write(event.c_str(), event.size()); });
+    }
 
-    // Send end data.
-    auto event = std::string { "data: {\"commits\": [], \"graphs\": []}\n\n" };
-    sink.write(event.c_str(), event.size());
+    if (!live) {
+        return nullptr;
+    }
+    return std::make_unique<LiveHistory>(LiveHistory {
+        .pRepo = &repo,
+        .repoPath = repoPath,
+        .follow = follow,
+        .noMerges = noMerges,
+        .authors = authors,
+        .head = head,
+        .generation = generation,
+        .pRefs = std::move(pRefs),
+        .commits = std::move(commits),
+        .hashToCommitIndex = std::move(hashToCommitIndex),
+    });
 }
 
-void get_git_log(httplib::DataSink& sink, const std::string& repoPath, const std::string& path, bool noMerges,
-    const std::string& commitId, const std::vector<std::string>& authors)
+export void get_git_log(httplib::DataSink& sink, CancellationToken& token, const std::string& repoPath,
+    const std::string& path, bool noMerges, const std::string& commitId, const std::vector<std::string>& authors,
+    bool live)
 {
     auto pGit = GetSharedGitRepository(repoPath);
-    get_git_log(sink, *pGit, pGit->GetRepoRoot(), std::filesystem::relative(path, pGit->GetRepoWorkDir()).string(),
-        noMerges, commitId, authors);
+    auto pHistory = send_git_log(sink, token, *pGit, pGit->GetRepoRoot(),
+        std::filesystem::relative(path, pGit->GetRepoWorkDir()).string(), noMerges, commitId, authors, live);
+    if (pHistory) {
+        watch_git_log(sink, token, *pHistory);
+    }
 }
 
-static const std::string GetHttpQueryParameter(
-    const httplib::Request& req, const std::string& key, std::string&& defaultValue)
+std::string search_git_log(const std::string& repoPath, const std::string& query, size_t limit)
 {
-    auto it = req.params.find(key);
-    return it == req.params.end() ? std::move(defaultValue) : it->second;
-}
+    auto pGit = GetSharedGitRepository(repoPath);
 
-static std::vector<std::string> GetHttpQueryParameters(const httplib::Request& req, const std::string& key)
-{
-    std::vector<std::string> res {};
-    auto values = req.params.equal_range(key);
+    // Index everything reachable from branches, tags and HEAD, and match ref names against the query as well.
+    std::vector<git_oid> tips {};
+    std::vector<std::pair<std::string, git_oid>> refTargets {};
+    auto pRefs = pGit->GetRefSnapshot();
+    for (const auto& [oid, ref] : pRefs->refs) {
+        if (ref.isBranch || ref.isRemote || ref.isTag) {
+            tips.push_back(oid);
+            refTargets.emplace_back(ref.name, oid);
+        }
+    }
+    git_oid head {};
+    if (!git_reference_name_to_id(&head, pGit->GetRepo(), "HEAD")) {
+        tips.push_back(head);
+    }
+
+    auto& index = pGit->GetSearchIndex();
+    auto indexing = !index.Update(pGit->GetRepo(), std::move(tips));
+    auto result = index.Search(pGit->GetRepo(), query, refTargets, limit);
+
+    json ids = json::array();
+    for (const auto& oid : result.ids) {
+        ids.push_back(GitHashToString(oid.id));
+    }
+
+    json j {};
+    j["ids"] = std::move(ids);
+    j["truncated"] = result.truncated;
+    if (indexing) {
+        // Another search is building the index, commits it hasn't reached yet are missing from the result.
+        j["indexing"] = true;
+    }
+    return dump(j);
+}
+
+void get_pickaxe_search(httplib::DataSink& sink, CancellationToken& token, const std::string& repoPath,
+    const std::string& commitId, const PickaxeQuery& query)
+{
+    auto pGit = GetSharedGitRepository(repoPath);
+
+    git_oid tip {};
+    auto error = commitId.empty() ? git_reference_name_to_id(&tip, pGit->GetRepo(), "HEAD")
+                                  : git_oid_fromstr(&tip, commitId.c_str());
+    if (error) {
+        auto event = std::string { "data: {\"done\": true, \"scanned\": 0, \"matches\": []}\n\n" };
+        sink.write(event.c_str(), event.size());
+        return;
+    }
+
+    auto scannedTotal = size_t {};
+    RunPickaxeSearch(
+        pGit->GetRepoRoot(), pGit->GetRepo(), tip, query, token, [&](size_t scanned, const auto& matches) {
+            if (!sink.is_writable()) {
+                return false;
+            }
+
+            json ids = json::array();
+            for (const auto& oid : matches) {
+                ids.push_back(GitHashToString(oid.id));
+            }
+            scannedTotal = scanned;
+            auto event = std::format("data: {{\"scanned\": {}, \"matches\": {}}}\n\n", scanned, dump(ids));
+            return sink.write(event.c_str(), event.size());
+        });
+    if (token.IsCancelled()) {
+        return;
+    }
+
+    auto event = std::format("data: {{\"done\": true, \"scanned\": {}, \"matches\": []}}\n\n", scannedTotal);
+    sink.write(event.c_str(), event.size());
+}
+
+/// @brief Stream the blame of path (relative to the work directory) at a commit (HEAD if empty). The first event has
+///        the content of the file, the next ones the ranges of lines attributed since the last event, with the commits
+///        they come from which are not sent yet. nearId is the commit the client blamed the file at before, see
+///        RunBlame.
+void get_blame(httplib::DataSink& sink, CancellationToken& token, const std::string& repoPath,
+    const std::string& commitId, const std::string& path, const std::string& nearId)
+{
+    auto writeEvent = [&sink](const json& j) {
+        auto event = std::format("data: {}\n\n", dump(j));
+        return sink.write(event.c_str(), event.size());
+    };
+
+    auto pGit = GetSharedGitRepository(repoPath);
+    git_oid oid {};
+    auto error = commitId.empty() ? git_reference_name_to_id(&oid, pGit->GetRepo(), "HEAD")
+                                  : git_oid_fromstr(&oid, commitId.c_str());
+    std::unique_ptr<git_commit> pCommit {};
+    if (error || git_commit_lookup(std::out_ptr(pCommit), pGit->GetRepo(), &oid)) {
+        writeEvent({ { "done", true }, { "notFound", true } });
+        return;
+    }
+    auto blobId = FindBlob(pCommit.get(), path);
+    std::unique_ptr<git_blob> pBlob {};
+    if (!blobId || git_blob_lookup(std::out_ptr(pBlob), pGit->GetRepo(), &*blobId)) {
+        writeEvent({ { "done", true }, { "notFound", true } });
+        return;
+    }
+    if (git_blob_is_binary(pBlob.get())) {
+        writeEvent({ { "done", true }, { "binary", true } });
+        return;
+    }
+
+    json j {};
+    j["commit"] = GitHashToString(oid.id);
+    j["content"] = std::string { (const char*)git_blob_rawcontent(pBlob.get()), (size_t)git_blob_rawsize(pBlob.get()) };
+    if (!writeEvent(j)) {
+        return;
+    }
+    pBlob.reset();
+
+    git_oid near {};
+    auto* pNearId = nearId.empty() || git_oid_fromstr(&near, nearId.c_str()) ? nullptr : &near;
+    size_t sentCommits {};
+    try {
+        RunBlame(pGit->GetRepoWorkDir(), pGit->GetRepo(), pCommit.get(), *blobId, path, pNearId, token,
+            [&](const Blame& blame, const std::vector<BlameRange>& ranges) {
+                if (!sink.is_writable()) {
+                    return false;
+                }
+
+                // Ranges refer to commits by index, which is their position in the order they are sent.
+                json commits = json::array();
+                for (; sentCommits < blame.commits.size(); ++sentCommits) {
+                    const auto& commit = blame.commits[sentCommits];
+                    commits.push_back({ { "id", commit.id }, { "author", commit.author }, { "time", commit.time },
+                        { "summary", commit.summary } });
+                }
+                json rangesJson = json::array();
+                for (const auto& range : ranges) {
+                    rangesJson.push_back({ range.line, range.count, range.commit, range.origLine });
+                }
+                return writeEvent({ { "commits", std::move(commits) }, { "ranges", std::move(rangesJson) } });
+            });
+    } catch (const std::exception& ex) {
+        if (!token.IsCancelled()) {
+            writeEvent({ { "done", true }, { "error", ex.what() } });
+        }
+        return;
+    }
+    if (token.IsCancelled()) {
+        return;
+    }
+    writeEvent({ { "done", true } });
+}
+
+/// @brief Find the object at path (relative to the work directory, the root tree if it is empty) in a commit. commitId
+///        must be a full id, so what is found never changes.
+std::optional<std::pair<git_oid, git_object_t>> find_commit_object(
+    git_repository* pRepo, const std::string& commitId, std::string path)
+{
+    git_oid oid {};
+    std::unique_ptr<git_commit> pCommit {};
+    if (commitId.size() != GIT_OID_HEXSZ || git_oid_fromstr(&oid, commitId.c_str())
+        || git_commit_lookup(std::out_ptr(pCommit), pRepo, &oid)) {
+        return std::nullopt;
+    }
+    while (path.ends_with('/')) {
+        path.pop_back();
+    }
+    if (path.empty()) {
+        return std::pair { *git_commit_tree_id(pCommit.get()), GIT_OBJECT_TREE };
+    }
+
+    std::unique_ptr<git_tree> pTree {};
+    if (git_commit_tree(std::out_ptr(pTree), pCommit.get())) {
+        return std::nullopt;
+    }
+    std::unique_ptr<git_tree_entry> pEntry {};
+    if (git_tree_entry_bypath(std::out_ptr(pEntry), pTree.get(), path.c_str())) {
+        return std::nullopt;
+    }
+    return std::pair { *git_tree_entry_id(pEntry.get()), git_tree_entry_type(pEntry.get()) };
+}
+
+/// @brief Entries of a tree, with the size of blobs, which is read from the object headers only.
+std::string get_git_tree(git_repository* pRepo, const git_oid& treeId)
+{
+    std::unique_ptr<git_tree> pTree {};
+    std::unique_ptr<git_odb> pOdb {};
+    if (git_tree_lookup(std::out_ptr(pTree), pRepo, &treeId)) {
+        return "{}";
+    }
+    if (git_repository_odb(std::out_ptr(pOdb), pRepo)) {
+        return "{}";
+    }
+
+    json entries = json::array();
+    for (size_t i = 0; i < git_tree_entrycount(pTree.get()); ++i) {
+        const auto* pEntry = git_tree_entry_byindex(pTree.get(), i);
+        const auto& id = *git_tree_entry_id(pEntry);
+        auto type = git_tree_entry_type(pEntry);
+        json entry {};
+        entry["name"] = git_tree_entry_name(pEntry);
+        entry["type"] = git_object_type2string(type);
+        entry["mode"] = std::format("{:06o}", (unsigned)git_tree_entry_filemode(pEntry));
+        entry["id"] = GitHashToString(id.id);
+        size_t size {};
+        git_object_t headerType {};
+        if (type == GIT_OBJECT_BLOB && !git_odb_read_header(&size, &headerType, pOdb.get(), &id)) {
+            entry["size"] = size;
+        }
+        entries.push_back(std::move(entry));
+    }
+
+    json j {};
+    j["id"] = GitHashToString(treeId.id);
+    j["entries"] = std::move(entries);
+    return dump(j);
+}
+
+/// @brief Trees of the two commits of a compare request, both ids must be full ids.
+static bool lookup_compare_trees(git_repository* pRepo, const std::string& fromId, const std::string& toId,
+    std::unique_ptr<git_tree>& pFromTree, std::unique_ptr<git_tree>& pToTree)
+{
+    for (auto [pId, pTree] : { std::pair { &fromId, &pFromTree }, std::pair { &toId, &pToTree } }) {
+        git_oid oid {};
+        std::unique_ptr<git_commit> pCommit {};
+        if (pId->size() != GIT_OID_HEXSZ || git_oid_fromstr(&oid, pId->c_str())
+            || git_commit_lookup(std::out_ptr(pCommit), pRepo, &oid)) {
+            return false;
+        }
+        if (git_commit_tree(std::out_ptr(*pTree), pCommit.get())) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/// @brief Same as get_diff_cache_key, so the changed files of a compare are shared with the commit which has the same
+///        trees.
+static std::string get_compare_cache_key(
+    git_tree* pFromTree, git_tree* pToTree, const std::string& pathspec, bool ignoreWhitespace)
+{
+    return std::format("{} {}\n{}\n{}", GitHashToString(git_tree_id(pToTree)->id),
+        GitHashToString(git_tree_id(pFromTree)->id), ignoreWhitespace, pathspec);
+}
+
+/// @brief Cached compare patches are "<path>\n<size>\n<patch>" for every file, the path is kept apart as libgit2
+///        quotes unusual names in the patch text.
+static void append_cached_file_patch(std::string& text, std::string_view path, std::string_view patch)
+{
+    text += std::format("{}\n{}\n", path, patch.size());
+    text += patch;
+}
+
+static void for_each_cached_file_patch(
+    std::string_view text, const std::function<bool(std::string_view path, std::string_view patch)>& onPatch)
+{
+    while (!text.empty()) {
+        auto path = TakeLine(text);
+        auto sizeLine = TakeLine(text);
+        size_t size {};
+        std::from_chars(sizeLine.data(), sizeLine.data() + sizeLine.size(), size);
+        if (!path.ends_with('\n') || size > text.size()) {
+            return;
+        }
+        auto patch = text.substr(0, size);
+        text.remove_prefix(size);
+        if (!onPatch(path.substr(0, path.size() - 1), patch)) {
+            return;
+        }
+    }
+}
+
+/// @brief Parse a patch formatted by libgit2, which starts with its "diff --git" line.
+static json parse_libgit2_file_patch(std::string_view path, std::string_view patch, const PatchOptions& options)
+{
+    TakeLine(patch);
+    return parse_file_patch(path, patch, options);
+}
+
+/// @brief Stream the change between two commits, tree to tree, from libgit2 rather than "git diff". The first event
+///        has the changed files, then every file patch is an event of its own, sent as soon as it is diffed. Patches
+///        are limited like the patches of a commit, the rest of a file is asked by get_compare_file. follow is the path
+///        the history is for. Complete compares up to 8MB are cached by the trees they compare.
+void get_compare(httplib::DataSink& sink, CancellationToken& token, const std::string& repoPath,
+    const std::string& follow, const std::string& fromId, const std::string& toId, bool ignoreWhitespace, bool split)
+{
+    constexpr size_t kMinReservation = 64 * 1024;
+    constexpr size_t kMaxCachedPatchBytes = 8 * 1024 * 1024;
+
+    auto writeEvent = [&sink](const json& j) {
+        auto event = std::format("data: {}\n\n", dump(j));
+        return sink.write(event.c_str(), event.size());
+    };
+
+    MemoryReservation reservation {};
+    reservation.Grow(kMinReservation);
+
+    auto pGit = GetSharedGitRepository(repoPath);
+    std::unique_ptr<git_tree> pFromTree {};
+    std::unique_ptr<git_tree> pToTree {};
+    if (!lookup_compare_trees(pGit->GetRepo(), fromId, toId, pFromTree, pToTree)) {
+        writeEvent({ { "done", true }, { "notFound", true } });
+        return;
+    }
+    auto pathspec
+        = follow.empty() ? std::string {} : std::filesystem::relative(follow, pGit->GetRepoWorkDir()).generic_string();
+    auto cacheKey = get_compare_cache_key(pFromTree.get(), pToTree.get(), pathspec, ignoreWhitespace);
+    auto pPatchText = GetDiffCache().Get("compare\n" + cacheKey);
+
+    // The diff is only made if something is not cached.
+    std::unique_ptr<git_diff> pDiff {};
+    auto getDiff = [&] {
+        if (!pDiff) {
+            pDiff = DiffTrees(pGit->GetRepo(), pFromTree.get(), pToTree.get(), pathspec, ignoreWhitespace);
+            if (!pDiff) {
+                throw std::runtime_error { "Diff trees failed." };
+            }
+        }
+        return pDiff.get();
+    };
+
+    json files {};
+    if (auto pCached = GetDiffCache().Get("stat\n" + cacheKey)) {
+        files = json::parse(*pCached);
+    } else {
+        files = json::array();
+        for (const auto& stat : GetDiffStat(getDiff(), token)) {
+            files.push_back(serialize(stat));
+        }
+        if (token.IsCancelled()) {
+            return;
+        }
+        GetDiffCache().Put("stat\n" + cacheKey, std::make_shared<const std::string>(dump(files)));
+    }
+    if (!writeEvent({ { "files", std::move(files) } })) {
+        return;
+    }
+
+    // The json of a file is freed once it is sent, so is its reservation. Only the cached text stays reserved for the
+    // whole stream.
+    auto stopped = false;
+    auto sendPatch = [&](std::string_view path, std::string_view patch) {
+        MemoryReservation fileReservation {};
+        PatchOptions options {
+            .maxFileBytes = s_maxFileDiffBytes,
+            .maxFileLines = s_maxFileDiffLines,
+            .summarizeMinified = true,
+            .pReservation = &fileReservation,
+            .split = split,
+        };
+        stopped = !writeEvent({ { "patch", parse_libgit2_file_patch(path, patch, options) } });
+        return !stopped;
+    };
+    if (pPatchText) {
+        for_each_cached_file_patch(*pPatchText, sendPatch);
+    } else {
+        std::string text {};
+        auto cacheable = true;
+        ForEachFilePatch(getDiff(), {}, token, [&](std::string_view path, std::string_view patch) {
+            cacheable = cacheable && text.size() + patch.size() <= kMaxCachedPatchBytes
+                && reservation.TryGrow(path.size() + patch.size());
+            if (cacheable) {
+                append_cached_file_patch(text, path, patch);
+            }
+            return sendPatch(path, patch);
+        });
+        if (stopped || token.IsCancelled()) {
+            return;
+        }
+        if (cacheable) {
+            GetDiffCache().Put("compare\n" + cacheKey, std::make_shared<const std::string>(std::move(text)));
+        }
+    }
+    if (!stopped && !token.IsCancelled()) {
+        writeEvent({ { "done", true } });
+    }
+}
+
+/// @brief Get the patch of one file of a compare as json, from continuation of its truncated patch on.
+std::string get_compare_file(CancellationToken& token, const std::string& repoPath, const std::string& follow,
+    const std::string& fromId, const std::string& toId, bool ignoreWhitespace, bool split, const std::string& file,
+    size_t continuation)
+{
+    MemoryReservation reservation {};
+    auto pGit = GetSharedGitRepository(repoPath);
+    std::unique_ptr<git_tree> pFromTree {};
+    std::unique_ptr<git_tree> pToTree {};
+    if (!lookup_compare_trees(pGit->GetRepo(), fromId, toId, pFromTree, pToTree)) {
+        return "{}";
+    }
+    auto pathspec
+        = follow.empty() ? std::string {} : std::filesystem::relative(follow, pGit->GetRepoWorkDir()).generic_string();
+
+    PatchOptions options {
+        .maxFileBytes = s_maxFileDiffBytes,
+        .maxFileLines = s_maxFileDiffLines,
+        .pReservation = &reservation,
+        .split = split,
+        .continuation = continuation,
+    };
+    json j = json::object();
+    auto parse = [&](std::string_view path, std::string_view patch) {
+        if (path != file) {
+            return true;
+        }
+        j = parse_libgit2_file_patch(path, patch, options);
+        return false;
+    };
+    auto cacheKey = get_compare_cache_key(pFromTree.get(), pToTree.get(), pathspec, ignoreWhitespace);
+    if (auto pPatchText = GetDiffCache().Get("compare\n" + cacheKey)) {
+        for_each_cached_file_patch(*pPatchText, parse);
+    } else if (auto pDiff = DiffTrees(pGit->GetRepo(), pFromTree.get(), pToTree.get(), pathspec, ignoreWhitespace)) {
+        ForEachFilePatch(pDiff.get(), file, token, parse);
+    }
+    return dump(j);
+}
+
+/// @brief Count the event stream as active and bytes written to it, until this object is destroyed.
+class StreamMetrics {
+public:
+    explicit StreamMetrics(httplib::DataSink& sink)
+        : m_sink { sink }
+        , m_write { std::move(sink.write) }
+    {
+        ++GetMetrics().activeStreams;
+        m_sink.write = [this](const char* data, size_t size) {
+            if (!m_write(data, size)) {
+                return false;
+            }
+            GetMetrics().streamedBytes += size;
+            return true;
+        };
+    }
+
+    StreamMetrics(const StreamMetrics&) = delete;
+
+    ~StreamMetrics()
+    {
+        m_sink.write = std::move(m_write);
+        --GetMetrics().activeStreams;
+    }
+
+private:
+    httplib::DataSink& m_sink;
+    std::function<bool(const char*, size_t)> m_write {};
+};
+
+static const std::string GetHttpQueryParameter(
+    const httplib::Request& req, const std::string& key, std::string&& defaultValue)
+{
+    auto it = req.params.find(key);
+    return it == req.params.end() ? std::move(defaultValue) : it->second;
+}
+
+/// @brief Get an unsigned number from the query, throw ClientException (400) if it is not one.
+template <typename T>
+static T GetHttpQueryNumber(const httplib::Request& req, const std::string& key, T defaultValue)
+{
+    auto it = req.params.find(key);
+    if (it == req.params.end()) {
+        return defaultValue;
+    }
+    T value {};
+    auto [end, error] = std::from_chars(it->second.data(), it->second.data() + it->second.size(), value);
+    if (error != std::errc {} || end != it->second.data() + it->second.size()) {
+        throw ClientException(400, std::format("Invalid {} '{}'.", key, it->second));
+    }
+    return value;
+}
+
+static std::vector<std::string> GetHttpQueryParameters(const httplib::Request& req, const std::string& key)
+{
+    std::vector<std::string> res {};
+    auto values = req.params.equal_range(key);
     for (auto it = values.first; it != values.second; ++it) {
         res.emplace_back(it->second);
     }
     return res;
 }
 
+static bool s_traceAllRequests {};
+static size_t s_streamPort {};
+static size_t s_maxStreams {};
+static std::atomic<size_t> s_streamCount {};
+
+/// @brief Count a new event stream, or respond 503 and return false if there are too many streams already. Streams of
+///        the http server and the event stream server share the limit.
+static bool AcquireEventStream(httplib::Response& res)
+{
+    if (++s_streamCount > s_maxStreams && s_maxStreams) {
+        --s_streamCount;
+        res.status = httplib::StatusCode::ServiceUnavailable_503;
+        res.set_header("Retry-After", "1");
+        return false;
+    }
+    return true;
+}
+
+/// @brief Respond with an event stream produced by provider, or 503 if there are too many streams already. A stream may
+///        be open for hours, so its worker slot is handed over to a new thread, short requests never wait behind it.
+///        The stream count is decreased once the response is destroyed, even if provider is never called.
+static void SetEventStreamProvider(httplib::Response& res, httplib::ContentProviderWithoutLength provider)
+{
+    if (!AcquireEventStream(res)) {
+        return;
+    }
+
+    res.set_content_provider(
+        "text/event-stream",
+        [provider = std::move(provider)](size_t offset, httplib::DataSink& sink) {
+            ServerTaskQueue::ReleaseCurrentWorker();
+            StreamMetrics metrics { sink };
+            return provider(offset, sink);
+        },
+        [](bool success) { --s_streamCount; });
+}
+
+/// @brief Start tracing the request if it is asked by "trace=1" or the server is started with --trace, the trace id is
+///        returned in the X-Trace-Id header. Return nullptr if the request is not traced.
+static std::shared_ptr<Trace> StartRequestTrace(const httplib::Request& req, httplib::Response& res)
+{
+    if (!s_traceAllRequests && GetHttpQueryParameter(req, "trace", "") != "1") {
+        return nullptr;
+    }
+    auto pTrace = CreateTrace(std::format("{} {}", req.method, req.target));
+    res.set_header("X-Trace-Id", pTrace->GetId());
+    return pTrace;
+}
+
 /// @brief Process static file request handler. If the file is not embedded, return Unhandled so that the request
 ///        will be processed by the next handler.
 static httplib::Server::HandlerResponse ProcessStaticFileRequest(const httplib::Request& req, httplib::Response& res)
@@ -521,7 +1816,10 @@ static httplib::Server::HandlerResponse ProcessStaticFileRequest(const httplib::
     return httplib::Server::HandlerResponse::Unhandled;
 }
 
-/// @brief Handle get git log request. Request path is: /api/git-log?repo=...&path=...
+/// @brief Handle get git log request. Request path is: /api/git-log?repo=...&path=...&live=1. If live is set, the
+///        stream is kept open after the history is sent, and new commits are pushed as "prepend" events. All the work
+///        (including the git child process) is cancelled once the client disconnects. Note, the request outlives the
+///        content provider, so it is safe to capture it by reference.
 static void ProcessGetGitLogRequest(const httplib::Request& req, httplib::Response& res)
 {
     auto repo = GetHttpQueryParameter(req, "repo", "");
@@ -533,15 +1831,138 @@ static void ProcessGetGitLogRequest(const httplib::Request& req, httplib::Respon
     auto noMerges = GetHttpQueryParameter(req, "noMerges", "") == "1";
     auto commitId = GetHttpQueryParameter(req, "commit", "");
     auto authors = GetHttpQueryParameters(req, "author");
-    res.set_content_provider("text/event-stream",
+    auto live = GetHttpQueryParameter(req, "live", "") == "1";
+    auto pTrace = StartRequestTrace(req, res);
+    SetEventStreamProvider(res,
         [repo = std::move(repo), path = std::move(path), noMerges = std::move(noMerges), commitId = std::move(commitId),
-            authors = std::move(authors)](size_t offset, httplib::DataSink& sink) {
-            get_git_log(sink, repo, path, noMerges, commitId, authors);
+            authors = std::move(authors), live, pTrace = std::move(pTrace), &req](
+            size_t offset, httplib::DataSink& sink) {
+            TraceScope traceScope { pTrace.get() };
+            CancellationToken token {};
+            ConnectionWatch watch { token, req.is_connection_closed };
+            get_git_log(sink, token, repo, path, noMerges, commitId, authors, live);
             return false;
         });
 }
 
-/// @brief Handle get git commit detail request. Request path is: /api/git-commit/{commitId}
+static ThreadPool& GetStreamThreadPool()
+{
+    // Producers of event streams may wait for "git log", keep them away from the shared pool.
+    static ThreadPool s_thread_pool { std::thread::hardware_concurrency() };
+    return s_thread_pool;
+}
+
+static bool WriteEventStream(EventStream& stream, const char* data, size_t size)
+{
+    if (!stream.Write(data, size)) {
+        return false;
+    }
+    GetMetrics().streamedBytes += size;
+    return true;
+}
+
+/// @brief Live history of an event stream, it is kept alive by the stream until the connection is closed.
+struct LiveHistoryStream {
+    std::weak_ptr<EventStream> pStream {};
+    std::shared_ptr<GitRepository> pGit {};
+    std::shared_ptr<Trace> pTrace {};
+    std::unique_ptr<LiveHistory> pHistory {};
+    std::mutex mutex {};
+    std::shared_ptr<void> pSubscription {};
+};
+
+static void UpdateLiveHistoryStream(const std::weak_ptr<LiveHistoryStream>& pWeakLive)
+{
+    auto pLive = pWeakLive.lock();
+    auto pStream = pLive ? pLive->pStream.lock() : nullptr;
+    if (!pStream) {
+        return;
+    }
+
+    std::unique_lock lock { pLive->mutex };
+    if (!pStream->IsWritable()) {
+        // Come back once the client catches up, the update includes all changes made meanwhile.
+        pStream->WhenWritable([pWeakLive] {
+            GetStreamThreadPool().Enqueue([pWeakLive] { UpdateLiveHistoryStream(pWeakLive); });
+        });
+        return;
+    }
+
+    TraceScope traceScope { pLive->pTrace.get() };
+    try {
+        if (auto event = update_live_history(*pLive->pHistory, pStream->GetCancellationToken())) {
+            WriteEventStream(*pStream, event->c_str(), event->size());
+        }
+        if (pLive->pHistory->ended) {
+            pStream->End();
+        }
+    } catch (const std::exception&) {
+        pStream->End();
+    }
+}
+
+/// @brief Handle get git log request on the event stream server, the query is the same as /api/git-log. The history
+///        is sent from the stream pool, afterwards no thread is held until the repository watcher notices a change.
+static void ProcessStreamGitLogRequest(
+    const httplib::Request& req, httplib::Response& res, std::shared_ptr<EventStream> pStream)
+{
+    auto repo = GetHttpQueryParameter(req, "repo", "");
+    if (repo.empty()) {
+        res.status = httplib::StatusCode::NotFound_404;
+        return;
+    }
+    auto path = GetHttpQueryParameter(req, "path", "");
+    auto noMerges = GetHttpQueryParameter(req, "noMerges", "") == "1";
+    auto commitId = GetHttpQueryParameter(req, "commit", "");
+    auto authors = GetHttpQueryParameters(req, "author");
+    auto live = GetHttpQueryParameter(req, "live", "") == "1";
+    if (!AcquireEventStream(res)) {
+        return;
+    }
+    auto pTrace = StartRequestTrace(req, res);
+
+    ++GetMetrics().activeStreams;
+    pStream->Attach(std::shared_ptr<void> { nullptr, [](void*) {
+        --GetMetrics().activeStreams;
+        --s_streamCount;
+    } });
+    GetStreamThreadPool().Enqueue([pStream = std::move(pStream), repo = std::move(repo), path = std::move(path),
+                                      noMerges, commitId = std::move(commitId), authors = std::move(authors), live,
+                                      pTrace = std::move(pTrace)] {
+        TraceScope traceScope { pTrace.get() };
+        httplib::DataSink sink {};
+        sink.write = [&pStream](const char* data, size_t size) { return WriteEventStream(*pStream, data, size); };
+        sink.is_writable = [&pStream] { return !pStream->IsClosed(); };
+        try {
+            auto pGit = GetSharedGitRepository(repo);
+            auto pHistory = send_git_log(sink, pStream->GetCancellationToken(), *pGit, pGit->GetRepoRoot(),
+                std::filesystem::relative(path, pGit->GetRepoWorkDir()).string(), noMerges, commitId, authors, live);
+            if (!pHistory) {
+                pStream->End();
+                return;
+            }
+
+            auto pLive = std::make_shared<LiveHistoryStream>();
+            pLive->pStream = pStream;
+            pLive->pGit = pGit;
+            pLive->pTrace = pTrace;
+            pLive->pHistory = std::move(pHistory);
+            pLive->pSubscription = pGit->GetWatcher().Subscribe([pWeakLive = std::weak_ptr { pLive }] {
+                GetStreamThreadPool().Enqueue([pWeakLive] { UpdateLiveHistoryStream(pWeakLive); });
+            });
+            pStream->Attach(pLive);
+
+            // Catch up with changes made while the history was sent.
+            UpdateLiveHistoryStream(pLive);
+        } catch (const std::exception&) {
+            pStream->End();
+        }
+    });
+}
+
+/// @brief Handle get git commit detail request. Request path is:
+///        /api/git-commit/{commitId}?repo=...&mode=split&stat=1&file=...&continuation=..., where mode, stat, file and
+///        continuation are optional. file and continuation come from a truncated file patch, and get the rest of it.
 static void ProcessGetGitCommitRequest(const httplib::Request& req, httplib::Response& res)
 {
     auto repo = GetHttpQueryParameter(req, "repo", "");
@@ -553,7 +1974,346 @@ static void ProcessGetGitCommitRequest(const httplib::Request& req, httplib::Res
     auto commitId = req.path_params.at("commitId");
     auto path = GetHttpQueryParameter(req, "path", "");
     auto ignoreWhitespace = GetHttpQueryParameter(req, "ignoreWhitespace", "") == "1";
-    res.set_content(get_git_commit(repo, path, commitId, ignoreWhitespace), "application/json");
+    auto full = GetHttpQueryParameter(req, "full", "") == "1";
+    auto split = GetHttpQueryParameter(req, "mode", "") == "split";
+    auto statOnly = GetHttpQueryParameter(req, "stat", "") == "1";
+    auto file = GetHttpQueryParameter(req, "file", "");
+    auto continuation = GetHttpQueryNumber<size_t>(req, "continuation", 0);
+    auto pTrace = StartRequestTrace(req, res);
+    TraceScope traceScope { pTrace.get() };
+    CancellationToken token {};
+    ConnectionWatch watch { token, req.is_connection_closed };
+    res.set_content(
+        get_git_commit(token, repo, path, commitId, ignoreWhitespace, full, split, statOnly, file, continuation),
+        "application/json");
+}
+
+/// @brief Handle exceptions thrown by request handlers. Client exceptions (e.g. a missing repository, or the memory
+///        budget is used up) carry their own status code.
+static void ProcessException(const httplib::Request& req, httplib::Response& res, std::exception_ptr ep)
+{
+    try {
+        std::rethrow_exception(ep);
+    } catch (const ClientException& ex) {
+        res.status = ex.StatusCode();
+        res.set_content(ex.what(), "text/plain");
+    } catch (const std::exception& ex) {
+        res.status = httplib::StatusCode::InternalServerError_500;
+        res.set_content(ex.what(), "text/plain");
+    } catch (...) {
+        res.status = httplib::StatusCode::InternalServerError_500;
+    }
+}
+
+/// @brief Handle search request. Request path is: /api/search?repo=...&q=...&limit=...
+static void ProcessSearchRequest(const httplib::Request& req, httplib::Response& res)
+{
+    auto repo = GetHttpQueryParameter(req, "repo", "");
+    if (repo.empty()) {
+        res.status = httplib::StatusCode::NotFound_404;
+        return;
+    }
+
+    auto query = GetHttpQueryParameter(req, "q", "");
+    auto limit = GetHttpQueryNumber<size_t>(req, "limit", 1000);
+    res.set_content(search_git_log(repo, query, limit), "application/json");
+}
+
+/// @brief Handle pickaxe search request, matches are streamed as they are found. Request path is:
+///        /api/pickaxe?repo=...&path=...&commit=...&q=...&regex=1
+static void ProcessPickaxeSearchRequest(const httplib::Request& req, httplib::Response& res)
+{
+    auto repo = GetHttpQueryParameter(req, "repo", "");
+    auto text = GetHttpQueryParameter(req, "q", "");
+    if (repo.empty() || text.empty()) {
+        res.status = httplib::StatusCode::NotFound_404;
+        return;
+    }
+
+    auto path = GetHttpQueryParameter(req, "path", "");
+    auto commitId = GetHttpQueryParameter(req, "commit", "");
+    auto regex = GetHttpQueryParameter(req, "regex", "") == "1";
+    if (!path.empty()) {
+        auto pGit = GetSharedGitRepository(repo);
+        path = std::filesystem::relative(path, pGit->GetRepoWorkDir()).generic_string();
+    }
+
+    PickaxeQuery query {};
+    try {
+        query = PickaxeQuery::Create(std::move(text), regex, std::move(path));
+    } catch (const std::regex_error& ex) {
+        res.status = httplib::StatusCode::BadRequest_400;
+        res.set_content(ex.what(), "text/plain");
+        return;
+    }
+
+    SetEventStreamProvider(res,
+        [repo = std::move(repo), commitId = std::move(commitId), query = std::move(query), &req](
+            size_t offset, httplib::DataSink& sink) {
+            CancellationToken token {};
+            ConnectionWatch watch { token, req.is_connection_closed };
+            get_pickaxe_search(sink, token, repo, commitId, query);
+            return false;
+        });
+}
+
+/// @brief Handle blame request, ranges of lines are streamed as they are attributed. Request path is:
+///        /api/blame?repo=...&path=...&commit=...&near=... path is relative to the work directory, near is the commit
+///        the file was blamed at before, whose cached blame is reused if it is the parent or a child of commit.
+static void ProcessBlameRequest(const httplib::Request& req, httplib::Response& res)
+{
+    auto repo = GetHttpQueryParameter(req, "repo", "");
+    auto path = GetHttpQueryParameter(req, "path", "");
+    if (repo.empty() || path.empty()) {
+        res.status = httplib::StatusCode::NotFound_404;
+        return;
+    }
+
+    // The path is passed to "git blame" through the shell in double quotes.
+    if (path.find_first_of("\"$`\\\n") != std::string::npos) {
+        res.status = httplib::StatusCode::BadRequest_400;
+        res.set_content("Unsupported character in path.", "text/plain");
+        return;
+    }
+
+    auto commitId = GetHttpQueryParameter(req, "commit", "");
+    auto nearId = GetHttpQueryParameter(req, "near", "");
+    SetEventStreamProvider(res,
+        [repo = std::move(repo), path = std::move(path), commitId = std::move(commitId), nearId = std::move(nearId),
+            &req](size_t offset, httplib::DataSink& sink) {
+            CancellationToken token {};
+            ConnectionWatch watch { token, req.is_connection_closed };
+            get_blame(sink, token, repo, commitId, path, nearId);
+            return false;
+        });
+}
+
+/// @brief Handle compare request, the change from one commit to another. Request path is:
+///        /api/compare?repo=...&path=...&from=...&to=...&ignoreWhitespace=1&mode=split. The change is streamed file by
+///        file, unless file is set: then only the patch of file is returned as json, from continuation on.
+static void ProcessCompareRequest(const httplib::Request& req, httplib::Response& res)
+{
+    auto repo = GetHttpQueryParameter(req, "repo", "");
+    auto fromId = GetHttpQueryParameter(req, "from", "");
+    auto toId = GetHttpQueryParameter(req, "to", "");
+    if (repo.empty() || fromId.empty() || toId.empty()) {
+        res.status = httplib::StatusCode::NotFound_404;
+        return;
+    }
+
+    auto path = GetHttpQueryParameter(req, "path", "");
+    auto ignoreWhitespace = GetHttpQueryParameter(req, "ignoreWhitespace", "") == "1";
+    auto split = GetHttpQueryParameter(req, "mode", "") == "split";
+    auto file = GetHttpQueryParameter(req, "file", "");
+    if (!file.empty()) {
+        auto continuation = GetHttpQueryNumber<size_t>(req, "continuation", 0);
+        CancellationToken token {};
+        ConnectionWatch watch { token, req.is_connection_closed };
+        res.set_content(
+            get_compare_file(token, repo, path, fromId, toId, ignoreWhitespace, split, file, continuation),
+            "application/json");
+        return;
+    }
+
+    SetEventStreamProvider(res,
+        [repo = std::move(repo), path = std::move(path), fromId = std::move(fromId), toId = std::move(toId),
+            ignoreWhitespace, split, &req](size_t offset, httplib::DataSink& sink) {
+            CancellationToken token {};
+            ConnectionWatch watch { token, req.is_connection_closed };
+            try {
+                get_compare(sink, token, repo, path, fromId, toId, ignoreWhitespace, split);
+            } catch (const std::exception& ex) {
+                // E.g. the memory budget is used up, the status is sent already.
+                auto event = std::format("data: {}\n\n", dump({ { "done", true }, { "error", ex.what() } }));
+                sink.write(event.c_str(), event.size());
+            }
+            return false;
+        });
+}
+
+/// @brief Objects never change, so responses for one are cached by the browser for good, and are revalidated by the
+///        object id if the same object is reached through another commit. Return true if the client has it already.
+static bool SetGitObjectCacheHeaders(const httplib::Request& req, httplib::Response& res, const git_oid& id)
+{
+    auto etag = std::format("\"{}\"", GitHashToString(id.id));
+    res.set_header("ETag", etag);
+    res.set_header("Cache-Control", "private, max-age=31536000, immutable");
+    if (req.get_header_value("If-None-Match") == etag) {
+        res.status = httplib::StatusCode::NotModified_304;
+        return true;
+    }
+    return false;
+}
+
+/// @brief Handle tree request, the entries of a directory at a commit. Request path is:
+///        /api/tree/<commit>?repo=...&path=... path is relative to the work directory, the root if it is empty.
+static void ProcessGetTreeRequest(const httplib::Request& req, httplib::Response& res)
+{
+    auto repo = GetHttpQueryParameter(req, "repo", "");
+    if (repo.empty()) {
+        res.status = httplib::StatusCode::NotFound_404;
+        return;
+    }
+
+    auto pGit = GetSharedGitRepository(repo);
+    auto object
+        = find_commit_object(pGit->GetRepo(), req.path_params.at("commitId"), GetHttpQueryParameter(req, "path", ""));
+    if (!object || object->second != GIT_OBJECT_TREE) {
+        res.status = httplib::StatusCode::NotFound_404;
+        return;
+    }
+    if (SetGitObjectCacheHeaders(req, res, object->first)) {
+        return;
+    }
+    res.set_content(get_git_tree(pGit->GetRepo(), object->first), "application/json");
+}
+
+/// @brief Handle blob request, the content of a file at a commit. Request path is: /api/blob/<commit>/<path>?repo=...
+///        The response is written straight from the blob loaded by libgit2, which is kept (and counted against the
+///        memory budget) until the response is sent. Range requests are answered by httplib, as the length is known.
+static void ProcessGetBlobRequest(const httplib::Request& req, httplib::Response& res)
+{
+    auto repo = GetHttpQueryParameter(req, "repo", "");
+    if (repo.empty()) {
+        res.status = httplib::StatusCode::NotFound_404;
+        return;
+    }
+
+    auto pGit = GetSharedGitRepository(repo);
+    auto object = find_commit_object(pGit->GetRepo(), req.matches[1], req.matches[2]);
+    if (!object || object->second != GIT_OBJECT_BLOB) {
+        res.status = httplib::StatusCode::NotFound_404;
+        return;
+    }
+    if (SetGitObjectCacheHeaders(req, res, object->first)) {
+        return;
+    }
+
+    // Reserve the memory before the blob is loaded.
+    size_t size {};
+    git_object_t type {};
+    std::unique_ptr<git_odb> pOdb {};
+    if (git_repository_odb(std::out_ptr(pOdb), pGit->GetRepo())) {
+        throw std::runtime_error { "Open object database failed." };
+    }
+    if (git_odb_read_header(&size, &type, pOdb.get(), &object->first)) {
+        throw std::runtime_error { "Read blob header failed." };
+    }
+    auto pReservation = std::make_shared<MemoryReservation>();
+    pReservation->Grow(size);
+
+    std::unique_ptr<git_blob> pUniqueBlob {};
+    if (git_blob_lookup(std::out_ptr(pUniqueBlob), pGit->GetRepo(), &object->first)) {
+        throw std::runtime_error { "Load blob failed." };
+    }
+    std::shared_ptr<git_blob> pBlob = std::move(pUniqueBlob);
+    res.set_header("X-Content-Type-Options", "nosniff");
+    const auto* contentType
+        = git_blob_is_binary(pBlob.get()) ? "application/octet-stream" : "text/plain; charset=utf-8";
+    size = (size_t)git_blob_rawsize(pBlob.get());
+    if (!size) {
+        res.set_content("", contentType);
+        return;
+    }
+    res.set_content_provider(size, contentType,
+        [pGit = std::move(pGit), pBlob = std::move(pBlob), pReservation = std::move(pReservation)](
+            size_t offset, size_t length, httplib::DataSink& sink) {
+            return sink.write((const char*)git_blob_rawcontent(pBlob.get()) + offset, length);
+        });
+}
+
+/// @brief Handle server stats request. Request path is: /api/stats
+static void ProcessStatsRequest(const httplib::Request& req, httplib::Response& res)
+{
+    json j {};
+    j["residentMemoryBytes"] = GetResidentMemoryBytes();
+    res.set_content(dump(j), "application/json");
+}
+
+/// @brief Handle server info request, the web UI finds the event stream server here. Request path is: /api/server-info
+static void ProcessServerInfoRequest(const httplib::Request& req, httplib::Response& res)
+{
+    json j {};
+    j["streamPort"] = s_streamPort;
+    res.set_content(dump(j), "application/json");
+}
+
+/// @brief Handle warm-up status request. Request path is: /api/warmup
+static void ProcessWarmupRequest(const httplib::Request& req, httplib::Response& res)
+{
+    res.set_content(GetWarmupStatus().Format(), "application/json");
+}
+
+/// @brief Handle metrics request, in Prometheus text format. Request path is: /api/metrics
+static void ProcessMetricsRequest(const httplib::Request& req, httplib::Response& res)
+{
+    res.set_content(GetMetrics().Format() + FormatGitOptionMetrics() + GetDiffCache().FormatMetrics(),
+        "text/plain; version=0.0.4");
+}
+
+/// @brief Handle get trace request, in Chrome trace_event format. Request path is: /api/traces/{traceId}
+static void ProcessGetTraceRequest(const httplib::Request& req, httplib::Response& res)
+{
+    auto pTrace = FindTrace(req.path_params.at("traceId"));
+    if (!pTrace) {
+        res.status = httplib::StatusCode::NotFound_404;
+        return;
+    }
+    res.set_content(pTrace->Format(), "application/json");
+}
+
+/// @brief Warm the repository up in the background, so the first request from the browser finds it hot: open it, load
+///        refs, open the index of every pack (they are mmapped lazily by the first object lookup which misses them),
+///        then walk the first page of the history, which loads its commits into the object cache of the shared
+///        repository and the files "git log" reads into the page cache (the page itself isn't kept). Hot repositories
+///        are pinned, they are never evicted from the repository cache.
+static void PrewarmRepository(std::string repoPath, std::string path, std::string source, bool keepOpen)
+{
+    auto& status = GetWarmupStatus();
+    auto index = status.Begin(repoPath, std::move(source));
+    GetStreamThreadPool().Enqueue([repoPath = std::move(repoPath), path = std::move(path), keepOpen, &status, index] {
+        try {
+            status.Stage(index, "open");
+            auto pGit = GetSharedGitRepository(repoPath, /*pin=*/keepOpen);
+
+            status.Stage(index, "refs");
+            pGit->GetRefSnapshot();
+
+            status.Stage(index, "pack_indexes");
+            std::unique_ptr<git_odb> pOdb {};
+            if (!git_repository_odb(std::out_ptr(pOdb), pGit->Get())) {
+                git_oid missing {};
+                std::fill(std::begin(missing.id), std::end(missing.id), (unsigned char)0xff);
+                git_odb_exists(pOdb.get(), &missing);
+            }
+
+            // Only the caches are warmed, the browser's request walks and lays out the page again.
+            status.Stage(index, "first_page");
+            CancellationToken token {};
+            httplib::DataSink sink {};
+            sink.write = [](const char* data, size_t size) { return true; };
+            sink.is_writable = [] { return true; };
+            send_git_log(sink, token, *pGit, pGit->GetRepoRoot(),
+                std::filesystem::relative(path, pGit->GetRepoWorkDir()).string(), /*noMerges=*/false,
+                /*commitId=*/"", /*authors=*/{}, /*live=*/false);
+            status.End(index);
+        } catch (const std::exception& ex) {
+            // Not a repository, the browser will get the error as well.
+            status.End(index, ex.what());
+        }
+    });
+}
+
+/// @brief Handle a request from the control socket. {"command": "open", "repo": ..., "path": ...} announces a
+///        repository the browser is about to open.
+static std::string ProcessControlRequest(const std::string& request)
+{
+    auto j = json::parse(request, nullptr, /*allow_exceptions=*/false);
+    if (!j.is_object() || j.value("command", "") != "open") {
+        return "{\"ok\": false}";
+    }
+    PrewarmRepository(j.value("repo", ""), j.value("path", ""), "cli", /*keepOpen=*/false);
+    return "{\"ok\": true}";
 }
 
 /// @brief Start server. This function won't return until the server is stopped (currently, we never stop server).
@@ -561,11 +2321,29 @@ static int StartServer(const Option& option)
 {
     // Init libgit2.
     git_libgit2_init();
+    option.git.Apply();
+    GetMemoryBudget().SetLimit(option.memoryBudgetMb * 1024 * 1024);
+    s_maxFileDiffLines = option.maxFileDiffLines;
+    s_maxFileDiffBytes = option.maxFileDiffKb * 1024;
+    GetDiffCache().SetLimits(
+        option.diffCacheMb * 1024 * 1024, option.diffCacheDir, option.diffCacheDiskMb * 1024 * 1024);
 
     // Create http server.
+    // Idle keep-alive connections hold a worker until they time out, so keep the timeout short. Event streams don't
+    // hold a worker, but the number of them is limited.
     httplib::Server svr {};
-    svr.set_keep_alive_max_count(std::numeric_limits<int32_t>::max());
-    svr.set_keep_alive_timeout(std::numeric_limits<int32_t>::max());
+    svr.new_task_queue = [&option] { return new ServerTaskQueue { option.workers, option.maxQueued }; };
+    svr.set_keep_alive_max_count(option.keepAliveMaxCount);
+    svr.set_keep_alive_timeout(option.keepAliveTimeout);
+    s_maxStreams = option.maxStreams;
+    svr.set_exception_handler(ProcessException);
+
+    // Bind before anything else, the cli waiting for this server is told it is ready once requests can be served.
+    if (!svr.bind_to_port("localhost", option.port)) {
+        printf("Bind port %d failed, is another gitkf server running?\n", option.port);
+        git_libgit2_shutdown();
+        return 1;
+    }
 
     // If wwwroot is specified, mount it, otherwise, use the embedded files.
     if (option.wwwroot.empty()) {
@@ -580,9 +2358,67 @@ static int StartServer(const Option& option)
     // Add get git commit detail handler.
     svr.Get("/api/git-commit/:commitId", ProcessGetGitCommitRequest);
 
+    // Add search handler.
+    svr.Get("/api/search", ProcessSearchRequest);
+
+    // Add pickaxe search handler.
+    svr.Get("/api/pickaxe", ProcessPickaxeSearchRequest);
+
+    // Add blame handler.
+    svr.Get("/api/blame", ProcessBlameRequest);
+
+    // Add compare handler.
+    svr.Get("/api/compare", ProcessCompareRequest);
+
+    // Add tree and blob handlers.
+    svr.Get("/api/tree/:commitId", ProcessGetTreeRequest);
+    svr.Get(R"(/api/blob/([0-9a-f]+)/(.+))", ProcessGetBlobRequest);
+
+    // Add server stats handler.
+    svr.Get("/api/stats", ProcessStatsRequest);
+
+    // Add warm-up status handler.
+    svr.Get("/api/warmup", ProcessWarmupRequest);
+
+    // Add metrics handler.
+    svr.Get("/api/metrics", ProcessMetricsRequest);
+
+    // Add trace handler, traces are recorded for requests with "trace=1", or all requests if --trace is set.
+    s_traceAllRequests = option.trace;
+    svr.Get("/api/traces/:traceId", ProcessGetTraceRequest);
+
+    // Serve history streams from the event stream server as well, it doesn't need a thread per open stream. Only
+    // pages served by this server may read them.
+    EventStreamServer streamServer { option.streamIoThreads,
+        { std::format("http://localhost:{}", option.port), std::format("http://127.0.0.1:{}", option.port) } };
+    streamServer.Get("/api/git-log", ProcessStreamGitLogRequest);
+    if (option.streamPort) {
+        try {
+            streamServer.Start("localhost", (int)option.streamPort);
+            s_streamPort = option.streamPort;
+        } catch (const std::exception& ex) {
+            printf("Event stream server is disabled: %s\n", ex.what());
+        }
+    }
+    svr.Get("/api/server-info", ProcessServerInfoRequest);
+
+    // Listen on the control socket, the cli announces repositories there.
+    std::optional<ControlServer> controlServer {};
+    try {
+        controlServer.emplace(option.port, ProcessControlRequest);
+    } catch (const std::exception& ex) {
+        printf("Control socket is disabled: %s\n", ex.what());
+    }
+    NotifyServerReady(option.readyFd);
+
+    // Warm hot repositories up in the background, progress is reported by /api/warmup.
+    for (const auto& repoPath : option.hotRepositories) {
+        PrewarmRepository(repoPath, "", "config", /*keepOpen=*/true);
+    }
+
     // Start server. Note, this function wont return until the server is stopped (currently, we never stop server).
     printf("gitkf server is running...\n");
-    svr.listen("localhost", option.port);
+    svr.listen_after_bind();
 
     // Shutdown libgit2.
     git_libgit2_shutdown();
@@ -601,13 +2437,34 @@ export int gitkf_main(int argc, char* argv[])
     if (option.serverMode) {
         return StartServer(option);
     } else {
-        // Check the application is running or not.
-        auto client = httplib::Client { std::format("http://localhost:{}", option.port) };
-        client.set_connection_timeout(0, 1'000'000);
-        auto res = client.Get("/");
-        if (!res) {
-            // No server is running, start it.
-            RunAsDaemon(std::format("{} --server", get_current_app_full_path()));
+        // Announce the repository to the server, it starts warming it up before the browser connects. The control
+        // socket fails at once if no server is running, there is no connect timeout to wait for.
+        json request {};
+        request["command"] = "open";
+        request["repo"] = option.repoPath;
+        request["path"] = option.follow;
+        auto announce = [&request, &option] { return SendControlRequest(option.port, dump(request)).has_value(); };
+        if (!announce()) {
+            // The server may not support the control socket (e.g. on Windows), check the http port as well.
+            auto client = httplib::Client { std::format("http://localhost:{}", option.port) };
+            client.set_connection_timeout(0, 1'000'000);
+            if (!client.Get("/")) {
+                // No server is running, start it and wait until it is ready. If another cli has started one in the
+                // meantime, ours exits and the other one is announced to.
+                auto cmd = std::format("{} --server", get_current_app_full_path());
+                auto started = false;
+                try {
+                    started = StartServerAndWait(cmd, std::chrono::seconds { 10 });
+                } catch (const std::exception& ex) {
+                    fprintf(stderr, "Start server failed: %s\n", ex.what());
+                    return 1;
+                }
+                if (!announce() && !started && !client.Get("/")) {
+                    fprintf(stderr, "Start server failed: '%s' exited or was not ready within 10 seconds.\n",
+                        cmd.c_str());
+                    return 1;
+                }
+            }
         }
 
         // Server is running started, open the url.
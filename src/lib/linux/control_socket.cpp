@@ -0,0 +1,183 @@
+module;
+
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <format>
+#include <functional>
+#include <optional>
+#include <poll.h>
+#include <stdexcept>
+#include <stop_token>
+#include <string>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+
+export module gitkf:control_socket;
+import :platform_utils;
+
+/// @brief Path of the control socket of the server on port. It lives in $XDG_RUNTIME_DIR, or a private directory in
+///        /tmp, so only the current user can talk to their own server.
+static std::string GetControlSocketPath(int port)
+{
+    std::filesystem::path dir {};
+    if (auto runtimeDir = getenv("XDG_RUNTIME_DIR"); runtimeDir && *runtimeDir) {
+        dir = runtimeDir;
+    } else {
+        dir = std::filesystem::temp_directory_path() / std::format("gitkf-{}", getuid());
+        mkdir(dir.c_str(), 0700);
+        struct stat st {};
+        if (lstat(dir.c_str(), &st) || !S_ISDIR(st.st_mode) || st.st_uid != getuid() || (st.st_mode & 077)) {
+            throw std::runtime_error { std::format("'{}' is not a private directory.", dir.string()) };
+        }
+    }
+
+    auto path = (dir / std::format("gitkf-{}.sock", port)).string();
+    if (path.size() >= sizeof(sockaddr_un::sun_path)) {
+        throw std::runtime_error { std::format("Control socket path '{}' is too long.", path) };
+    }
+    return path;
+}
+
+static sockaddr_un CreateSocketAddress(const std::string& path)
+{
+    sockaddr_un addr { .sun_family = AF_UNIX };
+    std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+    return addr;
+}
+
+/// @brief Read one line (without \n) from fd, return nullopt if it is not complete before timeout.
+static std::optional<std::string> ReadLine(int fd, std::chrono::milliseconds timeout)
+{
+    std::string line {};
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    while (true) {
+        auto remaining = std::chrono::ceil<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+        pollfd pfd { .fd = fd, .events = POLLIN };
+        if (remaining.count() <= 0 || poll(&pfd, 1, (int)remaining.count()) <= 0) {
+            return std::nullopt;
+        }
+
+        char buffer[4096];
+        auto n = read(fd, buffer, sizeof(buffer));
+        if (n <= 0) {
+            return std::nullopt;
+        }
+        line.append(buffer, n);
+        if (auto pos = line.find('\n'); pos != std::string::npos) {
+            line.resize(pos);
+            return line;
+        }
+    }
+}
+
+static bool WriteAll(int fd, const std::string& data)
+{
+    // The peer may be gone already, don't get killed by SIGPIPE.
+    for (size_t offset = 0; offset < data.size();) {
+        auto n = send(fd, data.data() + offset, data.size() - offset, MSG_NOSIGNAL);
+        if (n <= 0) {
+            return false;
+        }
+        offset += n;
+    }
+    return true;
+}
+
+/// @brief Listen on the control socket of the server, the cli announces repositories here before the browser opens
+///        them. Every connection carries one request line and gets one reply line from handler, which must be quick.
+export class ControlServer {
+public:
+    using Handler = std::function<std::string(const std::string&)>;
+
+    ControlServer(int port, Handler handler)
+        : m_path { GetControlSocketPath(port) }
+        , m_handler { std::move(handler) }
+        , m_listenFd { socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0) }
+    {
+        // The http port is bound already, so a socket left here belongs to a server which is gone.
+        unlink(m_path.c_str());
+        auto addr = CreateSocketAddress(m_path);
+        if (m_listenFd.fd < 0 || bind(m_listenFd.fd, (sockaddr*)&addr, sizeof(addr)) || listen(m_listenFd.fd, 16)) {
+            throw std::runtime_error { std::format("Listen on '{}' failed, error code: {}.", m_path, errno) };
+        }
+        m_thread = std::jthread { [this](std::stop_token stopToken) { Run(stopToken); } };
+    }
+
+    ControlServer(const ControlServer&) = delete;
+
+    ~ControlServer()
+    {
+        m_thread = {};
+        unlink(m_path.c_str());
+    }
+
+private:
+    void Run(std::stop_token stopToken)
+    {
+        while (!stopToken.stop_requested()) {
+            pollfd pfd { .fd = m_listenFd.fd, .events = POLLIN };
+            if (poll(&pfd, 1, /*timeout=*/500) <= 0) {
+                continue;
+            }
+            FileDescriptor client { accept4(m_listenFd.fd, nullptr, nullptr, SOCK_CLOEXEC) };
+            if (client.fd < 0) {
+                continue;
+            }
+            if (auto request = ReadLine(client.fd, std::chrono::seconds { 1 })) {
+                WriteAll(client.fd, m_handler(*request) + "\n");
+            }
+        }
+    }
+
+    std::string m_path {};
+    Handler m_handler {};
+    FileDescriptor m_listenFd;
+    std::jthread m_thread {};
+};
+
+/// @brief Send a request line to the server on port and return its reply, or nullopt if no server is listening. This is
+///        a local socket round trip, no network timeout is involved.
+export std::optional<std::string> SendControlRequest(int port, const std::string& request)
+{
+    auto addr = CreateSocketAddress(GetControlSocketPath(port));
+    FileDescriptor fd { socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0) };
+    if (fd.fd < 0 || connect(fd.fd, (sockaddr*)&addr, sizeof(addr)) || !WriteAll(fd.fd, request + "\n")) {
+        return std::nullopt;
+    }
+    return ReadLine(fd.fd, std::chrono::seconds { 5 });
+}
+
+/// @brief Start the server command as a daemon and wait until it reports it is ready (see NotifyServerReady()). The
+///        command gets "--ready-fd <fd>" appended, the server writes to it once it is listening. Return false if the
+///        server exits (e.g. another one has taken the port) or timeout is reached.
+export bool StartServerAndWait(const std::string& cmd, std::chrono::milliseconds timeout)
+{
+    int fds[2] {};
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds)) {
+        throw std::runtime_error { std::format("Create socket pair failed, error code: {}.", errno) };
+    }
+    FileDescriptor readFd { fds[0] };
+    {
+        // Only the end of the server is inherited.
+        FileDescriptor writeFd { fds[1] };
+        fcntl(writeFd.fd, F_SETFD, 0);
+        RunAsDaemon(std::format("{} --ready-fd {}", cmd, writeFd.fd));
+    }
+    return ReadLine(readFd.fd, timeout) == "ready";
+}
+
+/// @brief Tell the cli which started the server that it is ready, see StartServerAndWait().
+export void NotifyServerReady(int readyFd)
+{
+    if (readyFd >= 0) {
+        WriteAll(readyFd, "ready\n");
+        close(readyFd);
+    }
+}
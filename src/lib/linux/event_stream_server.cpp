@@ -0,0 +1,563 @@
+module;
+
+#include "thirdparty/httplib.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <format>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <stdexcept>
+#include <string>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+export module gitkf:event_stream_server;
+import :cancellation;
+import :platform_utils;
+
+class FlushQueue;
+
+/// @brief Response of one event stream connection. Producers may write from any thread, the data is buffered and sent
+///        by the I/O thread of the connection. Write() never blocks, a producer which can wait parks itself with
+///        WhenWritable() while IsWritable() is false, and a client which falls too far behind is disconnected.
+export class EventStream : public std::enable_shared_from_this<EventStream> {
+public:
+    EventStream(int fd, std::shared_ptr<FlushQueue> pFlushQueue)
+        : m_fd { fd }
+        , m_pFlushQueue { std::move(pFlushQueue) }
+    {
+    }
+
+    EventStream(const EventStream&) = delete;
+
+    /// @brief Append data to the response, return false if the connection is closed or the response is ended. If the
+    ///        client is too far behind, the response is ended without the pending data and false is returned.
+    bool Write(const char* data, size_t size);
+
+    /// @brief Whether the client keeps up, producers should stop writing otherwise.
+    bool IsWritable() const
+    {
+        std::unique_lock lock { m_mutex };
+        return !m_closed && !m_ended && m_output.size() - m_outputOffset < kMaxBufferedBytes;
+    }
+
+    /// @brief Call callback once the stream is writable, right away if it is already. It is called on the I/O thread
+    ///        otherwise, so it must not block. It replaces the previous one, and is dropped once the response is ended.
+    void WhenWritable(std::function<void()> callback);
+
+    /// @brief End the response, the connection is closed once all buffered data is sent.
+    void End();
+
+    bool IsClosed() const
+    {
+        std::unique_lock lock { m_mutex };
+        return m_closed;
+    }
+
+    /// @brief Cancelled once the connection is closed.
+    CancellationToken& GetCancellationToken() { return m_token; }
+
+    /// @brief Keep the object alive until the connection is closed.
+    void Attach(std::shared_ptr<void> pObject)
+    {
+        std::unique_lock lock { m_mutex };
+        if (!m_closed) {
+            m_attachments.emplace_back(std::move(pObject));
+        }
+    }
+
+private:
+    friend class EventStreamServer;
+
+    // Producers are parked once this much data is waiting for the client, and the client is dropped at the hard limit.
+    static constexpr size_t kMaxBufferedBytes = 4 * 1024 * 1024;
+    static constexpr size_t kMaxPendingBytes = 64 * 1024 * 1024;
+
+    static constexpr auto kKeepAliveInterval = std::chrono::seconds { 15 };
+
+    /// @brief Send the response head before anything written so far, nothing is sent until the head is there. Return
+    ///        false if the connection should be closed.
+    bool Respond(const std::string& head, bool end)
+    {
+        {
+            std::unique_lock lock { m_mutex };
+            if (end) {
+                m_output.clear();
+                m_ended = true;
+            }
+            m_output.insert(0, head);
+            m_responding = true;
+        }
+        return Flush();
+    }
+
+    /// @brief Send as much buffered data as the socket takes, return false if the connection should be closed.
+    bool Flush()
+    {
+        std::function<void()> onWritable {};
+        std::unique_lock lock { m_mutex };
+        if (m_closed || !m_responding) {
+            return !m_closed;
+        }
+
+        auto sent = false;
+        while (m_outputOffset < m_output.size()) {
+            auto n = send(m_fd, m_output.data() + m_outputOffset, m_output.size() - m_outputOffset, MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    break;
+                }
+                return false;
+            }
+            m_outputOffset += n;
+            sent = true;
+        }
+        if (m_outputOffset == m_output.size() || m_outputOffset > kMaxBufferedBytes) {
+            m_output.erase(0, m_outputOffset);
+            m_outputOffset = 0;
+        }
+        if (sent) {
+            m_lastSend = std::chrono::steady_clock::now();
+        }
+        if (m_onWritable && m_output.size() - m_outputOffset < kMaxBufferedBytes) {
+            onWritable = std::move(m_onWritable);
+            m_onWritable = nullptr;
+        }
+        auto keep = !m_ended || !m_output.empty();
+        lock.unlock();
+        if (onWritable) {
+            onWritable();
+        }
+        return keep;
+    }
+
+    /// @brief Send a comment line if nothing has been sent for a while, so proxies keep the connection open and a dead
+    ///        client is noticed. Return false if the connection should be closed.
+    bool KeepAlive(std::chrono::steady_clock::time_point now)
+    {
+        {
+            std::unique_lock lock { m_mutex };
+            if (!m_responding || m_ended || now - m_lastSend < kKeepAliveInterval || !m_output.empty()) {
+                return true;
+            }
+            m_output = ": keep-alive\n\n";
+        }
+        return Flush();
+    }
+
+    void Close()
+    {
+        std::vector<std::shared_ptr<void>> attachments {};
+        std::function<void()> onWritable {};
+        {
+            std::unique_lock lock { m_mutex };
+            if (m_closed) {
+                return;
+            }
+            m_closed = true;
+            attachments = std::move(m_attachments);
+            onWritable = std::move(m_onWritable);
+        }
+        m_token.Cancel();
+    }
+
+    int m_fd { -1 };
+    std::shared_ptr<FlushQueue> m_pFlushQueue {};
+    CancellationToken m_token {};
+
+    mutable std::mutex m_mutex {};
+    std::string m_output {};
+    size_t m_outputOffset {};
+    bool m_responding {};
+    bool m_ended {};
+    bool m_closed {};
+    std::chrono::steady_clock::time_point m_lastSend { std::chrono::steady_clock::now() };
+    std::vector<std::shared_ptr<void>> m_attachments {};
+    std::function<void()> m_onWritable {};
+
+    // Only touched by the I/O thread.
+    std::string m_input {};
+    std::chrono::steady_clock::time_point m_acceptTime { std::chrono::steady_clock::now() };
+};
+
+/// @brief Streams which have new data to send, shared by an I/O thread and its streams. The eventfd wakes the I/O
+///        thread up, edge-triggered EPOLLOUT doesn't fire again for a socket which is writable all the time.
+class FlushQueue {
+public:
+    FlushQueue()
+        : m_eventFd { eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC) }
+    {
+        if (m_eventFd.fd < 0) {
+            throw std::runtime_error { std::format("Create eventfd failed, error code: {}.", errno) };
+        }
+    }
+
+    int GetFd() const { return m_eventFd.fd; }
+
+    void Push(std::shared_ptr<EventStream> pStream)
+    {
+        {
+            std::unique_lock lock { m_mutex };
+            m_streams.emplace_back(std::move(pStream));
+        }
+        uint64_t one { 1 };
+        [[maybe_unused]] auto n = write(m_eventFd.fd, &one, sizeof(one));
+    }
+
+    std::vector<std::shared_ptr<EventStream>> Pop()
+    {
+        uint64_t count {};
+        [[maybe_unused]] auto n = read(m_eventFd.fd, &count, sizeof(count));
+        std::unique_lock lock { m_mutex };
+        return std::exchange(m_streams, {});
+    }
+
+private:
+    FileDescriptor m_eventFd;
+    std::mutex m_mutex {};
+    std::vector<std::shared_ptr<EventStream>> m_streams {};
+};
+
+bool EventStream::Write(const char* data, size_t size)
+{
+    bool wasEmpty {};
+    bool overflow {};
+    {
+        std::unique_lock lock { m_mutex };
+        if (m_closed || m_ended) {
+            return false;
+        }
+        if (m_output.size() - m_outputOffset + size > kMaxPendingBytes) {
+            // The connection is closed once what is being sent now is done, the cut event is never completed.
+            m_output.resize(m_outputOffset);
+            m_ended = true;
+            overflow = true;
+        } else {
+            wasEmpty = m_output.size() == m_outputOffset;
+            m_output.append(data, size);
+        }
+    }
+    if (wasEmpty || overflow) {
+        m_pFlushQueue->Push(shared_from_this());
+    }
+    return !overflow;
+}
+
+void EventStream::WhenWritable(std::function<void()> callback)
+{
+    {
+        std::unique_lock lock { m_mutex };
+        if (m_closed || m_ended) {
+            return;
+        }
+        if (m_output.size() - m_outputOffset >= kMaxBufferedBytes) {
+            m_onWritable = std::move(callback);
+            return;
+        }
+    }
+    callback();
+}
+
+void EventStream::End()
+{
+    {
+        std::unique_lock lock { m_mutex };
+        if (m_closed || m_ended) {
+            return;
+        }
+        m_ended = true;
+    }
+    m_pFlushQueue->Push(shared_from_this());
+}
+
+/// @brief Server for long-lived event streams (text/event-stream over http/1.1). A few I/O threads wait on
+///        edge-triggered epoll for all connections, producers never touch sockets, so an idle stream costs a socket
+///        and a buffer instead of a thread. Requests are parsed just enough for "GET path?query", the response is
+///        sent with "Connection: close" and ends when the connection is closed.
+export class EventStreamServer {
+public:
+    /// @brief Called on an I/O thread once the request is received. Set res.status to reject the request, otherwise
+    ///        start producing the stream on another thread, handler must not block. res.headers are sent as well.
+    using Handler = std::function<void(const httplib::Request&, httplib::Response&, std::shared_ptr<EventStream>)>;
+
+    /// @brief allowedOrigins are the origins (e.g. "http://localhost:13324") whose pages may read the streams.
+    EventStreamServer(size_t ioThreadCount, std::vector<std::string> allowedOrigins)
+        : m_ioThreadCount { std::max<size_t>(ioThreadCount, 1) }
+        , m_allowedOrigins { std::move(allowedOrigins) }
+    {
+    }
+
+    EventStreamServer(const EventStreamServer&) = delete;
+
+    ~EventStreamServer() { Stop(); }
+
+    void Get(std::string path, Handler handler) { m_handlers.emplace(std::move(path), std::move(handler)); }
+
+    /// @brief Start listening and serving in background threads, throw if the address can't be bound.
+    void Start(const std::string& host, int port)
+    {
+        addrinfo hints { .ai_flags = AI_PASSIVE, .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+        addrinfo* pResult {};
+        if (auto error = getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &pResult)) {
+            throw std::runtime_error { std::format("Resolve {} failed: {}.", host, gai_strerror(error)) };
+        }
+        std::unique_ptr<addrinfo, decltype(&freeaddrinfo)> pAddresses { pResult, freeaddrinfo };
+
+        m_listenFd = socket(pResult->ai_family, pResult->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        auto reuse = 1;
+        if (m_listenFd < 0 || setsockopt(m_listenFd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse))
+            || bind(m_listenFd, pResult->ai_addr, pResult->ai_addrlen) || listen(m_listenFd, SOMAXCONN)) {
+            auto error = errno;
+            Stop();
+            throw std::runtime_error { std::format("Listen on {}:{} failed, error code: {}.", host, port, error) };
+        }
+
+        for (auto i = 0u; i < m_ioThreadCount; ++i) {
+            auto pIoThread = std::make_unique<IoThread>();
+            epoll_event event { .events = EPOLLIN | EPOLLEXCLUSIVE, .data = { .fd = m_listenFd } };
+            if (epoll_ctl(pIoThread->epollFd.fd, EPOLL_CTL_ADD, m_listenFd, &event)) {
+                auto error = errno;
+                Stop();
+                throw std::runtime_error { std::format("Add listen socket to epoll failed, error code: {}.", error) };
+            }
+            pIoThread->thread = std::jthread { [this, pIoThread = pIoThread.get()](std::stop_token stopToken) {
+                Run(*pIoThread, stopToken);
+            } };
+            m_ioThreads.emplace_back(std::move(pIoThread));
+        }
+    }
+
+    void Stop()
+    {
+        // Threads close all their connections on exit.
+        m_ioThreads.clear();
+        if (m_listenFd >= 0) {
+            close(std::exchange(m_listenFd, -1));
+        }
+    }
+
+private:
+    static constexpr size_t kMaxRequestSize = 16 * 1024;
+    static constexpr auto kRequestTimeout = std::chrono::seconds { 10 };
+
+    struct IoThread {
+        FileDescriptor epollFd { epoll_create1(EPOLL_CLOEXEC) };
+        std::shared_ptr<FlushQueue> pFlushQueue { std::make_shared<FlushQueue>() };
+        std::unordered_map<int, std::shared_ptr<EventStream>> streams {};
+        std::jthread thread {};
+    };
+
+    void Run(IoThread& ioThread, std::stop_token stopToken)
+    {
+        epoll_event wakeEvent { .events = EPOLLIN, .data = { .fd = ioThread.pFlushQueue->GetFd() } };
+        epoll_ctl(ioThread.epollFd.fd, EPOLL_CTL_ADD, wakeEvent.data.fd, &wakeEvent);
+
+        auto lastTick = std::chrono::steady_clock::now();
+        std::array<epoll_event, 256> events {};
+        while (!stopToken.stop_requested()) {
+            auto count = epoll_wait(ioThread.epollFd.fd, events.data(), (int)events.size(), /*timeout=*/1000);
+            for (auto i = 0; i < count; ++i) {
+                auto fd = events[i].data.fd;
+                if (fd == m_listenFd) {
+                    Accept(ioThread);
+                } else if (fd == ioThread.pFlushQueue->GetFd()) {
+                    for (const auto& pStream : ioThread.pFlushQueue->Pop()) {
+                        // The connection may be closed, and even the fd reused, since it was queued.
+                        auto it = ioThread.streams.find(pStream->m_fd);
+                        if (it != ioThread.streams.end() && it->second == pStream && !pStream->Flush()) {
+                            CloseStream(ioThread, pStream->m_fd);
+                        }
+                    }
+                } else if (auto it = ioThread.streams.find(fd); it != ioThread.streams.end()) {
+                    auto pStream = it->second;
+                    if ((events[i].events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP))
+                        || ((events[i].events & EPOLLIN) && !Receive(pStream))
+                        || ((events[i].events & EPOLLOUT) && !pStream->Flush())) {
+                        CloseStream(ioThread, fd);
+                    }
+                }
+            }
+
+            auto now = std::chrono::steady_clock::now();
+            if (now - lastTick >= std::chrono::seconds { 1 }) {
+                lastTick = now;
+                std::vector<int> expired {};
+                for (const auto& [fd, pStream] : ioThread.streams) {
+                    if ((!pStream->m_responding && now - pStream->m_acceptTime > kRequestTimeout)
+                        || !pStream->KeepAlive(now)) {
+                        expired.push_back(fd);
+                    }
+                }
+                for (auto fd : expired) {
+                    CloseStream(ioThread, fd);
+                }
+            }
+        }
+
+        while (!ioThread.streams.empty()) {
+            CloseStream(ioThread, ioThread.streams.begin()->first);
+        }
+        ioThread.pFlushQueue->Pop();
+    }
+
+    void Accept(IoThread& ioThread)
+    {
+        while (true) {
+            auto fd = accept4(m_listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) {
+                // EAGAIN once the backlog is drained, other errors (e.g. out of fds) are retried on the next event.
+                return;
+            }
+            auto pStream = std::make_shared<EventStream>(fd, ioThread.pFlushQueue);
+            epoll_event event { .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data = { .fd = fd } };
+            if (epoll_ctl(ioThread.epollFd.fd, EPOLL_CTL_ADD, fd, &event)) {
+                close(fd);
+                continue;
+            }
+            ioThread.streams.emplace(fd, std::move(pStream));
+        }
+    }
+
+    void CloseStream(IoThread& ioThread, int fd)
+    {
+        auto it = ioThread.streams.find(fd);
+        auto pStream = std::move(it->second);
+        ioThread.streams.erase(it);
+        epoll_ctl(ioThread.epollFd.fd, EPOLL_CTL_DEL, fd, nullptr);
+        pStream->Close();
+        close(fd);
+    }
+
+    /// @brief Read the request until the headers are complete, return false if the connection should be closed.
+    bool Receive(const std::shared_ptr<EventStream>& pStream)
+    {
+        char buffer[4096];
+        while (true) {
+            auto n = recv(pStream->m_fd, buffer, sizeof(buffer), 0);
+            if (n == 0) {
+                return false;
+            }
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return errno == EAGAIN || errno == EWOULDBLOCK;
+            }
+
+            // Nothing more is expected once the request is received.
+            if (pStream->m_responding) {
+                continue;
+            }
+            pStream->m_input.append(buffer, n);
+            auto headerEnd = pStream->m_input.find("\r\n\r\n");
+            if (headerEnd != std::string::npos) {
+                pStream->m_input.resize(headerEnd + 2);
+                if (!Dispatch(pStream)) {
+                    return false;
+                }
+            } else if (pStream->m_input.size() > kMaxRequestSize) {
+                auto status = httplib::StatusCode::RequestHeaderFieldsTooLarge_431;
+                if (!pStream->Respond(CreateResponseHead(status, {}), /*end=*/true)) {
+                    return false;
+                }
+            }
+        }
+    }
+
+    /// @brief Call the handler of the request and send the response head, return false if the connection should be
+    ///        closed.
+    bool Dispatch(const std::shared_ptr<EventStream>& pStream)
+    {
+        httplib::Request req {};
+        httplib::Response res {};
+        res.status = httplib::StatusCode::OK_200;
+
+        auto input = std::exchange(pStream->m_input, {});
+        auto lineEnd = input.find("\r\n");
+        auto requestLine = std::string_view { input }.substr(0, lineEnd);
+        auto methodEnd = requestLine.find(' ');
+        auto targetEnd = requestLine.find(' ', methodEnd + 1);
+        if (methodEnd == std::string_view::npos || targetEnd == std::string_view::npos) {
+            return pStream->Respond(CreateResponseHead(httplib::StatusCode::BadRequest_400, {}), /*end=*/true);
+        }
+        req.method = requestLine.substr(0, methodEnd);
+        req.target = requestLine.substr(methodEnd + 1, targetEnd - methodEnd - 1);
+        auto queryStart = req.target.find('?');
+        req.path = httplib::detail::decode_url(req.target.substr(0, queryStart), /*convert_plus_to_space=*/false);
+        if (queryStart != std::string::npos) {
+            httplib::detail::parse_query_text(req.target.substr(queryStart + 1), req.params);
+        }
+        for (auto start = lineEnd + 2; start < input.size();) {
+            auto end = input.find("\r\n", start);
+            auto colon = input.find(':', start);
+            if (colon < end) {
+                auto valueStart = input.find_first_not_of(" \t", colon + 1);
+                req.headers.emplace(input.substr(start, colon - start),
+                    valueStart < end ? input.substr(valueStart, end - valueStart) : std::string {});
+            }
+            start = end + 2;
+        }
+
+        auto it = m_handlers.find(req.path);
+        if (req.method != "GET") {
+            res.status = httplib::StatusCode::MethodNotAllowed_405;
+        } else if (it == m_handlers.end()) {
+            res.status = httplib::StatusCode::NotFound_404;
+        } else {
+            try {
+                it->second(req, res, pStream);
+            } catch (const std::exception&) {
+                // Headers set by the handler are dropped, they may describe the stream which never starts.
+                res = {};
+                res.status = httplib::StatusCode::InternalServerError_500;
+            }
+        }
+
+        auto origin = req.get_header_value("Origin");
+        if (std::ranges::find(m_allowedOrigins, origin) != m_allowedOrigins.end()) {
+            res.set_header("Access-Control-Allow-Origin", origin);
+            res.set_header("Vary", "Origin");
+        }
+        auto ok = res.status == httplib::StatusCode::OK_200;
+        if (ok) {
+            res.set_header("Content-Type", "text/event-stream");
+            res.set_header("Cache-Control", "no-cache");
+        }
+        return pStream->Respond(CreateResponseHead(res.status, res.headers), /*end=*/!ok);
+    }
+
+    static std::string CreateResponseHead(int status, const httplib::Headers& headers)
+    {
+        auto head = std::format("HTTP/1.1 {} {}\r\nConnection: close\r\n", status, httplib::status_message(status));
+        if (status != httplib::StatusCode::OK_200) {
+            head += "Content-Length: 0\r\n";
+        }
+        for (const auto& [name, value] : headers) {
+            head += std::format("{}: {}\r\n", name, value);
+        }
+        head += "\r\n";
+        return head;
+    }
+
+    size_t m_ioThreadCount {};
+    std::vector<std::string> m_allowedOrigins {};
+    std::unordered_map<std::string, Handler> m_handlers {};
+    int m_listenFd { -1 };
+    std::vector<std::unique_ptr<IoThread>> m_ioThreads {};
+};
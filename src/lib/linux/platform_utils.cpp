@@ -1,33 +1,287 @@
 module;
 
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdlib>
+#include <fcntl.h>
+#include <filesystem>
+#include <format>
+#include <fstream>
 #include <functional>
+#include <poll.h>
 #include <stdexcept>
 #include <string>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 export module gitkf:platform_utils;
+import :cancellation;
+import :metrics;
+import :tracing;
 
-export std::string ExternRun(const std::string& commandLine, const char* workingDir)
+struct FileDescriptor {
+    int fd { -1 };
+
+    explicit FileDescriptor(int fd)
+        : fd { fd }
+    {
+    }
+    FileDescriptor(const FileDescriptor&) = delete;
+    ~FileDescriptor()
+    {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+};
+
+/// @brief Run command (through /bin/sh) and feed its output to onData. The process is killed if onData returns false
+///        or the token is cancelled, in that case no exception is thrown for its exit code.
+export void ExternRun(const std::string& commandLine, const char* workingDir,
+    const std::function<bool(char*, size_t)>& onData, CancellationToken* pToken = nullptr)
 {
-    throw std::runtime_error { "Not Implemented" };
+    // Create a pipe for the child process's stdout.
+    int fds[2] {};
+    if (pipe2(fds, O_CLOEXEC)) {
+        throw std::runtime_error { std::format(
+            "'Create pipe for command '{}' failed, error code: {}.'", commandLine, errno) };
+    }
+    FileDescriptor readFd { fds[0] };
+    FileDescriptor writeFd { fds[1] };
+
+    ++GetMetrics().childProcesses;
+    auto spawnStart = std::chrono::steady_clock::now();
+    auto pid = fork();
+    if (pid < 0) {
+        throw std::runtime_error { std::format(
+            "'Create process failed for command '{}', error code: {}.'", commandLine, errno) };
+    } else if (!pid) {
+        // Child process, only async-signal-safe functions can be called here.
+        dup2(writeFd.fd, STDOUT_FILENO);
+        dup2(writeFd.fd, STDERR_FILENO);
+        if (workingDir && chdir(workingDir)) {
+            _exit(127);
+        }
+        execl("/bin/sh", "sh", "-c", commandLine.c_str(), (char*)nullptr);
+        _exit(127);
+    }
+    RecordSpan("spawn", spawnStart, std::chrono::steady_clock::now());
+
+    // Close write fd from parent, otherwise read() will hang even child process closes it already.
+    close(std::exchange(writeFd.fd, -1));
+
+    // Kill the process when the request is cancelled, read() will return once the process is gone.
+    std::atomic<bool> killed {};
+    CancellationToken::Registration cancelRegistration {};
+    if (pToken) {
+        cancelRegistration = pToken->OnCancel([&] {
+            killed = true;
+            kill(pid, SIGKILL);
+        });
+    }
+
+    // Read output data.
+    while (true) {
+        std::array<char, 4096> buffer;
+        auto readed = read(readFd.fd, buffer.data(), buffer.size());
+        if (readed < 0 && errno == EINTR) {
+            continue;
+        } else if (readed <= 0) {
+            break;
+        } else if (!onData(buffer.data(), readed)) {
+            // Don't need continue, kill the process.
+            killed = true;
+            kill(pid, SIGKILL);
+            break;
+        }
+    }
+
+    // Stop the cancellation before the process is reaped, its pid may be reused afterwards.
+    cancelRegistration.Reset();
+
+    // Wait child process exit.
+    int status {};
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+    }
+
+    if (!killed && !(WIFEXITED(status) && !WEXITSTATUS(status))) {
+        auto exitCode = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+        throw std::runtime_error { std::format("Command '{}' failed, exit code: {}.", commandLine, exitCode) };
+    }
 }
 
-export void ExternRun(
-    const std::string& commandLine, const char* workingDir, const std::function<bool(char*, size_t)>& onData)
+export std::string ExternRun(
+    const std::string& commandLine, const char* workingDir, CancellationToken* pToken = nullptr)
 {
-    throw std::runtime_error { "Not Implemented" };
+    std::string output {};
+    ExternRun(
+        commandLine, workingDir,
+        [&output](char* data, size_t size) {
+            output.append(data, size);
+            return true;
+        },
+        pToken);
+    return output;
 }
 
 export std::string get_current_app_full_path()
 {
-    throw std::runtime_error { "Not Implemented" };
+    return std::filesystem::read_symlink("/proc/self/exe").string();
+}
+
+/// @brief Start a process which is detached from the current one: it is in its own session, its stdio is /dev/null,
+///        and it is reparented to init (forked twice), so it is never left as a zombie. File descriptors without
+///        close-on-exec are inherited.
+static void SpawnDetached(const std::vector<std::string>& args)
+{
+    std::vector<char*> argv {};
+    for (const auto& arg : args) {
+        argv.push_back(const_cast<char*>(arg.c_str()));
+    }
+    argv.push_back(nullptr);
+
+    auto pid = fork();
+    if (pid < 0) {
+        throw std::runtime_error { std::format("Start '{}' failed, error code: {}.", args[0], errno) };
+    } else if (pid == 0) {
+        setsid();
+        if (fork()) {
+            _exit(0);
+        }
+        auto nullFd = open("/dev/null", O_RDWR);
+        dup2(nullFd, STDIN_FILENO);
+        dup2(nullFd, STDOUT_FILENO);
+        dup2(nullFd, STDERR_FILENO);
+        if (nullFd > STDERR_FILENO) {
+            close(nullFd);
+        }
+        execvp(argv[0], argv.data());
+        _exit(127);
+    }
+    waitpid(pid, nullptr, 0);
 }
 
 export void RunAsDaemon(const std::string& cmd)
 {
-    throw std::runtime_error { "Not Implemented" };
+    SpawnDetached({ "/bin/sh", "-c", cmd });
 }
 
 export void OpenUrl(const std::string& url)
 {
-    throw std::runtime_error { "Not Implemented" };
+    SpawnDetached({ "xdg-open", url });
+}
+
+/// @brief Create a new directory under the temporary directory which only the current user can enter (mkdtemp creates
+///        it with mode 0700), its name starts with prefix.
+export std::filesystem::path CreatePrivateTempDirectory(const std::string& prefix)
+{
+    auto pattern = (std::filesystem::temp_directory_path() / (prefix + "XXXXXX")).string();
+    if (!mkdtemp(pattern.data())) {
+        throw std::runtime_error { std::format("Create directory '{}' failed, error code: {}.", pattern, errno) };
+    }
+    return pattern;
+}
+
+/// @brief Create dir (and its parents) if it doesn't exist, the directory itself with mode 0700. Throw if it isn't a
+///        directory owned by the current user which only that user can enter, since others could read or plant files.
+export void CreatePrivateDirectory(const std::filesystem::path& dir)
+{
+    if (dir.has_parent_path()) {
+        std::filesystem::create_directories(dir.parent_path());
+    }
+    mkdir(dir.c_str(), 0700);
+    struct stat st {};
+    if (lstat(dir.c_str(), &st) || !S_ISDIR(st.st_mode) || st.st_uid != getuid() || (st.st_mode & 077)) {
+        throw std::runtime_error { std::format("'{}' is not a private directory.", dir.string()) };
+    }
+}
+
+/// @brief Get resident memory of the current process, 0 if it is not available.
+export size_t GetResidentMemoryBytes()
+{
+    // Second field of /proc/self/statm is the number of resident pages.
+    size_t totalPages {};
+    size_t residentPages {};
+    if (std::ifstream in { "/proc/self/statm" }; in >> totalPages >> residentPages) {
+        return residentPages * sysconf(_SC_PAGESIZE);
+    }
+    return 0;
+}
+
+export struct WatchedDirectory {
+    std::string path {};
+    bool recursive {};
+};
+
+/// @brief Watch directories with inotify. onEvent is called with changed = true whenever something under the
+///        directories is created, modified, renamed or deleted, and with changed = false every second if nothing
+///        happened. Stop watching when onEvent returns false.
+export void WatchDirectories(const std::vector<WatchedDirectory>& dirs, const std::function<bool(bool)>& onEvent)
+{
+    FileDescriptor inotify { inotify_init1(IN_NONBLOCK | IN_CLOEXEC) };
+    if (inotify.fd < 0) {
+        throw std::runtime_error { std::format("Init inotify failed, error code: {}.", errno) };
+    }
+
+    constexpr uint32_t kMask = IN_CREATE | IN_DELETE | IN_MODIFY | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR;
+    std::unordered_map<int, WatchedDirectory> watches {};
+    auto addWatch = [&](const std::string& path, bool recursive) {
+        auto wd = inotify_add_watch(inotify.fd, path.c_str(), kMask);
+        if (wd >= 0) {
+            watches[wd] = { path, recursive };
+        }
+        if (recursive) {
+            std::error_code ec {};
+            for (auto it = std::filesystem::recursive_directory_iterator { path, ec };
+                it != std::filesystem::recursive_directory_iterator {}; it.increment(ec)) {
+                if (ec) {
+                    break;
+                }
+                if (it->is_directory(ec) && (wd = inotify_add_watch(inotify.fd, it->path().c_str(), kMask)) >= 0) {
+                    watches[wd] = { it->path().string(), recursive };
+                }
+            }
+        }
+    };
+    for (const auto& dir : dirs) {
+        addWatch(dir.path, dir.recursive);
+    }
+
+    while (true) {
+        pollfd pfd { .fd = inotify.fd, .events = POLLIN };
+        auto res = poll(&pfd, 1, /*timeout=*/1000);
+        if (res < 0 && errno != EINTR) {
+            throw std::runtime_error { std::format("Poll inotify failed, error code: {}.", errno) };
+        }
+
+        auto changed = false;
+        alignas(inotify_event) char buffer[4096];
+        ssize_t size {};
+        while (res > 0 && (size = read(inotify.fd, buffer, sizeof(buffer))) > 0) {
+            changed = true;
+            for (auto* p = buffer; p < buffer + size;) {
+                auto* pEvent = (const inotify_event*)p;
+                p += sizeof(inotify_event) + pEvent->len;
+
+                // New sub directory in a recursive watched directory (e.g. refs/heads/feature/), watch it as well.
+                auto it = watches.find(pEvent->wd);
+                if ((pEvent->mask & IN_ISDIR) && (pEvent->mask & (IN_CREATE | IN_MOVED_TO)) && it != watches.end()
+                    && it->second.recursive && pEvent->len) {
+                    addWatch(it->second.path + "/" + pEvent->name, /*recursive=*/true);
+                }
+            }
+        }
+
+        if (!onEvent(changed)) {
+            return;
+        }
+    }
 }
\ No newline at end of file
@@ -0,0 +1,90 @@
+module;
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+
+export module gitkf:memory_budget;
+import :client_exception;
+
+/// @brief Bytes held by in-flight requests, against a global budget (0 means no limit). Requests reserve memory before
+///        they hold it, and degrade or are rejected when a reservation fails, so one giant commit can't take the
+///        whole shared server down.
+export class MemoryBudget {
+public:
+    void SetLimit(size_t bytes) { m_limit = bytes; }
+
+    size_t GetLimit() const { return m_limit; }
+    size_t GetUsed() const { return m_used; }
+    size_t GetPeak() const { return m_peak; }
+    uint64_t GetRejected() const { return m_rejected; }
+
+    bool TryReserve(size_t bytes)
+    {
+        auto used = m_used.load();
+        do {
+            if (m_limit && used + bytes > m_limit) {
+                return false;
+            }
+        } while (!m_used.compare_exchange_weak(used, used + bytes));
+
+        for (auto peak = m_peak.load(); used + bytes > peak && !m_peak.compare_exchange_weak(peak, used + bytes);) {
+        }
+        return true;
+    }
+
+    void Release(size_t bytes) { m_used -= bytes; }
+
+    void CountRejected() { ++m_rejected; }
+
+private:
+    std::atomic<size_t> m_limit {};
+    std::atomic<size_t> m_used {};
+    std::atomic<size_t> m_peak {};
+    std::atomic<uint64_t> m_rejected {};
+};
+
+export MemoryBudget& GetMemoryBudget()
+{
+    static MemoryBudget s_memoryBudget {};
+    return s_memoryBudget;
+}
+
+/// @brief Memory reserved by one request, it is released when the reservation is destroyed.
+export class MemoryReservation {
+public:
+    MemoryReservation() = default;
+
+    MemoryReservation(const MemoryReservation&) = delete;
+
+    ~MemoryReservation() { GetMemoryBudget().Release(m_bytes); }
+
+    bool TryGrow(size_t bytes)
+    {
+        if (!GetMemoryBudget().TryReserve(bytes)) {
+            return false;
+        }
+        m_bytes += bytes;
+        return true;
+    }
+
+    /// @brief Give back bytes which are no longer held, at most what is reserved.
+    void Shrink(size_t bytes)
+    {
+        bytes = std::min(bytes, m_bytes);
+        GetMemoryBudget().Release(bytes);
+        m_bytes -= bytes;
+    }
+
+    /// @brief Grow the reservation, or reject the request with 503 if the budget is used up.
+    void Grow(size_t bytes)
+    {
+        if (!TryGrow(bytes)) {
+            GetMemoryBudget().CountRejected();
+            throw ClientException { 503, "The server is out of its memory budget, please try again later." };
+        }
+    }
+
+private:
+    size_t m_bytes {};
+};
@@ -0,0 +1,196 @@
+module;
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <format>
+#include <initializer_list>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+
+export module gitkf:metrics;
+import :memory_budget;
+import :tracing;
+
+/// @brief Lock-free latency histogram. Bucket i counts durations up to 2^i microseconds (1us ~ 67s), the last one
+///        counts everything else, so relative error is bounded the same way for fast and slow requests.
+export class Histogram {
+public:
+    static constexpr size_t kBucketCount = 28;
+
+    void Record(std::chrono::steady_clock::duration duration)
+    {
+        auto ns = (uint64_t)std::max<int64_t>(std::chrono::nanoseconds { duration }.count(), 0);
+        auto us = (ns + 999) / 1000;
+        auto index = std::min<size_t>(us ? std::bit_width(us - 1) : 0, kBucketCount - 1);
+        m_buckets[index].fetch_add(1, std::memory_order_relaxed);
+        m_sumNs.fetch_add(ns, std::memory_order_relaxed);
+        m_count.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    /// @brief Append the histogram in Prometheus text format, labels is like 'stage="layout"'.
+    void Format(std::string& out, std::string_view name, std::string_view labels) const
+    {
+        uint64_t cumulative {};
+        for (auto i = 0u; i < kBucketCount - 1; ++i) {
+            cumulative += m_buckets[i].load(std::memory_order_relaxed);
+            out += std::format("{}_bucket{{{},le=\"{}\"}} {}\n", name, labels, (1ull << i) / 1e6, cumulative);
+        }
+        cumulative += m_buckets[kBucketCount - 1].load(std::memory_order_relaxed);
+        out += std::format("{}_bucket{{{},le=\"+Inf\"}} {}\n", name, labels, cumulative);
+        out += std::format("{}_sum{{{}}} {}\n", name, labels, m_sumNs.load(std::memory_order_relaxed) / 1e9);
+        out += std::format("{}_count{{{}}} {}\n", name, labels, m_count.load(std::memory_order_relaxed));
+    }
+
+private:
+    std::array<std::atomic<uint64_t>, kBucketCount> m_buckets {};
+    std::atomic<uint64_t> m_sumNs {};
+    std::atomic<uint64_t> m_count {};
+};
+
+/// @brief Accumulate time spent in a stage during one request, the total is recorded once when the timer is destroyed.
+///        A stage may be entered many times (e.g. once for every chunk of "git log" output), every time is recorded
+///        as a span of the current trace as well.
+export class StageTimer {
+public:
+    StageTimer(Histogram& histogram, std::string_view name)
+        : m_histogram { histogram }
+        , m_name { name }
+    {
+    }
+
+    StageTimer(const StageTimer&) = delete;
+
+    ~StageTimer()
+    {
+        // A stage which never ran (e.g. the request failed before it) isn't a sample.
+        Stop();
+        if (m_started) {
+            m_histogram.Record(m_total);
+        }
+    }
+
+    void Start()
+    {
+        m_started = true;
+        m_start = std::chrono::steady_clock::now();
+    }
+
+    void Stop()
+    {
+        if (m_start) {
+            auto start = *std::exchange(m_start, std::nullopt);
+            auto end = std::chrono::steady_clock::now();
+            m_total += end - start;
+            RecordSpan(m_name, start, end);
+        }
+    }
+
+    template <typename F>
+    decltype(auto) Measure(F&& f)
+    {
+        struct Guard {
+            StageTimer& timer;
+            ~Guard() { timer.Stop(); }
+        } guard { *this };
+        Start();
+        return std::forward<F>(f)();
+    }
+
+private:
+    Histogram& m_histogram;
+    std::string_view m_name {};
+    std::optional<std::chrono::steady_clock::time_point> m_start {};
+    std::chrono::steady_clock::duration m_total {};
+    bool m_started {};
+};
+
+export struct Metrics {
+    Histogram gitLogProcess {};
+    Histogram gitLogLookup {};
+    Histogram gitLogLayout {};
+    Histogram gitLogSerialize {};
+    Histogram gitLogWrite {};
+    Histogram gitLogTotal {};
+
+    Histogram gitCommitLookup {};
+    Histogram gitCommitStat {};
+    Histogram gitCommitProcess {};
+    Histogram gitCommitParse {};
+    Histogram gitCommitSerialize {};
+    Histogram gitCommitTotal {};
+
+    std::atomic<uint64_t> repositoryCacheHits {};
+    std::atomic<uint64_t> repositoryCacheMisses {};
+    std::atomic<uint64_t> childProcesses {};
+    std::atomic<uint64_t> streamedBytes {};
+    std::atomic<int64_t> activeStreams {};
+    std::atomic<uint64_t> spilledBytes {};
+    std::atomic<uint64_t> truncatedFiles {};
+
+    /// @brief Format all metrics in Prometheus text format.
+    std::string Format() const
+    {
+        std::string out {};
+        auto formatHistograms = [&out](std::string_view name, std::string_view help,
+                                    std::initializer_list<std::pair<std::string_view, const Histogram*>> stages) {
+            out += std::format("# HELP {} {}\n# TYPE {} histogram\n", name, help, name);
+            for (const auto& [stage, pHistogram] : stages) {
+                pHistogram->Format(out, name, std::format("stage=\"{}\"", stage));
+            }
+        };
+        auto formatValue = [&out](std::string_view name, std::string_view type, std::string_view help, auto value) {
+            out += std::format("# HELP {} {}\n# TYPE {} {}\n{} {}\n", name, help, name, type, name, value);
+        };
+
+        formatHistograms("gitkf_git_log_stage_seconds", "Time spent in each stage of a git log request.",
+            {
+                { "git_log", &gitLogProcess },
+                { "commit_lookup", &gitLogLookup },
+                { "layout", &gitLogLayout },
+                { "serialize", &gitLogSerialize },
+                { "write", &gitLogWrite },
+                { "total", &gitLogTotal },
+            });
+        formatHistograms("gitkf_git_commit_stage_seconds", "Time spent in each stage of a git commit request.",
+            {
+                { "commit_lookup", &gitCommitLookup },
+                { "diff_stat", &gitCommitStat },
+                { "git_show", &gitCommitProcess },
+                { "parse_patch", &gitCommitParse },
+                { "serialize", &gitCommitSerialize },
+                { "total", &gitCommitTotal },
+            });
+        formatValue("gitkf_repository_cache_hits_total", "counter", "Repository cache hits.",
+            repositoryCacheHits.load());
+        formatValue("gitkf_repository_cache_misses_total", "counter", "Repository cache misses.",
+            repositoryCacheMisses.load());
+        formatValue("gitkf_child_processes_total", "counter", "Child processes spawned.", childProcesses.load());
+        formatValue("gitkf_streamed_bytes_total", "counter", "Bytes written to event streams.", streamedBytes.load());
+        formatValue("gitkf_active_streams", "gauge", "Event streams currently open.", activeStreams.load());
+        formatValue(
+            "gitkf_spilled_bytes_total", "counter", "Bytes of git output spilled to disk.", spilledBytes.load());
+        formatValue("gitkf_truncated_files_total", "counter", "File diffs truncated by size or memory budget.",
+            truncatedFiles.load());
+        const auto& budget = GetMemoryBudget();
+        formatValue("gitkf_memory_budget_bytes", "gauge", "Memory budget of requests, 0 means no limit.",
+            budget.GetLimit());
+        formatValue("gitkf_memory_used_bytes", "gauge", "Memory reserved by in-flight requests.", budget.GetUsed());
+        formatValue(
+            "gitkf_memory_peak_bytes", "gauge", "Peak memory reserved by in-flight requests.", budget.GetPeak());
+        formatValue("gitkf_memory_rejected_requests_total", "counter", "Requests rejected by the memory budget.",
+            budget.GetRejected());
+        return out;
+    }
+};
+
+export Metrics& GetMetrics()
+{
+    static Metrics s_metrics {};
+    return s_metrics;
+}
@@ -1,7 +1,10 @@
 module;
 
 export module gitkf;
+export import :cancellation;
 export import :client_exception;
+export import :git_ref_snapshot;
 export import :git_repository;
 export import :git_smart_pointer;
-export import :gitkf;
\ No newline at end of file
+export import :gitkf;
+export import :line_reader;
\ No newline at end of file
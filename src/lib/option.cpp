@@ -1,12 +1,17 @@
 module;
 
+#include <algorithm>
 #include <cctype>
 #include <cstring>
 #include <filesystem>
+#include <fstream>
+#include <optional>
 #include <string>
+#include <thread>
 #include <vector>
 
 export module gitkf:option;
+import :git_options;
 
 constexpr int kDefaultPort = 13324;
 
@@ -32,6 +37,36 @@ static bool ParseOption(int& i, int argc, char* argv[], const char* key, std::st
     return false;
 }
 
+static bool ParseOption(int& i, int argc, char* argv[], const char* key, size_t& val)
+{
+    std::string str {};
+    if (ParseOption(i, argc, argv, key, str)) {
+        val = std::stoul(str);
+        return true;
+    }
+    return false;
+}
+
+static bool ParseOption(int& i, int argc, char* argv[], const char* key, int& val)
+{
+    std::string str {};
+    if (ParseOption(i, argc, argv, key, str)) {
+        val = std::stoi(str);
+        return true;
+    }
+    return false;
+}
+
+static bool ParseOption(int& i, int argc, char* argv[], const char* key, std::optional<size_t>& val)
+{
+    size_t value {};
+    if (ParseOption(i, argc, argv, key, value)) {
+        val = value;
+        return true;
+    }
+    return false;
+}
+
 template <typename T>
 bool ParseOption(int& i, int argc, char* argv[], const char* key, std::vector<T>& vals)
 {
@@ -66,17 +101,88 @@ export struct Option {
     std::vector<std::string> authors {};
     std::string wwwroot {};
     bool printVersion {};
+    bool trace {};
+
+    // Global libgit2 options, from --git-profile and the --git-* overrides.
+    GitOptions git {};
+
+    // Repositories which are opened and warmed up when the server starts, from --hot-repo and --hot-repos-file.
+    std::vector<std::string> hotRepositories {};
+
+    // Set by the cli which starts the server, see StartServerAndWait().
+    int readyFd { -1 };
+
+    // Http server limits, see StartServer().
+    size_t workers { std::max<size_t>(8, std::thread::hardware_concurrency()) };
+    size_t maxQueued { 256 };
+    size_t maxStreams { 64 };
+    size_t keepAliveMaxCount { 100 };
+    size_t keepAliveTimeout { 5 };
+
+    // Event stream server, see StartServer(). Port 0 disables it.
+    size_t streamPort { kDefaultPort + 1 };
+    size_t streamIoThreads { 2 };
+
+    // Memory which requests may hold at once, see MemoryBudget. 0 means no limit.
+    size_t memoryBudgetMb { 2048 };
+
+    // Limits of the diff of a file in a commit request, the rest is loaded on demand.
+    size_t maxFileDiffLines { 5000 };
+    size_t maxFileDiffKb { 1024 };
+
+    // Diff cache, see DiffCache. 0 MB disables it, an empty directory keeps it in memory only.
+    size_t diffCacheMb { 256 };
+    std::string diffCacheDir {};
+    size_t diffCacheDiskMb { 4096 };
 
     static Option Parse(int argc, char* argv[])
     {
         Option option {};
+        std::string hotRepositoriesFile {};
+        std::string gitProfile { "default" };
+        std::optional<size_t> gitCacheMaxMb {};
+        std::optional<size_t> gitCacheCommitLimit {};
+        std::optional<size_t> gitCacheTreeLimit {};
+        std::optional<size_t> gitCacheBlobLimit {};
+        std::optional<size_t> gitMwindowMb {};
+        std::optional<size_t> gitMwindowMappedLimitMb {};
+        std::optional<size_t> gitMwindowFileLimit {};
+        bool gitStrictObjects {};
+        bool gitVerifyHashes {};
         for (int i = 0; i < argc; ++i) {
             if (*argv[i] == '-') {
                 if (!ParseFlag(i, argv, "--server", option.serverMode) && !ParseFlag(i, argv, "-v", option.printVersion)
                     && !ParseFlag(i, argv, "--version", option.printVersion)
+                    && !ParseFlag(i, argv, "--trace", option.trace)
+                    && !ParseFlag(i, argv, "--git-strict-objects", gitStrictObjects)
+                    && !ParseFlag(i, argv, "--git-verify-hashes", gitVerifyHashes)
                     && !ParseOption(i, argc, argv, "--repo", option.repoPath)
                     && !ParseOption(i, argc, argv, "--wwwroot", option.wwwroot)
-                    && !ParseOption(i, argc, argv, "--author", option.authors)) {
+                    && !ParseOption(i, argc, argv, "--author", option.authors)
+                    && !ParseOption(i, argc, argv, "--workers", option.workers)
+                    && !ParseOption(i, argc, argv, "--max-queued", option.maxQueued)
+                    && !ParseOption(i, argc, argv, "--max-streams", option.maxStreams)
+                    && !ParseOption(i, argc, argv, "--keep-alive-max-count", option.keepAliveMaxCount)
+                    && !ParseOption(i, argc, argv, "--keep-alive-timeout", option.keepAliveTimeout)
+                    && !ParseOption(i, argc, argv, "--stream-port", option.streamPort)
+                    && !ParseOption(i, argc, argv, "--stream-io-threads", option.streamIoThreads)
+                    && !ParseOption(i, argc, argv, "--memory-budget-mb", option.memoryBudgetMb)
+                    && !ParseOption(i, argc, argv, "--max-file-diff-lines", option.maxFileDiffLines)
+                    && !ParseOption(i, argc, argv, "--max-file-diff-kb", option.maxFileDiffKb)
+                    && !ParseOption(i, argc, argv, "--diff-cache-mb", option.diffCacheMb)
+                    && !ParseOption(i, argc, argv, "--diff-cache-dir", option.diffCacheDir)
+                    && !ParseOption(i, argc, argv, "--diff-cache-disk-mb", option.diffCacheDiskMb)
+                    && !ParseOption(i, argc, argv, "--ready-fd", option.readyFd)
+                    && !ParseOption(i, argc, argv, "--hot-repo", option.hotRepositories)
+                    && !ParseOption(i, argc, argv, "--hot-repos-file", hotRepositoriesFile)
+                    && !ParseOption(i, argc, argv, "--git-profile", gitProfile)
+                    && !ParseOption(i, argc, argv, "--git-cache-max-mb", gitCacheMaxMb)
+                    && !ParseOption(i, argc, argv, "--git-cache-commit-limit", gitCacheCommitLimit)
+                    && !ParseOption(i, argc, argv, "--git-cache-tree-limit", gitCacheTreeLimit)
+                    && !ParseOption(i, argc, argv, "--git-cache-blob-limit", gitCacheBlobLimit)
+                    && !ParseOption(i, argc, argv, "--git-mwindow-mb", gitMwindowMb)
+                    && !ParseOption(i, argc, argv, "--git-mwindow-mapped-limit-mb", gitMwindowMappedLimitMb)
+                    && !ParseOption(i, argc, argv, "--git-mwindow-file-limit", gitMwindowFileLimit)) {
                     throw std::runtime_error { std::format("Unknonw option: {}", argv[i]) };
                 }
             } else {
@@ -97,6 +203,39 @@ export struct Option {
                 }
             }
         }
+
+        // Explicit options override the profile, whatever their order is.
+        constexpr size_t kMiB = 1024 * 1024;
+        option.git = GitOptions::FromProfile(gitProfile);
+        option.git.cacheMaxSize = gitCacheMaxMb ? *gitCacheMaxMb * kMiB : option.git.cacheMaxSize;
+        option.git.cacheCommitLimit = gitCacheCommitLimit.value_or(option.git.cacheCommitLimit);
+        option.git.cacheTreeLimit = gitCacheTreeLimit.value_or(option.git.cacheTreeLimit);
+        option.git.cacheBlobLimit = gitCacheBlobLimit.value_or(option.git.cacheBlobLimit);
+        option.git.mwindowSize = gitMwindowMb ? *gitMwindowMb * kMiB : option.git.mwindowSize;
+        option.git.mwindowMappedLimit = gitMwindowMappedLimitMb ? *gitMwindowMappedLimitMb * kMiB
+                                                                : option.git.mwindowMappedLimit;
+        option.git.mwindowFileLimit = gitMwindowFileLimit.value_or(option.git.mwindowFileLimit);
+        option.git.strictObjectCreation = gitStrictObjects;
+        option.git.verifyObjectHashes = gitVerifyHashes;
+
+        // One repository per line, empty lines and lines starting with '#' are ignored.
+        if (!hotRepositoriesFile.empty()) {
+            std::ifstream in { hotRepositoriesFile };
+            if (!in) {
+                throw std::runtime_error { std::format("Can't open {}.", hotRepositoriesFile) };
+            }
+            for (std::string line {}; std::getline(in, line);) {
+                line.erase(line.find_last_not_of(" \t\r") + 1);
+                if (!line.empty() && line[0] != '#') {
+                    option.hotRepositories.emplace_back(std::move(line));
+                }
+            }
+        }
+
+        // Repositories are cached by path, use the same form as the cli does.
+        for (auto& repoPath : option.hotRepositories) {
+            repoPath = std::filesystem::weakly_canonical(repoPath).string();
+        }
         return option;
     }
 };
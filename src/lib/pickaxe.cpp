@@ -0,0 +1,215 @@
+module;
+
+#include <algorithm>
+#include <atomic>
+#include <format>
+#include <functional>
+#include <latch>
+#include <memory>
+#include <mutex>
+#include <regex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <thirdparty/libgit2/include/git2.h>
+#include <vector>
+
+export module gitkf:pickaxe;
+import :cancellation;
+import :git_repository;
+import :git_smart_pointer;
+import :ring_buffer;
+import :thread_pool;
+
+constexpr size_t kPickaxeBatchSize = 512;
+
+/// @brief Pickaxe query, the same as "git log -S<text>" (or "git log -G<text>" if regex is set).
+export struct PickaxeQuery {
+    std::string text {};
+    bool regex {};
+    std::string path {};
+    std::shared_ptr<const std::regex> pRegex {};
+
+    /// @brief Throws std::regex_error if text is not a valid regex in regex mode.
+    static PickaxeQuery Create(std::string text, bool regex, std::string path)
+    {
+        PickaxeQuery query { .text = std::move(text), .regex = regex, .path = std::move(path) };
+        if (regex) {
+            query.pRegex = std::make_shared<const std::regex>(query.text, std::regex::extended | std::regex::optimize);
+        }
+        return query;
+    }
+};
+
+static size_t CountOccurrences(git_repository* pRepo, const git_oid& blobId, std::string_view text)
+{
+    std::unique_ptr<git_blob> pBlob {};
+    if (git_oid_is_zero(&blobId) || git_blob_lookup(std::out_ptr(pBlob), pRepo, &blobId)) {
+        return 0;
+    }
+
+    auto content = std::string_view {
+        (const char*)git_blob_rawcontent(pBlob.get()),
+        (size_t)git_blob_rawsize(pBlob.get()),
+    };
+    size_t count {};
+    for (auto pos = content.find(text); pos != std::string_view::npos; pos = content.find(text, pos + text.size())) {
+        ++count;
+    }
+    return count;
+}
+
+/// @brief Check whether the commit changes the number of occurrences of the text (-S), or adds/removes a line matching
+///        the regex (-G). Like "git log", merge commits are not checked.
+static bool MatchPickaxe(git_repository* pRepo, const git_oid& commitId, const PickaxeQuery& query)
+{
+    std::unique_ptr<git_commit> pCommit {};
+    if (!pRepo || git_commit_lookup(std::out_ptr(pCommit), pRepo, &commitId)) {
+        return false;
+    }
+    if (git_commit_parentcount(pCommit.get()) > 1) {
+        return false;
+    }
+
+    std::unique_ptr<git_tree> pTree {};
+    std::unique_ptr<git_tree> pParentTree {};
+    if (git_commit_tree(std::out_ptr(pTree), pCommit.get())) {
+        return false;
+    }
+    if (git_commit_parentcount(pCommit.get())) {
+        std::unique_ptr<git_commit> pParent {};
+        if (git_commit_parent(std::out_ptr(pParent), pCommit.get(), 0)) {
+            return false;
+        }
+        if (git_commit_tree(std::out_ptr(pParentTree), pParent.get())) {
+            return false;
+        }
+    }
+
+    git_diff_options options = GIT_DIFF_OPTIONS_INIT;
+    auto path = query.path;
+    auto* pPath = path.data();
+    if (!path.empty()) {
+        options.pathspec = { &pPath, 1 };
+    }
+
+    std::unique_ptr<git_diff> pDiff {};
+    if (git_diff_tree_to_tree(std::out_ptr(pDiff), pRepo, pParentTree.get(), pTree.get(), &options)) {
+        return false;
+    }
+
+    if (!query.pRegex) {
+        // -S only needs to count occurrences in both sides, no need to generate the diff at all.
+        for (auto i = 0u; i < git_diff_num_deltas(pDiff.get()); ++i) {
+            auto* pDelta = git_diff_get_delta(pDiff.get(), i);
+            if (CountOccurrences(pRepo, pDelta->old_file.id, query.text)
+                != CountOccurrences(pRepo, pDelta->new_file.id, query.text)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    auto onLine = [](const git_diff_delta*, const git_diff_hunk*, const git_diff_line* pLine, void* payload) {
+        if (pLine->origin != GIT_DIFF_LINE_ADDITION && pLine->origin != GIT_DIFF_LINE_DELETION) {
+            return 0;
+        }
+        auto* pRegex = (const std::regex*)payload;
+        return std::regex_search(pLine->content, pLine->content + pLine->content_len, *pRegex) ? 1 : 0;
+    };
+    return git_diff_foreach(pDiff.get(), nullptr, nullptr, nullptr, onLine, (void*)query.pRegex.get()) == 1;
+}
+
+/// @brief Result of a completed search, how many commits were scanned and which ones matched.
+struct PickaxeResult {
+    size_t scanned {};
+    std::vector<git_oid> matches {};
+};
+
+static std::string GetPickaxeCacheKey(const std::string& repoRoot, const git_oid& tip, const PickaxeQuery& query)
+{
+    return std::format("{}\n{}\n{}\n{}\n{}", repoRoot, GitHashToString(tip.id), query.regex, query.path, query.text);
+}
+
+/// @brief Run pickaxe search over the history of tip. Commits are distributed to the shared thread pool in batches,
+///        matches of every batch are reported in history order through onBatch as soon as the batch is done. Stop
+///        when onBatch returns false or the token is cancelled, workers check the token before every commit, so a
+///        cancelled search returns without finishing the current batch. Results of completed searches are cached per
+///        (query, tip).
+export void RunPickaxeSearch(const std::string& repoRoot, git_repository* pRepo, const git_oid& tip,
+    const PickaxeQuery& query, CancellationToken& token,
+    const std::function<bool(size_t scanned, const std::vector<git_oid>& matches)>& onBatch)
+{
+    static std::shared_mutex s_pickaxe_cache_mutex {};
+    static ring_buffer<std::pair<std::string, std::shared_ptr<const PickaxeResult>>, 32> s_pickaxe_cache;
+
+    auto key = GetPickaxeCacheKey(repoRoot, tip, query);
+    {
+        std::shared_lock read_lock { s_pickaxe_cache_mutex };
+        auto it = std::find_if(
+            s_pickaxe_cache.begin(), s_pickaxe_cache.end(), [&key](const auto& pair) { return pair.first == key; });
+        if (it != s_pickaxe_cache.end()) {
+            onBatch(it->second->scanned, it->second->matches);
+            return;
+        }
+    }
+
+    std::unique_ptr<git_revwalk> pWalk {};
+    if (git_revwalk_new(std::out_ptr(pWalk), pRepo)) {
+        return;
+    }
+    // Commit time order, like "git log". Topological order would walk the whole history before the first batch.
+    git_revwalk_sorting(pWalk.get(), GIT_SORT_TIME);
+    if (git_revwalk_push(pWalk.get(), &tip)) {
+        return;
+    }
+
+    auto& pool = GetSharedThreadPool();
+    auto pResult = std::make_shared<PickaxeResult>();
+    auto& scanned = pResult->scanned;
+    while (true) {
+        std::vector<git_oid> batch {};
+        git_oid oid {};
+        while (batch.size() < kPickaxeBatchSize && !git_revwalk_next(&oid, pWalk.get())) {
+            batch.push_back(oid);
+        }
+        if (batch.empty()) {
+            break;
+        }
+
+        // Workers pick the next commit from a shared counter, so a slow commit won't hold up others.
+        std::vector<char> matched(batch.size());
+        std::atomic<size_t> next {};
+        auto taskCount = std::min(pool.Size(), batch.size());
+        std::latch done { (std::ptrdiff_t)taskCount };
+        for (auto i = 0u; i < taskCount; ++i) {
+            pool.Enqueue([&] {
+                auto* pWorkerRepo = GetThreadLocalRepository(repoRoot);
+                for (auto j = next++; j < batch.size() && !token.IsCancelled(); j = next++) {
+                    matched[j] = MatchPickaxe(pWorkerRepo, batch[j], query);
+                }
+                done.count_down();
+            });
+        }
+        done.wait();
+        if (token.IsCancelled()) {
+            return;
+        }
+
+        std::vector<git_oid> matches {};
+        for (auto i = 0u; i < batch.size(); ++i) {
+            if (matched[i]) {
+                matches.push_back(batch[i]);
+            }
+        }
+        scanned += batch.size();
+        pResult->matches.insert(pResult->matches.end(), matches.begin(), matches.end());
+        if (!onBatch(scanned, matches)) {
+            // Cancelled, the result is incomplete, don't cache it.
+            return;
+        }
+    }
+
+    std::unique_lock write_lock { s_pickaxe_cache_mutex };
+    s_pickaxe_cache.push_front(std::make_pair(std::move(key), std::move(pResult)));
+}
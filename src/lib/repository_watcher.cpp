@@ -0,0 +1,147 @@
+module;
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stop_token>
+#include <string>
+#include <thread>
+#include <vector>
+
+export module gitkf:repository_watcher;
+import :git_ref_snapshot;
+import :platform_utils;
+
+/// @brief Watch HEAD, packed-refs and refs/ of a repository in a background thread, and bump a generation number
+///        whenever the refs or HEAD really changed, so that open history streams can push new commits.
+export class RepositoryWatcher {
+public:
+    RepositoryWatcher(std::string gitDir, std::string commonDir)
+        : m_gitDir { std::move(gitDir) }
+        , m_commonDir { std::move(commonDir) }
+        , m_state { ReadState() }
+        , m_thread { [this](std::stop_token stopToken) { Run(stopToken); } }
+    {
+    }
+
+    RepositoryWatcher(const RepositoryWatcher&) = delete;
+
+    uint64_t GetGeneration()
+    {
+        std::unique_lock lock { m_mutex };
+        return m_generation;
+    }
+
+    /// @brief Whether changes are noticed as they happen, so the generation is bumped right after refs change. It is
+    ///        false until the directories are watched, and if watching is not supported (the watcher polls then).
+    bool IsWatching() const { return m_watching; }
+
+    /// @brief Wait until the generation is different from lastGeneration or timeout, return the current generation.
+    uint64_t WaitForChange(uint64_t lastGeneration, std::chrono::milliseconds timeout)
+    {
+        std::unique_lock lock { m_mutex };
+        m_cond.wait_for(lock, timeout, [&] { return m_generation != lastGeneration; });
+        return m_generation;
+    }
+
+    /// @brief Call onChange on the watcher thread after every bump of the generation, for as long as the returned
+    ///        handle is alive. onChange must be quick, hand real work over to another thread.
+    [[nodiscard]] std::shared_ptr<void> Subscribe(std::function<void()> onChange)
+    {
+        auto pSubscriber = std::make_shared<std::function<void()>>(std::move(onChange));
+        std::unique_lock lock { m_mutex };
+        m_subscribers.emplace_back(pSubscriber);
+        return pSubscriber;
+    }
+
+private:
+    struct State {
+        uint64_t refStoreSignature {};
+        std::string head {};
+
+        bool operator==(const State&) const = default;
+    };
+
+    State ReadState() const
+    {
+        State state { .refStoreSignature = GetRefStoreSignature(m_commonDir) };
+        std::ifstream in { std::filesystem::path { m_gitDir } / "HEAD", std::ios::binary };
+        std::getline(in, state.head);
+        return state;
+    }
+
+    void Refresh()
+    {
+        auto state = ReadState();
+        {
+            std::unique_lock lock { m_mutex };
+            if (state == m_state) {
+                return;
+            }
+            m_state = std::move(state);
+            ++m_generation;
+        }
+        m_cond.notify_all();
+
+        std::vector<std::shared_ptr<std::function<void()>>> subscribers {};
+        {
+            std::unique_lock lock { m_mutex };
+            std::erase_if(m_subscribers, [&](const auto& pWeak) {
+                auto pSubscriber = pWeak.lock();
+                if (pSubscriber) {
+                    subscribers.push_back(std::move(pSubscriber));
+                }
+                return !pSubscriber;
+            });
+        }
+        for (const auto& pSubscriber : subscribers) {
+            (*pSubscriber)();
+        }
+    }
+
+    void Run(std::stop_token stopToken)
+    {
+        std::vector<WatchedDirectory> dirs {
+            { .path = m_gitDir, .recursive = false },
+            { .path = (std::filesystem::path { m_commonDir } / "refs").string(), .recursive = true },
+        };
+        if (std::filesystem::path { m_commonDir } != std::filesystem::path { m_gitDir }) {
+            // Linked worktree, packed-refs lives in the common dir.
+            dirs.push_back({ .path = m_commonDir, .recursive = false });
+        }
+
+        try {
+            WatchDirectories(dirs, [&](bool changed) {
+                m_watching = true;
+                if (changed) {
+                    Refresh();
+                }
+                return !stopToken.stop_requested();
+            });
+        } catch (const std::exception&) {
+            // Watching is not supported here, fall back to polling.
+            m_watching = false;
+            while (!stopToken.stop_requested()) {
+                std::this_thread::sleep_for(std::chrono::seconds { 1 });
+                Refresh();
+            }
+        }
+    }
+
+    std::string m_gitDir {};
+    std::string m_commonDir {};
+    std::mutex m_mutex {};
+    std::condition_variable m_cond {};
+    State m_state {};
+    uint64_t m_generation {};
+    std::atomic<bool> m_watching {};
+    std::vector<std::weak_ptr<std::function<void()>>> m_subscribers {};
+    std::jthread m_thread {};
+};
@@ -0,0 +1,621 @@
+module;
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <thirdparty/libgit2/include/git2.h>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+export module gitkf:search_index;
+import :git_oid;
+import :git_smart_pointer;
+
+constexpr char kSearchIndexMagic[8] = { 'G', 'K', 'F', 'S', 'I', 'D', 'X', '1' };
+
+/// @brief Sorted list of document ids, delta + varint encoded. Ids are always appended in increasing order, so the
+///        in-memory representation is also the on-disk representation.
+class PostingList {
+public:
+    void Add(uint32_t doc)
+    {
+        if (m_count && doc == m_last) {
+            return;
+        }
+
+        WriteVarint(doc - m_last);
+        m_last = doc;
+        ++m_count;
+    }
+
+    /// @brief Append the ids of other, they must be greater than the ids of this list.
+    void Append(const PostingList& other)
+    {
+        if (!other.m_count) {
+            return;
+        }
+
+        // Only the first id of other is not relative to a previous one.
+        size_t i {};
+        auto first = ReadVarint(other.m_bytes, i);
+        WriteVarint(first - m_last);
+        m_bytes.insert(m_bytes.end(), other.m_bytes.begin() + i, other.m_bytes.end());
+        m_last = other.m_last;
+        m_count += other.m_count;
+    }
+
+    std::vector<uint32_t> Decode() const
+    {
+        std::vector<uint32_t> docs {};
+        docs.reserve(m_count);
+        uint32_t doc {};
+        for (size_t i {}; i < m_bytes.size();) {
+            doc += ReadVarint(m_bytes, i);
+            docs.push_back(doc);
+        }
+        return docs;
+    }
+
+    uint32_t Size() const { return m_count; }
+
+    /// @brief Check a list read from disk: ids are increasing, within [minDoc, endDoc), and match the header.
+    bool IsValid(uint32_t minDoc, uint32_t endDoc) const
+    {
+        uint64_t doc {};
+        uint32_t count {};
+        for (size_t i {}; i < m_bytes.size(); ++count) {
+            uint64_t delta {};
+            for (auto shift = 0;; shift += 7) {
+                if (i == m_bytes.size() || shift > 28) {
+                    return false;
+                }
+                auto byte = m_bytes[i++];
+                delta |= (uint64_t)(byte & 0x7f) << shift;
+                if (!(byte & 0x80)) {
+                    break;
+                }
+            }
+            if (count && !delta) {
+                return false;
+            }
+            doc += delta;
+            if (doc < minDoc || doc >= endDoc) {
+                return false;
+            }
+        }
+        return count == m_count && doc == m_last;
+    }
+
+    void Write(std::ostream& out) const
+    {
+        uint32_t size = (uint32_t)m_bytes.size();
+        out.write((const char*)&m_last, sizeof(m_last));
+        out.write((const char*)&m_count, sizeof(m_count));
+        out.write((const char*)&size, sizeof(size));
+        out.write((const char*)m_bytes.data(), size);
+    }
+
+    /// @brief Read the list, fail if it is longer than maxSize bytes.
+    bool Read(std::istream& in, size_t maxSize)
+    {
+        uint32_t size {};
+        in.read((char*)&m_last, sizeof(m_last));
+        in.read((char*)&m_count, sizeof(m_count));
+        in.read((char*)&size, sizeof(size));
+        if (size > maxSize) {
+            in.setstate(std::ios::failbit);
+        }
+        m_bytes.resize(in ? size : 0);
+        in.read((char*)m_bytes.data(), m_bytes.size());
+        return (bool)in;
+    }
+
+private:
+    void WriteVarint(uint32_t value)
+    {
+        while (value >= 0x80) {
+            m_bytes.push_back((uint8_t)(value | 0x80));
+            value >>= 7;
+        }
+        m_bytes.push_back((uint8_t)value);
+    }
+
+    static uint32_t ReadVarint(const std::vector<uint8_t>& bytes, size_t& i)
+    {
+        uint32_t value {};
+        for (auto shift = 0; i < bytes.size(); shift += 7) {
+            auto byte = bytes[i++];
+            value |= (uint32_t)(byte & 0x7f) << shift;
+            if (!(byte & 0x80)) {
+                break;
+            }
+        }
+        return value;
+    }
+
+    std::vector<uint8_t> m_bytes {};
+    uint32_t m_last {};
+    uint32_t m_count {};
+};
+
+static uint32_t MakeTrigram(const char* p) { return ((uint8_t)p[0] << 16) | ((uint8_t)p[1] << 8) | (uint8_t)p[2]; }
+
+static std::string ToLower(std::string_view str)
+{
+    std::string res { str };
+    for (auto& ch : res) {
+        if (ch >= 'A' && ch <= 'Z') {
+            ch = ch - 'A' + 'a';
+        }
+    }
+    return res;
+}
+
+/// @brief Non-ASCII bytes are treated as word characters so that UTF-8 words are kept as a whole.
+static bool IsTokenChar(char ch) { return (uint8_t)ch >= 0x80 || std::isalnum((uint8_t)ch) || ch == '_'; }
+
+template <typename Fn>
+void ForEachToken(std::string_view text, Fn&& fn)
+{
+    size_t i {};
+    while (i < text.size()) {
+        while (i < text.size() && !IsTokenChar(text[i])) {
+            ++i;
+        }
+        auto start = i;
+        while (i < text.size() && IsTokenChar(text[i])) {
+            ++i;
+        }
+        if (i > start) {
+            fn(text.substr(start, i - start));
+        }
+    }
+}
+
+/// @brief The text used for substring (trigram) search: summary, author name and author email.
+static std::string GetSubstringSearchText(const git_commit* pCommit)
+{
+    auto message = std::string_view { git_commit_message(pCommit) };
+    auto text = std::string { message.substr(0, message.find('\n')) };
+    if (auto pAuthor = git_commit_author(pCommit)) {
+        text += '\n';
+        text += pAuthor->name;
+        text += " <";
+        text += pAuthor->email;
+        text += '>';
+    }
+    return ToLower(text);
+}
+
+export struct SearchResult {
+    std::vector<git_oid> ids {};
+    bool truncated {};
+};
+
+/// @brief Commits indexed by one update, and the tips they were walked from. The index file is a sequence of
+///        segments, each update appends one, so the whole index is one segment merged with the following ones.
+struct SearchIndexSegment {
+    std::vector<git_oid> docs {};
+    std::vector<git_oid> tips {};
+    std::unordered_map<std::string, PostingList> tokens {};
+    std::unordered_map<uint32_t, PostingList> trigrams {};
+
+    /// @brief Add the commit as document firstDoc + docs.size(), firstDoc is the number of documents before this
+    ///        segment.
+    void AddCommit(uint32_t firstDoc, const git_commit* pCommit)
+    {
+        auto doc = firstDoc + (uint32_t)docs.size();
+        docs.push_back(*git_commit_id(pCommit));
+
+        auto text = GetSubstringSearchText(pCommit);
+        for (auto i = 0u; i + 3 <= text.size(); ++i) {
+            trigrams[MakeTrigram(text.data() + i)].Add(doc);
+        }
+
+        auto addTokens = [&](std::string_view str) {
+            ForEachToken(ToLower(str), [&](std::string_view token) { tokens[std::string { token }].Add(doc); });
+        };
+        addTokens(git_commit_message(pCommit));
+        if (auto pAuthor = git_commit_author(pCommit)) {
+            addTokens(pAuthor->name);
+            addTokens(pAuthor->email);
+        }
+    }
+
+    /// @brief Append the following segment, the posting lists of the first one are taken over as they are.
+    void Append(SearchIndexSegment&& other)
+    {
+        if (docs.empty()) {
+            *this = std::move(other);
+            return;
+        }
+
+        docs.insert(docs.end(), other.docs.begin(), other.docs.end());
+        tips = std::move(other.tips);
+        for (const auto& [token, list] : other.tokens) {
+            tokens[token].Append(list);
+        }
+        for (const auto& [trigram, list] : other.trigrams) {
+            trigrams[trigram].Append(list);
+        }
+    }
+
+    void Write(std::ostream& out) const
+    {
+        auto writeOids = [&out](const std::vector<git_oid>& oids) {
+            uint32_t count = (uint32_t)oids.size();
+            out.write((const char*)&count, sizeof(count));
+            out.write((const char*)oids.data(), oids.size() * sizeof(git_oid));
+        };
+
+        writeOids(docs);
+        writeOids(tips);
+
+        uint32_t count = (uint32_t)tokens.size();
+        out.write((const char*)&count, sizeof(count));
+        for (const auto& [token, list] : tokens) {
+            uint32_t size = (uint32_t)token.size();
+            out.write((const char*)&size, sizeof(size));
+            out.write(token.data(), size);
+            list.Write(out);
+        }
+
+        count = (uint32_t)trigrams.size();
+        out.write((const char*)&count, sizeof(count));
+        for (const auto& [trigram, list] : trigrams) {
+            out.write((const char*)&trigram, sizeof(trigram));
+            list.Write(out);
+        }
+    }
+
+    /// @brief Read a segment which follows firstDoc documents, return false if it is truncated or corrupted. The file
+    ///        is fileSize bytes, no count in it may claim more than that.
+    bool Read(std::istream& in, uint32_t firstDoc, size_t fileSize)
+    {
+        auto readOids = [&](std::vector<git_oid>& oids) {
+            uint32_t count {};
+            in.read((char*)&count, sizeof(count));
+            if ((uint64_t)count * sizeof(git_oid) > fileSize) {
+                in.setstate(std::ios::failbit);
+            }
+            oids.resize(in ? count : 0);
+            in.read((char*)oids.data(), oids.size() * sizeof(git_oid));
+        };
+
+        readOids(docs);
+        readOids(tips);
+
+        uint32_t count {};
+        in.read((char*)&count, sizeof(count));
+        for (auto i = 0u; in && i < count; ++i) {
+            uint32_t size {};
+            in.read((char*)&size, sizeof(size));
+            std::string token(in && size <= fileSize ? size : 0, '\0');
+            in.read(token.data(), token.size());
+            tokens[std::move(token)].Read(in, fileSize);
+        }
+
+        in.read((char*)&count, sizeof(count));
+        for (auto i = 0u; in && i < count; ++i) {
+            uint32_t trigram {};
+            in.read((char*)&trigram, sizeof(trigram));
+            trigrams[trigram].Read(in, fileSize);
+        }
+
+        // Search looks documents up by the ids in posting lists, so they must stay within this segment.
+        auto endDoc = (uint64_t)firstDoc + docs.size();
+        auto isValid = [&](const auto& lists) {
+            return std::ranges::all_of(lists, [&](const auto& item) {
+                return endDoc <= UINT32_MAX && item.second.IsValid(firstDoc, (uint32_t)endDoc);
+            });
+        };
+        return in && isValid(tokens) && isValid(trigrams);
+    }
+};
+
+/// @brief Inverted index over commit messages, author names and emails. Every commit gets a document id in reverse
+///        history order (the oldest commit gets the smallest id), so newly created commits are simply appended and
+///        "history order" is descending document id.
+///
+///        Two kinds of posting lists are kept:
+///          - tokens: lower-cased words of the whole message and author, used for exact word match.
+///          - trigrams: every 3 bytes of the lower-cased summary and author, used for substring match. Candidates
+///            found by trigrams are verified against the real commit before being returned.
+export class SearchIndex {
+public:
+    explicit SearchIndex(std::string indexPath)
+        : m_indexPath { std::move(indexPath) }
+    {
+        Load();
+    }
+
+    /// @brief Index commits reachable from tips but not from the tips indexed last time. Tips which are not committish
+    ///        are ignored. New commits are walked without blocking searches, and merged into the index at the end. If
+    ///        another update is running, return false right away, the search sees the commits indexed so far then.
+    bool Update(git_repository* pRepo, std::vector<git_oid> tips)
+    {
+        std::sort(tips.begin(), tips.end(), [](const auto& a, const auto& b) { return git_oid_cmp(&a, &b) < 0; });
+        tips.erase(std::unique(tips.begin(), tips.end(), GitOidEqual {}), tips.end());
+
+        {
+            std::shared_lock read_lock { m_mutex };
+            if (std::ranges::equal(tips, m_index.tips, GitOidEqual {})) {
+                return true;
+            }
+        }
+
+        // The index is only changed by the update holding this lock, so it may read the index without m_mutex.
+        std::unique_lock update_lock { m_updateMutex, std::try_to_lock };
+        if (!update_lock) {
+            return false;
+        }
+        if (std::ranges::equal(tips, m_index.tips, GitOidEqual {})) {
+            return true;
+        }
+
+        std::unique_ptr<git_revwalk> pWalk {};
+        if (git_revwalk_new(std::out_ptr(pWalk), pRepo)) {
+            return true;
+        }
+        git_revwalk_sorting(pWalk.get(), GIT_SORT_TOPOLOGICAL | GIT_SORT_TIME | GIT_SORT_REVERSE);
+        for (const auto& tip : tips) {
+            git_revwalk_push(pWalk.get(), &tip);
+        }
+        for (const auto& tip : m_index.tips) {
+            // Old tips may be gone (e.g. rewritten branches), that is fine, their history is indexed already.
+            git_revwalk_hide(pWalk.get(), &tip);
+        }
+
+        auto firstDoc = (uint32_t)m_index.docs.size();
+        SearchIndexSegment segment { .tips = std::move(tips) };
+        git_oid oid {};
+        while (!git_revwalk_next(&oid, pWalk.get())) {
+            if (m_oidToDoc.contains(oid)) {
+                continue;
+            }
+            std::unique_ptr<git_commit> pCommit {};
+            if (!git_commit_lookup(std::out_ptr(pCommit), pRepo, &oid)) {
+                segment.AddCommit(firstDoc, pCommit.get());
+            }
+        }
+
+        // Appending the segment is proportional to the new commits, the file is rewritten once in a while to merge
+        // the segments.
+        auto rewrite = m_rewrite || m_segmentCount >= kMaxSegments || !std::filesystem::exists(m_indexPath);
+        if (!rewrite && !segment.docs.empty()) {
+            std::ofstream out { m_indexPath, std::ios::binary | std::ios::app };
+            segment.Write(out);
+            ++m_segmentCount;
+            m_rewrite = !out;
+        }
+
+        // The first update indexes the whole history, its map is built outside the lock as well.
+        std::unordered_map<git_oid, uint32_t, GitOidHash, GitOidEqual> oidToDoc {};
+        if (m_oidToDoc.empty()) {
+            oidToDoc.reserve(segment.docs.size());
+            for (auto i = 0u; i < segment.docs.size(); ++i) {
+                oidToDoc.emplace(segment.docs[i], i);
+            }
+        }
+
+        {
+            std::unique_lock write_lock { m_mutex };
+            if (m_oidToDoc.empty()) {
+                m_oidToDoc = std::move(oidToDoc);
+            }
+            for (auto i = 0u; firstDoc && i < segment.docs.size(); ++i) {
+                m_oidToDoc.emplace(segment.docs[i], firstDoc + i);
+            }
+            m_index.Append(std::move(segment));
+        }
+
+        if (rewrite) {
+            Save();
+        }
+        return true;
+    }
+
+    /// @brief Search commits matching all whitespace separated terms in query. A term matches a commit if it is a word
+    ///        of the commit message, a substring of the summary/author, or a substring of a ref pointing to the commit.
+    ///        Matched commits are returned in history order, at most limit ids.
+    SearchResult Search(git_repository* pRepo, std::string_view query,
+        const std::vector<std::pair<std::string, git_oid>>& refs, size_t limit) const
+    {
+        std::shared_lock read_lock { m_mutex };
+
+        struct Term {
+            std::string text {};
+            std::vector<uint32_t> definite {};
+            std::vector<uint32_t> candidates {};
+        };
+
+        std::vector<Term> terms {};
+        for (auto& text : SplitQuery(query)) {
+            Term term { .text = std::move(text) };
+            if (auto it = m_index.tokens.find(term.text); it != m_index.tokens.end()) {
+                term.definite = it->second.Decode();
+            }
+            for (const auto& [name, oid] : refs) {
+                if (ToLower(name).find(term.text) != std::string::npos) {
+                    if (auto it = m_oidToDoc.find(oid); it != m_oidToDoc.end()) {
+                        term.definite.push_back(it->second);
+                    }
+                }
+            }
+            std::sort(term.definite.begin(), term.definite.end());
+            term.candidates = GetTrigramCandidates(term.text);
+            terms.emplace_back(std::move(term));
+        }
+
+        SearchResult result {};
+        if (terms.empty()) {
+            return result;
+        }
+
+        // Drive the search by the most selective term, every other term is checked by binary search.
+        auto& driver = *std::ranges::min_element(
+            terms, {}, [](const auto& term) { return term.definite.size() + term.candidates.size(); });
+        std::vector<uint32_t> docs {};
+        std::ranges::set_union(driver.definite, driver.candidates, std::back_inserter(docs));
+
+        for (auto it = docs.rbegin(); it != docs.rend(); ++it) {
+            auto doc = *it;
+            std::string text {};
+            auto matched = std::ranges::all_of(terms, [&](const auto& term) {
+                if (std::ranges::binary_search(term.definite, doc)) {
+                    return true;
+                }
+                if (!std::ranges::binary_search(term.candidates, doc)) {
+                    return false;
+                }
+                if (text.empty()) {
+                    std::unique_ptr<git_commit> pCommit {};
+                    if (git_commit_lookup(std::out_ptr(pCommit), pRepo, &m_index.docs[doc])) {
+                        return false;
+                    }
+                    text = GetSubstringSearchText(pCommit.get());
+                }
+                return text.find(term.text) != std::string::npos;
+            });
+
+            if (matched) {
+                if (result.ids.size() == limit) {
+                    result.truncated = true;
+                    break;
+                }
+                result.ids.push_back(m_index.docs[doc]);
+            }
+        }
+        return result;
+    }
+
+private:
+    static constexpr size_t kMaxSegments = 32;
+
+    static std::vector<std::string> SplitQuery(std::string_view query)
+    {
+        std::vector<std::string> terms {};
+        size_t i {};
+        while (i < query.size()) {
+            auto start = query.find_first_not_of(" \t\r\n", i);
+            if (start == std::string_view::npos) {
+                break;
+            }
+            auto end = std::min(query.find_first_of(" \t\r\n", start), query.size());
+            terms.emplace_back(ToLower(query.substr(start, end - start)));
+            i = end;
+        }
+        return terms;
+    }
+
+    std::vector<uint32_t> GetTrigramCandidates(std::string_view term) const
+    {
+        if (term.size() < 3) {
+            return {};
+        }
+
+        std::vector<const PostingList*> lists {};
+        for (auto i = 0u; i + 3 <= term.size(); ++i) {
+            auto it = m_index.trigrams.find(MakeTrigram(term.data() + i));
+            if (it == m_index.trigrams.end()) {
+                return {};
+            }
+            lists.push_back(&it->second);
+        }
+
+        // Intersect from the shortest list.
+        std::ranges::sort(lists, {}, [](const auto* pList) { return pList->Size(); });
+        lists.erase(std::unique(lists.begin(), lists.end()), lists.end());
+        auto candidates = lists[0]->Decode();
+        for (auto i = 1u; i < lists.size() && !candidates.empty(); ++i) {
+            auto docs = lists[i]->Decode();
+            std::vector<uint32_t> intersection {};
+            std::ranges::set_intersection(candidates, docs, std::back_inserter(intersection));
+            candidates = std::move(intersection);
+        }
+        return candidates;
+    }
+
+    void Load()
+    {
+        std::ifstream in { m_indexPath, std::ios::binary };
+        if (!in) {
+            return;
+        }
+
+        char magic[sizeof(kSearchIndexMagic)] {};
+        in.read(magic, sizeof(magic));
+        if (!in || memcmp(magic, kSearchIndexMagic, sizeof(magic))) {
+            return;
+        }
+
+        std::error_code ec {};
+        auto fileSize = (size_t)std::filesystem::file_size(m_indexPath, ec);
+        SearchIndexSegment index {};
+        auto segmentCount = size_t {};
+        while (!ec && in.peek() != std::ifstream::traits_type::eof()) {
+            SearchIndexSegment segment {};
+            if (!segment.Read(in, (uint32_t)index.docs.size(), fileSize)) {
+                // Corrupted, or an append was interrupted. Keep the segments before it, the file is rewritten by the
+                // next update.
+                m_rewrite = true;
+                break;
+            }
+            index.Append(std::move(segment));
+            ++segmentCount;
+        }
+
+        m_index = std::move(index);
+        m_segmentCount = segmentCount;
+        m_oidToDoc.reserve(m_index.docs.size());
+        for (auto i = 0u; i < m_index.docs.size(); ++i) {
+            m_oidToDoc.emplace(m_index.docs[i], i);
+        }
+    }
+
+    /// @brief Rewrite the index file as one segment. Only called by the update holding m_updateMutex, which is the
+    ///        only writer, so searches go on meanwhile.
+    void Save()
+    {
+        // Write to a temporary file then rename it, so that a crash never leaves a half written index.
+        auto tmpPath = m_indexPath + ".tmp";
+        std::error_code ec {};
+        std::filesystem::create_directories(std::filesystem::path { m_indexPath }.parent_path(), ec);
+        {
+            std::ofstream out { tmpPath, std::ios::binary | std::ios::trunc };
+            if (!out) {
+                return;
+            }
+
+            out.write(kSearchIndexMagic, sizeof(kSearchIndexMagic));
+            m_index.Write(out);
+            if (!out) {
+                return;
+            }
+        }
+        std::filesystem::rename(tmpPath, m_indexPath, ec);
+        if (!ec) {
+            m_segmentCount = 1;
+            m_rewrite = false;
+        }
+    }
+
+    std::string m_indexPath {};
+    mutable std::shared_mutex m_mutex {};
+    std::mutex m_updateMutex {};
+    SearchIndexSegment m_index {};
+    std::unordered_map<git_oid, uint32_t, GitOidHash, GitOidEqual> m_oidToDoc {};
+
+    // Number of segments in the index file, and whether it must be rewritten instead of appended to.
+    size_t m_segmentCount {};
+    bool m_rewrite {};
+};
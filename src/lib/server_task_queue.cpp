@@ -0,0 +1,110 @@
+module;
+
+#include "thirdparty/httplib.h"
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+export module gitkf:server_task_queue;
+
+/// @brief Task queue of the http server. Every connection is served by one of a fixed number of workers, and at most
+///        maxQueued connections wait for a worker, more connections are refused (0 means no limit). A worker serving
+///        a long-lived stream calls ReleaseCurrentWorker() to hand its slot over to a new thread, so streams never
+///        pin the workers which serve short requests like commit details.
+export class ServerTaskQueue : public httplib::TaskQueue {
+public:
+    ServerTaskQueue(size_t workerCount, size_t maxQueued)
+        : m_maxQueued { maxQueued }
+    {
+        for (auto i = 0u; i < std::max<size_t>(workerCount, 1); ++i) {
+            StartWorker();
+        }
+    }
+
+    ServerTaskQueue(const ServerTaskQueue&) = delete;
+
+    ~ServerTaskQueue() override { shutdown(); }
+
+    bool enqueue(std::function<void()> fn) override
+    {
+        {
+            std::unique_lock lock { m_mutex };
+            if (m_shutdown || (m_maxQueued && m_jobs.size() >= m_maxQueued)) {
+                return false;
+            }
+            m_jobs.push_back(std::move(fn));
+        }
+        m_cond.notify_one();
+        return true;
+    }
+
+    void shutdown() override
+    {
+        std::unique_lock lock { m_mutex };
+        m_shutdown = true;
+        m_cond.notify_all();
+        m_exitCond.wait(lock, [this] { return !m_threadCount; });
+    }
+
+    /// @brief Start a new worker to take the place of current one, current thread exits once its connection is done
+    ///        and never touches the queue again. Nothing happens if current thread is not a worker, or it has been
+    ///        released already.
+    static void ReleaseCurrentWorker()
+    {
+        if (t_pQueue && !t_released) {
+            t_released = true;
+            std::thread { [pQueue = t_pQueue] { pQueue->Run(); } }.detach();
+        }
+    }
+
+private:
+    void StartWorker()
+    {
+        {
+            std::unique_lock lock { m_mutex };
+            ++m_threadCount;
+        }
+        std::thread { [this] { Run(); } }.detach();
+    }
+
+    void Run()
+    {
+        t_pQueue = this;
+        while (!t_released) {
+            std::function<void()> fn {};
+            {
+                std::unique_lock lock { m_mutex };
+                m_cond.wait(lock, [this] { return !m_jobs.empty() || m_shutdown; });
+                if (m_jobs.empty()) {
+                    break;
+                }
+                fn = std::move(m_jobs.front());
+                m_jobs.pop_front();
+            }
+            fn();
+        }
+
+        // The slot has been taken by another thread if current one is released.
+        if (t_released) {
+            return;
+        }
+        std::unique_lock lock { m_mutex };
+        if (!--m_threadCount) {
+            m_exitCond.notify_all();
+        }
+    }
+
+    static inline thread_local ServerTaskQueue* t_pQueue {};
+    static inline thread_local bool t_released {};
+
+    size_t m_maxQueued {};
+    std::deque<std::function<void()>> m_jobs {};
+    std::mutex m_mutex {};
+    std::condition_variable m_cond {};
+    std::condition_variable m_exitCond {};
+    size_t m_threadCount {};
+    bool m_shutdown {};
+};
@@ -0,0 +1,125 @@
+module;
+
+#include <atomic>
+#include <cstdint>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+
+export module gitkf:spill_buffer;
+import :memory_budget;
+import :platform_utils;
+
+/// @brief Directory of spilled data. Patches may come from private repositories and the temporary directory is shared
+///        with other users, so it is a new directory only the current user can enter. It is removed with whatever is
+///        left in it when the process exits.
+static const std::filesystem::path& GetSpillDirectory()
+{
+    struct SpillDirectory {
+        std::filesystem::path path { CreatePrivateTempDirectory("gitkf-spill-") };
+
+        ~SpillDirectory()
+        {
+            std::error_code ec {};
+            std::filesystem::remove_all(path, ec);
+        }
+    };
+
+    static const SpillDirectory s_dir {};
+    return s_dir.path;
+}
+
+/// @brief Output of a child process which is kept in memory up to memoryLimit bytes (if the reservation can grow to
+///        it), and spilled to a temporary file beyond that, which gives the memory back to the reservation. The file is
+///        deleted with the buffer.
+export class SpillBuffer {
+public:
+    SpillBuffer(MemoryReservation& reservation, size_t memoryLimit)
+        : m_reservation { reservation }
+        , m_memoryLimit { memoryLimit }
+    {
+    }
+
+    SpillBuffer(const SpillBuffer&) = delete;
+
+    ~SpillBuffer()
+    {
+        if (!m_path.empty()) {
+            m_file.close();
+            std::error_code ec {};
+            std::filesystem::remove(m_path, ec);
+        }
+    }
+
+    void Append(const char* data, size_t size)
+    {
+        m_size += size;
+        if (m_path.empty() && m_memory.size() + size <= m_memoryLimit && m_reservation.TryGrow(size)) {
+            m_reservedBytes += size;
+            m_memory.append(data, size);
+            return;
+        }
+        if (m_path.empty()) {
+            Spill();
+        }
+        m_file.write(data, size);
+    }
+
+    bool IsSpilled() const { return !m_path.empty(); }
+
+    /// @brief Move out the data, only if it is not spilled.
+    std::string TakeMemory() { return std::move(m_memory); }
+
+    size_t GetSize() const { return m_size; }
+
+    /// @brief Feed everything appended so far to onData, in blocks if it is spilled. onData returns how much of data it
+    ///        has used, the rest is passed again with the next block. last is set for the final call, which must use
+    ///        everything.
+    void Consume(const std::function<size_t(std::string_view data, bool last)>& onData)
+    {
+        if (m_path.empty()) {
+            onData(m_memory, /*last=*/true);
+            return;
+        }
+
+        constexpr size_t kBlockSize = 4 * 1024 * 1024;
+        m_file.flush();
+        std::ifstream in { m_path, std::ios::binary };
+        std::string data {};
+        for (auto last = false; !last;) {
+            auto size = data.size();
+            data.resize(size + kBlockSize);
+            in.read(data.data() + size, kBlockSize);
+            data.resize(size + in.gcount());
+            last = !in;
+            data.erase(0, onData(data, last));
+        }
+    }
+
+private:
+    void Spill()
+    {
+        static std::atomic<uint64_t> s_nextId {};
+        m_path = GetSpillDirectory() / std::format("{}.tmp", ++s_nextId);
+        m_file.open(m_path, std::ios::binary | std::ios::trunc);
+        if (!m_file) {
+            throw std::runtime_error { std::format("Create spill file '{}' failed.", m_path.string()) };
+        }
+        m_file.write(m_memory.data(), m_memory.size());
+        m_memory = {};
+        m_reservation.Shrink(std::exchange(m_reservedBytes, 0));
+    }
+
+    MemoryReservation& m_reservation;
+    size_t m_memoryLimit {};
+    size_t m_size {};
+    std::string m_memory {};
+    size_t m_reservedBytes {};
+    std::filesystem::path m_path {};
+    std::ofstream m_file {};
+};
@@ -0,0 +1,80 @@
+module;
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+export module gitkf:thread_pool;
+
+/// @brief A simple fixed size thread pool for CPU bound background work (e.g. diffing blobs). Http requests are not
+///        processed here, they have their own worker threads.
+export class ThreadPool {
+public:
+    explicit ThreadPool(size_t threadCount)
+    {
+        threadCount = std::max<size_t>(threadCount, 1);
+        for (auto i = 0u; i < threadCount; ++i) {
+            m_threads.emplace_back([this] { Run(); });
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+
+    ~ThreadPool()
+    {
+        {
+            std::unique_lock lock { m_mutex };
+            m_shutdown = true;
+        }
+        m_cond.notify_all();
+        for (auto& thread : m_threads) {
+            thread.join();
+        }
+    }
+
+    size_t Size() const { return m_threads.size(); }
+
+    void Enqueue(std::function<void()> fn)
+    {
+        {
+            std::unique_lock lock { m_mutex };
+            m_jobs.push_back(std::move(fn));
+        }
+        m_cond.notify_one();
+    }
+
+private:
+    void Run()
+    {
+        while (true) {
+            std::function<void()> fn {};
+            {
+                std::unique_lock lock { m_mutex };
+                m_cond.wait(lock, [this] { return !m_jobs.empty() || m_shutdown; });
+                if (m_jobs.empty()) {
+                    return;
+                }
+                fn = std::move(m_jobs.front());
+                m_jobs.pop_front();
+            }
+            fn();
+        }
+    }
+
+    std::vector<std::thread> m_threads {};
+    std::deque<std::function<void()>> m_jobs {};
+    std::mutex m_mutex {};
+    std::condition_variable m_cond {};
+    bool m_shutdown {};
+};
+
+/// @brief The thread pool shared by all background jobs, one thread per hardware thread.
+export ThreadPool& GetSharedThreadPool()
+{
+    static ThreadPool s_thread_pool { std::thread::hardware_concurrency() };
+    return s_thread_pool;
+}
@@ -0,0 +1,177 @@
+module;
+
+#include "thirdparty/json.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <format>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+export module gitkf:tracing;
+import :ring_buffer;
+
+using json = nlohmann::json;
+
+/// @brief Spans recorded for one request. Spans may be added from any thread.
+export class Trace {
+public:
+    Trace(std::string id, std::string title)
+        : m_id { std::move(id) }
+        , m_title { std::move(title) }
+    {
+    }
+
+    const std::string& GetId() const { return m_id; }
+
+    void AddSpan(std::string_view name, std::chrono::steady_clock::time_point start,
+        std::chrono::steady_clock::time_point end)
+    {
+        std::unique_lock lock { m_mutex };
+        if (m_spans.size() == kMaxSpans) {
+            ++m_droppedSpans;
+            return;
+        }
+
+        auto [it, inserted] = m_threadIds.try_emplace(std::this_thread::get_id(), (int)m_threadIds.size() + 1);
+        m_spans.push_back(Span {
+            .name = std::string { name },
+            .threadId = it->second,
+            .start = start,
+            .end = end,
+        });
+    }
+
+    /// @brief Format as Chrome trace_event json, it can be loaded by chrome://tracing or Perfetto directly.
+    std::string Format() const
+    {
+        std::shared_lock lock { m_mutex };
+        json events = json::array();
+        events.push_back(
+            { { "name", "process_name" }, { "ph", "M" }, { "pid", 1 }, { "args", { { "name", m_title } } } });
+        for (const auto& [_, threadId] : m_threadIds) {
+            events.push_back({ { "name", "thread_name" }, { "ph", "M" }, { "pid", 1 }, { "tid", threadId },
+                { "args", { { "name", threadId == 1 ? "request" : std::format("thread {}", threadId) } } } });
+        }
+        for (const auto& span : m_spans) {
+            events.push_back({
+                { "name", span.name },
+                { "cat", "gitkf" },
+                { "ph", "X" },
+                { "pid", 1 },
+                { "tid", span.threadId },
+                { "ts", std::chrono::duration<double, std::micro> { span.start - m_start }.count() },
+                { "dur", std::chrono::duration<double, std::micro> { span.end - span.start }.count() },
+            });
+        }
+
+        json trace {};
+        trace["traceEvents"] = std::move(events);
+        trace["displayTimeUnit"] = "ms";
+        trace["otherData"] = { { "id", m_id }, { "droppedSpans", m_droppedSpans } };
+        return trace.dump(/*indent=*/-1, /*indent_char=*/' ', /*ensure_ascii=*/false,
+            /*error_handler=*/json::error_handler_t::replace);
+    }
+
+private:
+    // A live history stream may run for hours, don't let its trace grow forever.
+    static constexpr size_t kMaxSpans = 100'000;
+
+    struct Span {
+        std::string name {};
+        int threadId {};
+        std::chrono::steady_clock::time_point start {};
+        std::chrono::steady_clock::time_point end {};
+    };
+
+    std::string m_id {};
+    std::string m_title {};
+    std::chrono::steady_clock::time_point m_start { std::chrono::steady_clock::now() };
+    mutable std::shared_mutex m_mutex {};
+    std::vector<Span> m_spans {};
+    std::unordered_map<std::thread::id, int> m_threadIds {};
+    size_t m_droppedSpans {};
+};
+
+static std::shared_mutex s_trace_cache_mutex {};
+static ring_buffer<std::shared_ptr<Trace>, 64> s_trace_cache;
+
+/// @brief Create a trace, it can be found by its id until 64 newer traces are created.
+export std::shared_ptr<Trace> CreateTrace(std::string title)
+{
+    static std::atomic<uint64_t> s_nextId {};
+    auto pTrace = std::make_shared<Trace>(std::to_string(++s_nextId), std::move(title));
+    std::unique_lock write_lock { s_trace_cache_mutex };
+    s_trace_cache.push_front(std::shared_ptr<Trace> { pTrace });
+    return pTrace;
+}
+
+export std::shared_ptr<Trace> FindTrace(const std::string& id)
+{
+    std::shared_lock read_lock { s_trace_cache_mutex };
+    auto it = std::find_if(
+        s_trace_cache.begin(), s_trace_cache.end(), [&id](const auto& pTrace) { return pTrace->GetId() == id; });
+    return it != s_trace_cache.end() ? *it : nullptr;
+}
+
+static thread_local Trace* t_pCurrentTrace {};
+
+/// @brief Make the trace current on this thread until this object is destroyed, spans opened on this thread are added
+///        to it. Nothing is recorded if there is no current trace.
+export class TraceScope {
+public:
+    explicit TraceScope(Trace* pTrace)
+        : m_pPrevious { std::exchange(t_pCurrentTrace, pTrace) }
+    {
+    }
+
+    TraceScope(const TraceScope&) = delete;
+
+    ~TraceScope() { t_pCurrentTrace = m_pPrevious; }
+
+private:
+    Trace* m_pPrevious {};
+};
+
+/// @brief Add a span to the current trace of this thread, if there is one.
+export void RecordSpan(
+    std::string_view name, std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end)
+{
+    if (t_pCurrentTrace) {
+        t_pCurrentTrace->AddSpan(name, start, end);
+    }
+}
+
+/// @brief Record a span from construction to destruction into the current trace of this thread.
+export class TraceSpan {
+public:
+    explicit TraceSpan(std::string_view name)
+        : m_pTrace { t_pCurrentTrace }
+        , m_name { name }
+    {
+        if (m_pTrace) {
+            m_start = std::chrono::steady_clock::now();
+        }
+    }
+
+    TraceSpan(const TraceSpan&) = delete;
+
+    ~TraceSpan()
+    {
+        if (m_pTrace) {
+            m_pTrace->AddSpan(m_name, m_start, std::chrono::steady_clock::now());
+        }
+    }
+
+private:
+    Trace* m_pTrace {};
+    std::string_view m_name {};
+    std::chrono::steady_clock::time_point m_start {};
+};
@@ -0,0 +1,76 @@
+module;
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <thirdparty/libgit2/include/git2.h>
+
+export module gitkf:tree_diff;
+import :cancellation;
+import :git_smart_pointer;
+
+/// @brief Diff two trees (a null tree is empty) with renames detected, as "git show" and "git diff" do by default.
+///        Copies are not detected, so file lists agree with the patches of "git show". pathspec is relative to the
+///        work directory, empty means all files. Return nullptr if the diff fails.
+export std::unique_ptr<git_diff> DiffTrees(git_repository* pRepo, git_tree* pOldTree, git_tree* pNewTree,
+    const std::string& pathspec, bool ignoreWhitespace)
+{
+    // Hunks are placed by the indent heuristic, which "git diff" uses by default.
+    git_diff_options options = GIT_DIFF_OPTIONS_INIT;
+    options.flags |= GIT_DIFF_INDENT_HEURISTIC;
+    if (ignoreWhitespace) {
+        options.flags |= GIT_DIFF_IGNORE_WHITESPACE;
+    }
+    auto path = pathspec;
+    auto* pPath = path.data();
+    if (!path.empty()) {
+        options.pathspec = { &pPath, 1 };
+    }
+
+    std::unique_ptr<git_diff> pDiff {};
+    if (git_diff_tree_to_tree(std::out_ptr(pDiff), pRepo, pOldTree, pNewTree, &options)) {
+        return nullptr;
+    }
+
+    git_diff_find_options findOptions = GIT_DIFF_FIND_OPTIONS_INIT;
+    findOptions.flags = GIT_DIFF_FIND_RENAMES;
+    if (git_diff_find_similar(pDiff.get(), &findOptions)) {
+        return nullptr;
+    }
+    return pDiff;
+}
+
+/// @brief Path of the file a delta is about, the new path unless the file is deleted.
+export std::string_view GetDeltaPath(const git_diff_delta* pDelta)
+{
+    return pDelta->new_file.path ? pDelta->new_file.path : pDelta->old_file.path;
+}
+
+/// @brief Format the patch of every file in diff, in "git diff" format, and pass it to onPatch with the path of the
+///        file, one file at a time, so the first files can be sent before the last ones are diffed. libgit2 quotes
+///        unusual names in the patch text, path is never quoted. If file is set, only its patch is formatted. Stop
+///        when onPatch returns false or the token is cancelled.
+export void ForEachFilePatch(git_diff* pDiff, std::string_view file, CancellationToken& token,
+    const std::function<bool(std::string_view path, std::string_view patch)>& onPatch)
+{
+    for (size_t i = 0; i < git_diff_num_deltas(pDiff) && !token.IsCancelled(); ++i) {
+        auto path = GetDeltaPath(git_diff_get_delta(pDiff, i));
+        if (!file.empty() && path != file) {
+            continue;
+        }
+
+        std::unique_ptr<git_patch> pPatch {};
+        if (git_patch_from_diff(std::out_ptr(pPatch), pDiff, i)) {
+            continue;
+        }
+        git_buf buf {};
+        std::unique_ptr<git_buf> pBuf { &buf };
+        if (!pPatch || git_patch_to_buf(&buf, pPatch.get())) {
+            continue;
+        }
+        if (!onPatch(path, { buf.ptr, buf.size })) {
+            return;
+        }
+    }
+}
@@ -0,0 +1,114 @@
+module;
+
+#include "thirdparty/json.hpp"
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+export module gitkf:warmup;
+
+using json = nlohmann::json;
+
+/// @brief Progress of repositories being warmed up, either hot repositories listed at startup or repositories
+///        announced by the cli. Stages are reported by the warming thread, readers see a consistent snapshot. Only
+///        the latest finished warm-ups are kept.
+export class WarmupStatus {
+public:
+    /// @brief Start tracking a warm-up, return its index for later calls.
+    size_t Begin(std::string repoPath, std::string source)
+    {
+        std::unique_lock lock { m_mutex };
+        while (m_entries.size() >= kMaxEntries && m_entries.front().done) {
+            m_entries.pop_front();
+            ++m_firstIndex;
+        }
+        m_entries.push_back(Entry {
+            .repoPath = std::move(repoPath),
+            .source = std::move(source),
+            .stageStart = std::chrono::steady_clock::now(),
+        });
+        return m_firstIndex + m_entries.size() - 1;
+    }
+
+    /// @brief Finish the current stage of the warm-up (if any) and start the named one.
+    void Stage(size_t index, std::string stage)
+    {
+        std::unique_lock lock { m_mutex };
+        auto& entry = m_entries[index - m_firstIndex];
+        FinishStage(entry);
+        entry.stage = std::move(stage);
+    }
+
+    /// @brief Finish the warm-up, error is empty if it succeeded.
+    void End(size_t index, std::string error = {})
+    {
+        std::unique_lock lock { m_mutex };
+        auto& entry = m_entries[index - m_firstIndex];
+        FinishStage(entry);
+        entry.stage = error.empty() ? "done" : "failed";
+        entry.error = std::move(error);
+        entry.done = true;
+    }
+
+    std::string Format() const
+    {
+        std::unique_lock lock { m_mutex };
+        json repositories = json::array();
+        size_t pending {};
+        for (const auto& entry : m_entries) {
+            json stages = json::object();
+            for (const auto& [name, ms] : entry.stageMs) {
+                stages[name] = ms;
+            }
+            repositories.push_back({
+                { "repo", entry.repoPath },
+                { "source", entry.source },
+                { "stage", entry.stage },
+                { "done", entry.done },
+                { "error", entry.error },
+                { "stagesMs", std::move(stages) },
+            });
+            pending += !entry.done;
+        }
+
+        json j {};
+        j["pending"] = pending;
+        j["repositories"] = std::move(repositories);
+        return j.dump(/*indent=*/-1, /*indent_char=*/' ', /*ensure_ascii=*/false,
+            /*error_handler=*/json::error_handler_t::replace);
+    }
+
+private:
+    static constexpr size_t kMaxEntries = 64;
+
+    struct Entry {
+        std::string repoPath {};
+        std::string source {};
+        std::string stage { "queued" };
+        std::string error {};
+        bool done {};
+        std::chrono::steady_clock::time_point stageStart {};
+        std::vector<std::pair<std::string, double>> stageMs {};
+    };
+
+    static void FinishStage(Entry& entry)
+    {
+        auto now = std::chrono::steady_clock::now();
+        entry.stageMs.emplace_back(
+            entry.stage, std::chrono::duration<double, std::milli> { now - entry.stageStart }.count());
+        entry.stageStart = now;
+    }
+
+    mutable std::mutex m_mutex {};
+    std::deque<Entry> m_entries {};
+    size_t m_firstIndex {};
+};
+
+export WarmupStatus& GetWarmupStatus()
+{
+    static WarmupStatus s_warmupStatus {};
+    return s_warmupStatus;
+}
@@ -0,0 +1,35 @@
+module;
+
+#include <chrono>
+#include <functional>
+#include <optional>
+#include <stdexcept>
+#include <string>
+
+export module gitkf:control_socket;
+import :platform_utils;
+
+/// @brief Control socket of the server, see linux/control_socket.cpp. Not supported on Windows yet, the cli probes the
+///        http port instead.
+export class ControlServer {
+public:
+    using Handler = std::function<std::string(const std::string&)>;
+
+    ControlServer(int port, Handler handler) { throw std::runtime_error { "Not Implemented" }; }
+
+    ControlServer(const ControlServer&) = delete;
+};
+
+export std::optional<std::string> SendControlRequest(int port, const std::string& request)
+{
+    return std::nullopt;
+}
+
+/// @brief The server can't report readiness here, assume it is ready once it is started.
+export bool StartServerAndWait(const std::string& cmd, std::chrono::milliseconds timeout)
+{
+    RunAsDaemon(cmd);
+    return true;
+}
+
+export void NotifyServerReady(int readyFd) { }
@@ -0,0 +1,50 @@
+module;
+
+#include "thirdparty/httplib.h"
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+export module gitkf:event_stream_server;
+import :cancellation;
+
+/// @brief Response of one event stream connection, see linux/event_stream_server.cpp. Streams are served by the http
+///        server on Windows, no instance is ever created.
+export class EventStream {
+public:
+    EventStream(const EventStream&) = delete;
+
+    bool Write(const char* data, size_t size) { return false; }
+
+    bool IsWritable() const { return false; }
+
+    void WhenWritable(std::function<void()> callback) { }
+
+    void End() { }
+
+    bool IsClosed() const { return true; }
+
+    CancellationToken& GetCancellationToken() { return m_token; }
+
+    void Attach(std::shared_ptr<void> pObject) { }
+
+private:
+    CancellationToken m_token {};
+};
+
+export class EventStreamServer {
+public:
+    using Handler = std::function<void(const httplib::Request&, httplib::Response&, std::shared_ptr<EventStream>)>;
+
+    EventStreamServer(size_t ioThreadCount, std::vector<std::string> allowedOrigins) { }
+
+    EventStreamServer(const EventStreamServer&) = delete;
+
+    void Get(std::string path, Handler handler) { }
+
+    void Start(const std::string& host, int port) { throw std::runtime_error { "Not Implemented" }; }
+
+    void Stop() { }
+};
@@ -1,14 +1,23 @@
 module;
 
 #include <array>
+#include <chrono>
+#include <filesystem>
 #include <format>
 #include <functional>
+#include <memory>
+#include <random>
 #include <stdexcept>
 #include <string>
 #include <vector>
 #include <windows.h>
+// windows.h must be included first.
+#include <psapi.h>
 
 export module gitkf:platform_utils;
+import :cancellation;
+import :metrics;
+import :tracing;
 
 export std::string get_current_app_full_path()
 {
@@ -26,8 +35,10 @@ export std::string get_current_app_full_path()
     }
 }
 
-export void ExternRun(
-    const std::string& commandLine, const char* workingDir, const std::function<bool(char*, size_t)>& onData)
+/// @brief Run command and feed its output to onData. The process is killed if onData returns false or the token is
+///        cancelled, in that case no exception is thrown for its exit code.
+export void ExternRun(const std::string& commandLine, const char* workingDir,
+    const std::function<bool(char*, size_t)>& onData, CancellationToken* pToken = nullptr)
 {
     STARTUPINFOA si { .cb = sizeof(si) };
     PROCESS_INFORMATION pi {};
@@ -50,16 +61,29 @@ export void ExternRun(
     si.hStdOutput = pWriteHandle.get();
     si.hStdError = pWriteHandle.get();
 
+    ++GetMetrics().childProcesses;
+    auto spawnStart = std::chrono::steady_clock::now();
     if (!::CreateProcessA(nullptr, (char*)commandLine.c_str(), nullptr, nullptr, true, CREATE_NO_WINDOW, nullptr,
             workingDir, &si, &pi)) {
         auto err = GetLastError();
         throw std::runtime_error { std::format(
             "'Create process failed for command '{}', error code: {}.'", commandLine, err) };
     }
+    RecordSpan("spawn", spawnStart, std::chrono::steady_clock::now());
 
     // Close write handle from parent, otherwise ReadFile() will hang even child process closes it already.
     pWriteHandle = nullptr;
 
+    // Kill the process when the request is cancelled, ReadFile() will return once the process is gone.
+    auto killed = false;
+    CancellationToken::Registration cancelRegistration {};
+    if (pToken) {
+        cancelRegistration = pToken->OnCancel([&] {
+            killed = true;
+            TerminateProcess(pi.hProcess, /*uExitcode=*/0);
+        });
+    }
+
     // Read output data.
     while (true) {
         std::array<char, 1024> buffer;
@@ -76,6 +100,7 @@ export void ExternRun(
 
     // Wait child process exit.
     ::WaitForSingleObject(pi.hProcess, INFINITE);
+    cancelRegistration.Reset();
 
     DWORD exitCode {};
     ::GetExitCodeProcess(pi.hProcess, &exitCode);
@@ -83,18 +108,22 @@ export void ExternRun(
     ::CloseHandle(pi.hThread);
     ::CloseHandle(pi.hProcess);
 
-    if (exitCode) {
+    if (exitCode && !killed) {
         throw std::runtime_error { std::format("Command '{}' failed, exit code: {}.", commandLine, exitCode) };
     }
 }
 
-export std::string ExternRun(const std::string& commandLine, const char* workingDir)
+export std::string ExternRun(
+    const std::string& commandLine, const char* workingDir, CancellationToken* pToken = nullptr)
 {
     std::string output {};
-    ExternRun(commandLine, workingDir, [&output](char* data, size_t size) {
-        output.append(data, size);
-        return true;
-    });
+    ExternRun(
+        commandLine, workingDir,
+        [&output](char* data, size_t size) {
+            output.append(data, size);
+            return true;
+        },
+        pToken);
     return output;
 }
 
@@ -113,4 +142,72 @@ export void RunAsDaemon(const std::string& cmd)
 export void OpenUrl(const std::string& url)
 {
     ShellExecuteA(0, 0, url.c_str(), 0, 0, SW_SHOW);
+}
+
+/// @brief Create a new directory under the temporary directory, its name starts with prefix. The temporary directory
+///        is in the profile of the current user, which other users can't enter.
+export std::filesystem::path CreatePrivateTempDirectory(const std::string& prefix)
+{
+    for (auto i = 0; i < 100; ++i) {
+        auto dir = std::filesystem::temp_directory_path() / std::format("{}{:08x}", prefix, std::random_device {}());
+        if (std::filesystem::create_directory(dir)) {
+            return dir;
+        }
+    }
+    throw std::runtime_error { std::format("Create directory under '{}' failed.",
+        std::filesystem::temp_directory_path().string()) };
+}
+
+/// @brief Create dir (and its parents) if it doesn't exist. A new directory inherits the ACL of its parent, which
+///        under the profile of the current user other users can't enter.
+export void CreatePrivateDirectory(const std::filesystem::path& dir)
+{
+    std::filesystem::create_directories(dir);
+}
+
+/// @brief Get resident memory (working set) of the current process, 0 if it is not available.
+export size_t GetResidentMemoryBytes()
+{
+    PROCESS_MEMORY_COUNTERS counters { .cb = sizeof(counters) };
+    return GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)) ? counters.WorkingSetSize : 0;
+}
+
+export struct WatchedDirectory {
+    std::string path {};
+    bool recursive {};
+};
+
+/// @brief Watch directories with change notifications. onEvent is called with changed = true whenever something
+///        under the directories is created, modified, renamed or deleted, and with changed = false every second if
+///        nothing happened. Stop watching when onEvent returns false.
+export void WatchDirectories(const std::vector<WatchedDirectory>& dirs, const std::function<bool(bool)>& onEvent)
+{
+    std::vector<std::unique_ptr<void, decltype(&FindCloseChangeNotification)>> handles {};
+    std::vector<HANDLE> rawHandles {};
+    for (const auto& dir : dirs) {
+        auto handle = FindFirstChangeNotificationA(dir.path.c_str(), dir.recursive,
+            FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_DIR_NAME | FILE_NOTIFY_CHANGE_LAST_WRITE);
+        if (handle == INVALID_HANDLE_VALUE) {
+            auto err = GetLastError();
+            throw std::runtime_error { std::format("Watch directory '{}' failed, error code: {}.", dir.path, err) };
+        }
+        handles.emplace_back(handle, &FindCloseChangeNotification);
+        rawHandles.push_back(handle);
+    }
+
+    while (true) {
+        auto res = WaitForMultipleObjects((DWORD)rawHandles.size(), rawHandles.data(), false, /*dwMilliseconds=*/1000);
+        if (res == WAIT_FAILED) {
+            auto err = GetLastError();
+            throw std::runtime_error { std::format("Wait for directory changes failed, error code: {}.", err) };
+        }
+
+        auto changed = res >= WAIT_OBJECT_0 && res < WAIT_OBJECT_0 + rawHandles.size();
+        if (changed) {
+            FindNextChangeNotification(rawHandles[res - WAIT_OBJECT_0]);
+        }
+        if (!onEvent(changed)) {
+            return;
+        }
+    }
 }
\ No newline at end of file
@@ -0,0 +1,161 @@
+module;
+
+#include <algorithm>
+#include <cctype>
+#include <optional>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+export module gitkf:word_diff;
+
+/// @brief Byte range [first, second) of a line.
+export using WordRange = std::pair<size_t, size_t>;
+
+export struct WordDiff {
+    std::vector<WordRange> oldRanges {};
+    std::vector<WordRange> newRanges {};
+};
+
+static bool IsWordChar(unsigned char ch) { return std::isalnum(ch) || ch == '_' || ch >= 0x80; }
+
+/// @brief Split line into words, runs of whitespace and single punctuation characters. Non-ASCII bytes are word
+///        characters, so a UTF-8 sequence is never split.
+static std::vector<std::string_view> Tokenize(std::string_view line)
+{
+    std::vector<std::string_view> tokens {};
+    for (size_t i = 0; i < line.size();) {
+        auto begin = i++;
+        unsigned char ch = line[begin];
+        if (IsWordChar(ch)) {
+            while (i < line.size() && IsWordChar(line[i])) {
+                ++i;
+            }
+        } else if (std::isspace(ch)) {
+            while (i < line.size() && std::isspace((unsigned char)line[i])) {
+                ++i;
+            }
+        }
+        tokens.push_back(line.substr(begin, i - begin));
+    }
+    return tokens;
+}
+
+/// @brief Merge changed tokens into byte ranges of their line.
+static std::vector<WordRange> ToRanges(
+    std::string_view line, const std::vector<std::string_view>& tokens, const std::vector<bool>& changed)
+{
+    std::vector<WordRange> ranges {};
+    for (size_t i = 0; i < tokens.size(); ++i) {
+        if (!changed[i]) {
+            continue;
+        }
+        auto begin = (size_t)(tokens[i].data() - line.data());
+        auto end = begin + tokens[i].size();
+        if (!ranges.empty() && ranges.back().second == begin) {
+            ranges.back().second = end;
+        } else {
+            ranges.emplace_back(begin, end);
+        }
+    }
+    return ranges;
+}
+
+/// @brief Diff the words of a deleted line and the line which replaces it (Myers' O(ND) algorithm), return the changed
+///        byte ranges of both. budget is the number of steps the diff may take, it is shared by the lines of a hunk so
+///        pathological hunks stay cheap. Return nullopt if the budget is used up, or the lines have nothing in common.
+export std::optional<WordDiff> DiffWords(std::string_view oldLine, std::string_view newLine, size_t& budget)
+{
+    auto a = Tokenize(oldLine);
+    auto b = Tokenize(newLine);
+    auto n = (int)a.size();
+    auto m = (int)b.size();
+    if (budget < (size_t)(n + m)) {
+        budget = 0;
+        return std::nullopt;
+    }
+    budget -= n + m;
+
+    // v[offset + k] is the furthest x on diagonal k, trace keeps diagonals [-d, d] of v before every step d for the
+    // backtrack, so it takes no more memory than the budget.
+    auto offset = n + m + 1;
+    std::vector<int> v(2 * offset + 1);
+    std::vector<std::vector<int>> trace {};
+    auto found = false;
+    for (int d = 0; d <= n + m && !found; ++d) {
+        if (budget < (size_t)(2 * d + 1)) {
+            budget = 0;
+            return std::nullopt;
+        }
+        budget -= 2 * d + 1;
+        trace.emplace_back(v.begin() + offset - d, v.begin() + offset + d + 1);
+        for (int k = -d; k <= d; k += 2) {
+            auto x = (k == -d || (k != d && v[offset + k - 1] < v[offset + k + 1])) ? v[offset + k + 1]
+                                                                                     : v[offset + k - 1] + 1;
+            auto y = x - k;
+            while (x < n && y < m && a[x] == b[y]) {
+                ++x;
+                ++y;
+            }
+            v[offset + k] = x;
+            if (x >= n && y >= m) {
+                found = true;
+                break;
+            }
+        }
+    }
+
+    // Walk back from the end, tokens which are not on a snake are changed.
+    std::vector<bool> oldChanged(n, true);
+    std::vector<bool> newChanged(m, true);
+    auto x = n;
+    auto y = m;
+    for (auto d = (int)trace.size() - 1; d >= 0; --d) {
+        const auto& vd = trace[d];
+        auto k = x - y;
+        auto prevK = (k == -d || (k != d && vd[d + k - 1] < vd[d + k + 1])) ? k + 1 : k - 1;
+        auto prevX = d ? vd[d + prevK] : 0;
+        auto prevY = prevX - prevK;
+        while (x > prevX && y > prevY) {
+            oldChanged[--x] = false;
+            newChanged[--y] = false;
+        }
+        if (d) {
+            x = prevX;
+            y = prevY;
+        }
+    }
+
+    // Lines which share less than half of their text (whitespace aside) are rewritten rather than edited, highlighting
+    // their words would be noise.
+    size_t oldText {};
+    size_t commonText {};
+    for (int i = 0; i < n; ++i) {
+        if (!std::isspace((unsigned char)a[i][0])) {
+            oldText += a[i].size();
+            commonText += oldChanged[i] ? 0 : a[i].size();
+        }
+    }
+    auto newText = (size_t)std::ranges::count_if(newLine, [](unsigned char ch) { return !std::isspace(ch); });
+    if (commonText * 2 < std::min(oldText, newText)) {
+        return std::nullopt;
+    }
+    return WordDiff { ToRanges(oldLine, a, oldChanged), ToRanges(newLine, b, newChanged) };
+}
+
+/// @brief Convert ascending byte offsets of UTF-8 text to offsets in UTF-16 code units, which is how the browser
+///        indexes strings.
+export void ToUtf16Offsets(std::string_view text, std::vector<size_t>& offsets)
+{
+    size_t bytes {};
+    size_t units {};
+    for (auto& offset : offsets) {
+        for (; bytes < offset && bytes < text.size(); ++bytes) {
+            unsigned char ch = text[bytes];
+            // Continuation bytes don't start a code point, and code points beyond the BMP take two units.
+            units += (ch & 0xc0) != 0x80;
+            units += ch >= 0xf0;
+        }
+        offset = units;
+    }
+}
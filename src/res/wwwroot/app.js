@@ -1,6 +1,11 @@
 import "./components.js";
 
 const server = location.origin;
+// History streams are served by the event stream server if it is running, it doesn't need a thread per stream.
+const g_streamServer = fetch(`${server}/api/server-info`)
+    .then(response => response.json())
+    .then(info => info.streamPort ? `${location.protocol}//${location.hostname}:${info.streamPort}` : server)
+    .catch(() => server);
 const queries = new URLSearchParams(location.search);
 const g_repo = queries.get("repo") || "";
 const g_path = queries.get("path") || "";
@@ -9,11 +14,13 @@ const g_authors = queries.getAll("author");
 var g_app;
 var g_ignoreWhitespaceCheckbox;
 var g_noMergesCheckbox;
+var g_splitModeCheckbox;
 
 window.onload = async () => {
     window.app = g_app = new App();
     g_noMergesCheckbox = document.getElementById("no-merges-checkbox");
     g_ignoreWhitespaceCheckbox = document.getElementById("ignore-whitespace-checkbox");
+    g_splitModeCheckbox = document.getElementById("split-mode-checkbox");
 
     var verDom = document.getElementById("current-version-column");
     verDom.innerText = `Current Ver: ${kVersion}`;
@@ -81,8 +88,7 @@ function show_commits_loading_wrapper(show) {
 }
 
 function is_column_ended(commit, commits) {
-    return (commit.parentIndexes[0] < 0 || commits[commit.parentIndexes[0]].column != commit.column)
-        && (commit.parentIndexes[1] < 0 || commits[commit.parentIndexes[1]].column != commit.column);
+    return commit.parentIndexes.every(parentIndex => parentIndex < 0 || commits[parentIndex].column != commit.column);
 }
 
 function crate_graph(commit, commits) {
@@ -105,9 +111,8 @@ function crate_graph(commit, commits) {
         }
     }
 
-    // Draw parent line
-    for (var i = 0; i < 2; ++i) {
-        const parentIndex = commit.parentIndexes[i];
+    // Draw parent line, merges can have any number of parents.
+    for (const parentIndex of commit.parentIndexes) {
         if (parentIndex != -1) {
             const parentColumn = parentIndex >= 0 ? commits[parentIndex].column : commit.column;
             const color = kColumnColors[parentColumn % kColumnColors.length];
@@ -187,9 +192,174 @@ function create_commit_navigation_node(label, commit) {
     return dom;
 }
 
-function create_commit_detail(commit, detailPanelDom, fileListDom) {
+// Changed words are marked by the server, spans are [begin, end, begin, end, ...] offsets of text.
+function append_marked_text(dom, text, spans, className) {
+    let pos = 0;
+    for (let i = 0; spans && i < spans.length; i += 2) {
+        dom.append(text.substring(pos, spans[i]));
+        const span = document.createElement("span");
+        span.classList.add(className);
+        span.textContent = text.substring(spans[i], spans[i + 1]);
+        dom.append(span);
+        pos = spans[i + 1];
+    }
+    dom.append(text.substring(pos));
+}
+
+// Rows of a side-by-side diff or a blame are rendered in blocks when they scroll near the view, and dropped when they
+// are far away, so files with thousands of lines don't keep all their nodes. Rows have a fixed height, so a block has
+// its size before it is rendered.
+const kSplitRowsPerBlock = 100;
+const kSplitRowHeight = 18;
+
+function get_split_block_observer() {
+    if (!get_split_block_observer.observer) {
+        get_split_block_observer.observer = new IntersectionObserver(entries => {
+            entries.forEach(entry => {
+                if (!entry.isIntersecting) {
+                    entry.target.replaceChildren();
+                } else if (!entry.target.hasChildNodes()) {
+                    entry.target.replaceChildren(...entry.target.rows.map(entry.target.createRow));
+                }
+            });
+        }, { root: document.getElementById("commit-detail").parentElement, rootMargin: "1000px 0px" });
+    }
+    return get_split_block_observer.observer;
+}
+
+// See parse_split_patch() on the server for the format of a row.
+function create_split_row(row) {
+    const type = row[0];
+    let oldLine = "", newLine = "", oldText = "", newText = "", oldSpans, newSpans;
+    if (type == " ") {
+        [, oldLine, newLine, oldText] = row;
+        newText = oldText;
+    } else if (type == "~") {
+        [, oldLine, newLine, oldText, newText, oldSpans, newSpans] = row;
+    } else if (type == "-") {
+        [, oldLine, oldText] = row;
+    } else {
+        [, newLine, newText] = row;
+    }
+
+    const dom = document.createElement("div");
+    dom.classList.add("split-row");
+    const addCell = (className, text, spans, spanClassName) => {
+        const cell = document.createElement("span");
+        cell.classList.add(className);
+        append_marked_text(cell, text, spans, spanClassName);
+        dom.appendChild(cell);
+    };
+    addCell("split-line-number", `${oldLine}`);
+    addCell(type == "+" ? "split-empty" : (type == " " ? "split-default" : "split-delete"), oldText, oldSpans,
+        "word-delete");
+    addCell("split-line-number", `${newLine}`);
+    addCell(type == "-" ? "split-empty" : (type == " " ? "split-default" : "split-add"), newText, newSpans, "word-add");
+    return dom;
+}
+
+function create_split_diff(fileDiffDom, hunks) {
+    hunks.forEach(hunk => {
+        const headerDom = document.createElement("pre");
+        headerDom.classList.add("chunk-statistics");
+        headerDom.innerText = hunk.header;
+        fileDiffDom.appendChild(headerDom);
+
+        for (let i = 0; i < hunk.rows.length; i += kSplitRowsPerBlock) {
+            const blockDom = document.createElement("div");
+            blockDom.rows = hunk.rows.slice(i, i + kSplitRowsPerBlock);
+            blockDom.createRow = create_split_row;
+            blockDom.style.height = `${blockDom.rows.length * kSplitRowHeight}px`;
+            fileDiffDom.appendChild(blockDom);
+            get_split_block_observer().observe(blockDom);
+        }
+    });
+}
+
+// The commit a line comes from is shown at the first line of every range from it, lines which are not attributed yet
+// only have their text.
+function create_blame_row(blame, index) {
+    const dom = document.createElement("div");
+    dom.classList.add("blame-row");
+
+    const infoDom = document.createElement("span");
+    const commit = blame.commits[blame.attribution[index]];
+    if (commit && (index == 0 || blame.attribution[index - 1] != blame.attribution[index])) {
+        const idDom = document.createElement("span");
+        idDom.classList.add("clickable-text");
+        idDom.innerText = commit.id.substring(0, 8);
+        idDom.title = commit.summary;
+        idDom.addEventListener("click", () => g_app.select_commit(commit.id));
+        const date = new Date(commit.time * 1000).toISOString().substring(0, 10);
+        infoDom.append(idDom, ` ${date} ${commit.author}`);
+    }
+
+    const numberDom = document.createElement("span");
+    numberDom.classList.add("split-line-number");
+    numberDom.innerText = `${index + 1}`;
+    const textDom = document.createElement("span");
+    textDom.textContent = blame.lines[index];
+    dom.append(infoDom, numberDom, textDom);
+    return dom;
+}
+
+function create_blame_blocks(blameDom, blame) {
+    blame.blocks = [];
+    for (let i = 0; i < blame.lines.length; i += kSplitRowsPerBlock) {
+        const blockDom = document.createElement("div");
+        blockDom.rows = [...Array(Math.min(kSplitRowsPerBlock, blame.lines.length - i)).keys()].map(j => i + j);
+        blockDom.createRow = index => create_blame_row(blame, index);
+        blockDom.style.height = `${blockDom.rows.length * kSplitRowHeight}px`;
+        blameDom.appendChild(blockDom);
+        blame.blocks.push(blockDom);
+        get_split_block_observer().observe(blockDom);
+    }
+}
+
+// Ranges are [line, count, commit, origLine], lines are 1-based. Blocks in view are rendered again if their lines
+// are attributed.
+function add_blame_ranges(blame, ranges) {
+    const dirtyBlocks = new Set();
+    ranges.forEach(([line, count, commit]) => {
+        for (let i = line - 1; i < line - 1 + count && i < blame.lines.length; ++i) {
+            blame.attribution[i] = commit;
+            dirtyBlocks.add(Math.floor(i / kSplitRowsPerBlock));
+            // The next line shows its commit only if it starts a range.
+            dirtyBlocks.add(Math.floor((i + 1) / kSplitRowsPerBlock));
+        }
+    });
+    dirtyBlocks.forEach(i => {
+        const blockDom = blame.blocks[i];
+        if (blockDom && blockDom.hasChildNodes()) {
+            blockDom.replaceChildren(...blockDom.rows.map(blockDom.createRow));
+        }
+    });
+}
+
+// Big file diffs come in parts, the next part is loaded from fileUrl when the end of the last one is clicked. Minified
+// files only come with their header.
+function append_patch_content(fileDiffDom, patch, fileUrl) {
+    patch.chunks.forEach(chunk => {
+        const dom = document.createElement("pre");
+        dom.classList.add(`chunk-${chunk.type}`);
+        append_marked_text(dom, chunk.content, chunk.spans, `word-${chunk.type}`);
+        fileDiffDom.appendChild(dom);
+    });
+    if (patch.hunks) {
+        create_split_diff(fileDiffDom, patch.hunks);
+    }
+    if (patch.truncated) {
+        const dom = document.createElement("pre");
+        dom.classList.add("chunk-truncated");
+        dom.innerText = patch.minified ? `Minified file, ${patch.truncated} long lines not shown, click to show them.`
+                                       : `${patch.truncated} more lines not shown, click to show more.`;
+        dom.addEventListener("click", () => g_app.load_more_diff_async(fileUrl, patch, dom));
+        fileDiffDom.appendChild(dom);
+    }
+}
+
+function create_commit_detail(commit, detailPanelDom, fileListDom, fileUrl) {
     var detailDomList = [];
-    var fileDomList = [];
 
     // Add comments node.
     const commentsDetailDom = document.createElement("div");
@@ -223,34 +393,90 @@ function create_commit_detail(commit, detailPanelDom, fileListDom) {
     dom.addEventListener("click", () => onSelectFile(dom));
     dom.innerText = "Comments";
     dom.detailDom = commentsDetailDom;
-    fileDomList.push(dom);
 
-    // Add file node and file detail.
+    // Add file detail.
+    const fileDiffDoms = new Map();
     if (commit.patch) {
         commit.patch.forEach(patch => {
             // Add detail dom.
             const fileDiffDom = document.createElement("div");
             fileDiffDom.classList.add("file-diff");
-            patch.chunks.forEach(chunk => {
-                const dom = document.createElement("pre");
-                dom.classList.add(`chunk-${chunk.type}`);
-                dom.innerText = chunk.content;
-                fileDiffDom.appendChild(dom);
-            });
+            append_patch_content(fileDiffDom, patch, fileUrl);
             detailDomList.push(fileDiffDom);
-
-            // Add file dome
-            const file = patch.filename;
-            const fileDom = document.createElement("div");
-            fileDom.classList.add("file");
-            fileDom.addEventListener("click", () => onSelectFile(fileDom));
-            fileDom.innerText = file;
-            fileDom.detailDom = fileDiffDom;
-            fileDomList.push(fileDom);
+            fileDiffDoms.set(patch.filename, fileDiffDom);
         });
     }
     detailPanelDom.replaceChildren(...detailDomList);
-    fileListDom.replaceChildren(...fileDomList);
+
+    // Changed files come with their line counts, and before the patch, see load_commit_async.
+    const files = commit.files || (commit.patch || []).map(patch => ({ path: patch.filename }));
+    create_file_list(fileListDom, dom, files, fileDiffDoms, commit.id);
+}
+
+function create_file_node(file, detailDom, commitId) {
+    const dom = document.createElement("div");
+    dom.classList.add("file");
+    dom.addEventListener("click", () => onSelectFile(dom));
+    dom.detailDom = detailDom;
+
+    const name = document.createElement("span");
+    name.innerText = file.oldPath ? `${file.oldPath} \u2192 ${file.path} (${file.similarity}%)` : file.path;
+    dom.appendChild(name);
+    if (file.binary) {
+        const stat = document.createElement("span");
+        stat.classList.add("file-stat");
+        stat.innerText = "binary";
+        dom.appendChild(stat);
+    } else if (file.status) {
+        const additions = document.createElement("span");
+        additions.classList.add("file-stat", "file-additions");
+        additions.innerText = `+${file.additions}`;
+        const deletions = document.createElement("span");
+        deletions.classList.add("file-stat", "file-deletions");
+        deletions.innerText = `-${file.deletions}`;
+        dom.append(additions, deletions);
+    }
+    if (file.status != "D") {
+        // Files are served with the type of their content, plain text or binary, so the browser never runs them.
+        const view = document.createElement("a");
+        view.classList.add("file-stat", "clickable-text");
+        view.innerText = "view";
+        view.target = "_blank";
+        const path = file.path.split("/").map(encodeURIComponent).join("/");
+        view.href = `${server}/api/blob/${commitId}/${path}?repo=${encodeURIComponent(g_repo)}`;
+        view.addEventListener("click", e => e.stopPropagation());
+        dom.appendChild(view);
+
+        const blame = document.createElement("span");
+        blame.classList.add("file-stat", "clickable-text");
+        blame.innerText = "blame";
+        blame.addEventListener("click", e => {
+            e.stopPropagation();
+            g_app.blame_file(commitId, file.path);
+        });
+        dom.appendChild(blame);
+    }
+    return dom;
+}
+
+var g_sortFilesByChanges = false;
+
+function create_file_list(fileListDom, commentsDom, files, fileDiffDoms, commitId) {
+    const sortDom = document.createElement("div");
+    sortDom.classList.add("file", "clickable-text");
+    sortDom.innerText = g_sortFilesByChanges ? "Sort by path" : "Sort by changes";
+    sortDom.addEventListener("click", () => {
+        g_sortFilesByChanges = !g_sortFilesByChanges;
+        create_file_list(fileListDom, commentsDom, files, fileDiffDoms, commitId);
+    });
+
+    const sortedFiles = [...files];
+    if (g_sortFilesByChanges) {
+        const changes = file => (file.additions || 0) + (file.deletions || 0);
+        sortedFiles.sort((a, b) => changes(b) - changes(a));
+    }
+    const fileDoms = sortedFiles.map(file => create_file_node(file, fileDiffDoms.get(file.path), commitId));
+    fileListDom.replaceChildren(commentsDom, ...(files.length > 1 ? [sortDom] : []), ...fileDoms);
 }
 
 function onSelectFile(fileDom) {
@@ -259,7 +485,9 @@ function onSelectFile(fileDom) {
     }
     fileDom.classList.add("selected");
     onSelectFile.lastSelectedFileDom = fileDom;
-    fileDom.detailDom.scrollIntoView();
+    if (fileDom.detailDom) {
+        fileDom.detailDom.scrollIntoView();
+    }
 }
 
 function clean_commit_detail() {
@@ -289,6 +517,8 @@ class App {
 
     select_commit(commitId) {
         // clean last selection.
+        this.#close_compare();
+        this.#set_compare_row(null);
         if (this.#last_selected_row) {
             this.#last_selected_row.classList.remove("selected");
             this.#selectIndex = 0;
@@ -308,6 +538,184 @@ class App {
         this.#update_selection_status();
     }
 
+    reload_commit() {
+        if (this.#compare) {
+            this.compare_commits(this.#compare.fromId, this.#compare.toId);
+        } else if (this.#selected_commit_id) {
+            this.#load_commit_async(this.#selected_commit_id);
+        }
+    }
+
+    // Show the change from fromId to toId. The changed files come first, then the patches of the files one by one,
+    // as the server diffs them.
+    compare_commits(fromId, toId) {
+        this.#close_compare();
+        if (this.#commit_abort_controller) {
+            this.#commit_abort_controller.abort();
+        }
+        show_detail_loading_wrapper(false);
+        clean_commit_detail();
+        this.#selected_commit_id = null;
+        this.#compare = { fromId, toId };
+
+        const detailPanelDom = document.getElementById("commit-detail");
+        const fileListDom = document.getElementById("commit-file-list");
+        document.getElementById("commit-id-field").innerText = `${fromId}..${toId}`;
+
+        const commentsDetailDom = document.createElement("div");
+        commentsDetailDom.classList.add("comments");
+        const statusDom = document.createElement("pre");
+        statusDom.innerText = `Compare ${fromId}\n     to ${toId}\n\nLoading...`;
+        commentsDetailDom.appendChild(statusDom);
+        detailPanelDom.replaceChildren(commentsDetailDom);
+
+        const commentsDom = document.createElement("div");
+        commentsDom.classList.add("file");
+        commentsDom.addEventListener("click", () => onSelectFile(commentsDom));
+        commentsDom.innerText = "Compare";
+        commentsDom.detailDom = commentsDetailDom;
+        fileListDom.replaceChildren(commentsDom);
+
+        const url = `${server}/api/compare?repo=${encodeURI(g_repo)}&path=${encodeURI(g_path)}&from=${fromId}`
+            + `&to=${toId}${this.#get_diff_options()}`;
+        const fileDiffDoms = new Map();
+        const evtSource = this.#compare_event_source = new EventSource(url);
+        evtSource.onmessage = (e) => {
+            const data = JSON.parse(e.data);
+            if (data.files) {
+                // Patches come in the order of the files, each fills the place of its file.
+                data.files.forEach(file => {
+                    const fileDiffDom = document.createElement("div");
+                    fileDiffDom.classList.add("file-diff");
+                    fileDiffDoms.set(file.path, fileDiffDom);
+                });
+                detailPanelDom.replaceChildren(commentsDetailDom, ...fileDiffDoms.values());
+                create_file_list(fileListDom, commentsDom, data.files, fileDiffDoms, toId);
+            }
+            if (data.patch && fileDiffDoms.has(data.patch.filename)) {
+                append_patch_content(fileDiffDoms.get(data.patch.filename), data.patch, url);
+            }
+            if (data.done) {
+                evtSource.close();
+                statusDom.innerText = `Compare ${fromId}\n     to ${toId}\n\n`
+                    + (data.notFound ? "Commit not found." : (data.error ? `Compare failed: ${data.error}` : ""));
+            }
+        };
+        evtSource.onerror = () => evtSource.close();
+    }
+
+    #close_compare() {
+        if (this.#compare_event_source) {
+            this.#compare_event_source.close();
+            this.#compare_event_source = null;
+        }
+        this.#compare = null;
+    }
+
+    #set_compare_row(row) {
+        if (this.#compare_row) {
+            this.#compare_row.classList.remove("selected");
+        }
+        if (row) {
+            row.classList.add("selected");
+        }
+        this.#compare_row = row;
+    }
+
+    // Shift-click on a row compares it with the selected commit, from the older one to the newer one.
+    #compare_with_selection(commitId, row) {
+        if (!this.#last_selected_row || this.#last_selected_row == row) {
+            this.select_commit(commitId);
+            return;
+        }
+        const selectedId = this.#last_selected_row.getAttribute("commitid");
+        const indexOf = id => this.#commits.findIndex(c => c.id == id);
+        const isOlder = indexOf(commitId) > indexOf(selectedId);
+        this.compare_commits(isOlder ? commitId : selectedId, isOlder ? selectedId : commitId);
+        this.#set_compare_row(row);
+    }
+
+    // Replace moreDom, the end of a truncated file diff, with the next part of it. fileUrl is the url of the commit or
+    // the compare the diff is from.
+    async load_more_diff_async(fileUrl, patch, moreDom) {
+        const fileDiffDom = moreDom.parentElement;
+        moreDom.innerText = "Loading...";
+        try {
+            const url = `${fileUrl}&file=${encodeURIComponent(patch.filename)}&continuation=${patch.continuation}`;
+            const response = await fetch(url);
+            if (!response.ok) {
+                throw new Error(await response.text());
+            }
+            const next = await response.json();
+            moreDom.remove();
+            append_patch_content(fileDiffDom, next, fileUrl);
+        } catch (ex) {
+            console.error(ex);
+            moreDom.innerText = `Loading failed: ${ex.message}`;
+        }
+    }
+
+    // Show the blame of path at a commit after the commit detail, lines are attributed as the ranges arrive. The
+    // commit of the last blame is sent as near, so walking the history of a file reuses its cached blame.
+    blame_file(commitId, path) {
+        if (this.#blame_event_source) {
+            this.#blame_event_source.close();
+        }
+        document.querySelectorAll("#commit-detail .blame").forEach(e => e.remove());
+
+        const blameDom = document.createElement("div");
+        blameDom.classList.add("file-diff", "blame");
+        const headerDom = document.createElement("pre");
+        headerDom.classList.add("chunk-header");
+        headerDom.innerText = `blame ${path} at ${commitId.substring(0, 8)}`;
+        const statusDom = document.createElement("pre");
+        statusDom.classList.add("chunk-statistics");
+        statusDom.innerText = "Loading...";
+        blameDom.append(headerDom, statusDom);
+        document.getElementById("commit-detail").appendChild(blameDom);
+        blameDom.scrollIntoView();
+
+        var url = `${server}/api/blame?repo=${encodeURI(g_repo)}&path=${encodeURIComponent(path)}&commit=${commitId}`;
+        if (this.#last_blame && this.#last_blame.path == path && this.#last_blame.commitId != commitId) {
+            url += `&near=${this.#last_blame.commitId}`;
+        }
+
+        const blame = { lines: [], attribution: [], commits: [], blocks: [] };
+        const evtSource = this.#blame_event_source = new EventSource(url);
+        evtSource.onmessage = (e) => {
+            if (!blameDom.isConnected) {
+                evtSource.close();
+                return;
+            }
+            const data = JSON.parse(e.data);
+            if (data.content != undefined) {
+                blame.lines = data.content.split("\n");
+                if (data.content.endsWith("\n")) {
+                    blame.lines.pop();
+                }
+                create_blame_blocks(blameDom, blame);
+            }
+            if (data.commits) {
+                blame.commits.push(...data.commits);
+                add_blame_ranges(blame, data.ranges);
+            }
+            if (data.done) {
+                evtSource.close();
+                if (data.notFound) {
+                    statusDom.innerText = "File not found.";
+                } else if (data.binary) {
+                    statusDom.innerText = "Binary file.";
+                } else if (data.error) {
+                    statusDom.innerText = `Blame failed: ${data.error}`;
+                } else {
+                    statusDom.remove();
+                    this.#last_blame = { commitId, path };
+                }
+            }
+        };
+        evtSource.onerror = () => evtSource.close();
+    }
+
     show_author_commits_clicked(newWindow) {
         const menu = document.getElementById('author-context-menu');
         const search = `repo=${g_repo}&path=${g_path}&author=${menu.author}`;
@@ -321,8 +729,95 @@ class App {
         }
     }
 
+    async search_commits_async(query) {
+        const statusDom = document.getElementById("search-status");
+        const mode = document.getElementById("search-mode").value;
+        if (query == this.#search_query && mode == this.#search_mode && this.#search_matches.length) {
+            // Same query, jump to the next match.
+            this.#select_next_search_match();
+            return;
+        }
+
+        if (this.#search_event_source) {
+            this.#search_event_source.close();
+            this.#search_event_source = null;
+        }
+        this.#search_query = query;
+        this.#search_mode = mode;
+        this.#search_matches = [];
+        document.querySelectorAll(".search-match").forEach(e => e.classList.remove("search-match"));
+        statusDom.innerText = "";
+        if (!query) {
+            return;
+        }
+
+        if (mode != "message") {
+            this.#search_content(query, mode == "regex", statusDom);
+            return;
+        }
+
+        try {
+            const url = `${server}/api/search?repo=${encodeURI(g_repo)}&q=${encodeURIComponent(query)}`;
+            const response = await fetch(url);
+            const result = await response.json();
+            this.#add_search_matches(result.ids);
+            statusDom.innerText = `${result.ids.length}${result.truncated || result.indexing ? "+" : ""} matches`
+                + (result.indexing ? " (still indexing, search again for the rest)" : "");
+            if (result.indexing) {
+                // Searching the same query again should query the server rather than jump to the next match.
+                this.#search_query = null;
+            }
+            this.#select_next_search_match();
+        } catch (ex) {
+            console.error(ex);
+        }
+    }
+
+    #search_content(query, regex, statusDom) {
+        var url = `${server}/api/pickaxe?repo=${encodeURI(g_repo)}&path=${encodeURI(g_path)}`;
+        url += `&q=${encodeURIComponent(query)}`;
+        if (regex) {
+            url += "&regex=1";
+        }
+        if (g_commitId) {
+            url += `&commit=${g_commitId}`;
+        }
+
+        const evtSource = this.#search_event_source = new EventSource(url);
+        evtSource.onmessage = (e) => {
+            const data = JSON.parse(e.data);
+            const hadMatches = this.#search_matches.length > 0;
+            this.#add_search_matches(data.matches);
+            statusDom.innerText = `${this.#search_matches.length} matches`
+                + (data.done ? "" : ` (${data.scanned} commits scanned)`);
+            if (!hadMatches && this.#search_matches.length) {
+                this.#select_next_search_match();
+            }
+            if (data.done) {
+                evtSource.close();
+            }
+        };
+        evtSource.onerror = () => evtSource.close();
+    }
+
+    #add_search_matches(ids) {
+        this.#search_matches.push(...ids);
+        ids.forEach(id => {
+            const row = document.getElementById(`commit-${id}`);
+            if (row) {
+                row.classList.add("search-match");
+            }
+        });
+    }
+
     async load_commits_async() {
+        const streamServer = await g_streamServer;
+
         // clear old data.
+        if (this.#history_event_source) {
+            this.#history_event_source.close();
+            this.#history_event_source = null;
+        }
         this.#commits = [];
         this.select_commit(null);
         const commitsListDom = document.getElementById("gitk-history-content");
@@ -332,7 +827,7 @@ class App {
         show_commits_loading_wrapper(true);
 
         try {
-            var url = `${server}/api/git-log?repo=${encodeURI(g_repo)}&path=${encodeURI(g_path)}`;
+            var url = `${streamServer}/api/git-log?repo=${encodeURI(g_repo)}&path=${encodeURI(g_path)}&live=1`;
             if (g_noMergesCheckbox.checked) {
                 url += "&noMerges=1";
             }
@@ -343,85 +838,57 @@ class App {
             commitsListDom.replaceChildren();
             commitsListDom.classList.add("in-progress");
 
-            const evtSource = new EventSource(url);
+            const evtSource = this.#history_event_source = new EventSource(url);
             const progressStatus = document.getElementById("progress-column");
             progressStatus.classList.remove("hidden");
 
-            const closeEventSource = () => {
-                evtSource.close();
+            const stopProgress = () => {
                 progressStatus.classList.add("hidden");
                 commitsListDom.classList.remove("in-progress");
             };
 
             evtSource.onmessage = (e) => {
                 const data = JSON.parse(e.data);
-                const commits = data.commits;
-                if (commits.length == 0) {
-                    closeEventSource();
+                if (data.reload) {
+                    // History is rewritten (e.g. HEAD is moved to another branch), load it again.
+                    this.load_commits_async();
                     return;
                 }
 
-                this.#commits.push(...commits);
-                for (var i = 0; i < data.graphs.length; ++i) {
-                    this.#commits[i] = { ...this.#commits[i], ...data.graphs[i] };
-                }
-                for (var i = 0; i < commits.length; ++i) {
-                    const commit = commits[i];
-                    const row = document.createElement("div");
-                    row.setAttribute("id", `commit-${commit.id}`);
-                    row.setAttribute("style", `height: ${kLineHight}px`);
-                    row.setAttribute("commitid", commit.id);
-                    row.addEventListener("click", () => this.select_commit(commit.id));
-                    row.commit = commit;
-                    row.classList.add("row");
-
-                    const graphAndMessage = document.createElement("div");
-                    graphAndMessage.classList.add("graph-and-message");
-                    const graph = document.createElement("div");
-                    graph.setAttribute("id", `commit-${commit.id}-graph`);
-                    graphAndMessage.appendChild(graph);
-                    graphAndMessage.appendChild(crate_message(commit));
-                    row.appendChild(graphAndMessage);
-
-                    const author = document.createElement("div");
-                    author.classList.add("author");
-                    author.classList.add("oneline");
-                    var txt = document.createTextNode(`${commit.author.name} <${commit.author.email}>`);
-                    author.appendChild(txt);
-                    author.addEventListener("contextmenu", (e) => {
-                        if (this.#last_selected_row == row) {
-                            const emailOrName = row.commit.author.email || row.commit.author.name;
-                            if (emailOrName) {
-                                e.preventDefault();
-                                const menu = document.getElementById('author-context-menu');
-                                menu.author = emailOrName;
-                                menu.style.left = e.pageX + 'px';
-                                menu.style.top = e.pageY + 'px';
-                                menu.classList.remove('hidden');
-                            }
-                        }
+                if (data.prepend) {
+                    // Live update, new commits are pushed after the history is loaded.
+                    this.#commits.unshift(...data.prepend);
+                    this.#merge_graphs(data.graphs);
+                    data.prepend.reverse().forEach(commit => commitsListDom.prepend(this.#create_commit_row(commit)));
+                    this.#commits.forEach(commit => {
+                        const row = document.getElementById(`commit-${commit.id}`);
+                        row.commit = commit;
+                        row.querySelector(".message").replaceWith(crate_message(commit));
                     });
-                    row.appendChild(author);
-
-                    const date = document.createElement("div");
-                    date.classList.add("date");
-                    txt = document.createTextNode(commit["date"]);
-                    date.appendChild(txt);
-                    row.appendChild(date);
-                    commitsListDom.appendChild(row);
+                    this.#render_graphs();
+                    if (this.#selectIndex) {
+                        this.#selectIndex += data.prepend.length;
+                    }
+                    this.#update_selection_status();
+                    return;
                 }
 
-                // Create graph data.
-                for (var i = 0; i < this.#commits.length; ++i) {
-                    var commit = this.#commits[i];
-                    var graphDiv = document.getElementById(`commit-${commit.id}-graph`);
-                    graphDiv.replaceChildren(crate_graph(commit, this.#commits));
+                const commits = data.commits;
+                if (commits.length == 0) {
+                    // History is loaded, the stream is kept open for live updates.
+                    stopProgress();
+                    return;
                 }
 
+                this.#commits.push(...commits);
+                this.#merge_graphs(data.graphs);
+                commits.forEach(commit => commitsListDom.appendChild(this.#create_commit_row(commit)));
+                this.#render_graphs();
                 this.#update_selection_status();
             }
             evtSource.onerror = (e) => {
-                closeEventSource();
+                evtSource.close();
+                stopProgress();
             }
         } catch (ex) {
             console.error(ex);
@@ -430,30 +897,143 @@ class App {
         show_commits_loading_wrapper(false);
     }
 
+    #merge_graphs(graphs) {
+        for (var i = 0; i < graphs.length; ++i) {
+            this.#commits[i] = { ...this.#commits[i], ...graphs[i] };
+        }
+    }
+
+    #render_graphs() {
+        Object.keys(columnEndedTrack).forEach(key => delete columnEndedTrack[key]);
+        for (var i = 0; i < this.#commits.length; ++i) {
+            var commit = this.#commits[i];
+            var graphDiv = document.getElementById(`commit-${commit.id}-graph`);
+            graphDiv.replaceChildren(crate_graph(commit, this.#commits));
+        }
+    }
+
+    #create_commit_row(commit) {
+        const row = document.createElement("div");
+        row.setAttribute("id", `commit-${commit.id}`);
+        row.setAttribute("style", `height: ${kLineHight}px`);
+        row.setAttribute("commitid", commit.id);
+        row.addEventListener("click", e => {
+            if (e.shiftKey) {
+                this.#compare_with_selection(commit.id, row);
+            } else {
+                this.select_commit(commit.id);
+            }
+        });
+        row.commit = commit;
+        row.classList.add("row");
+        if (this.#search_matches.indexOf(commit.id) >= 0) {
+            row.classList.add("search-match");
+        }
+
+        const graphAndMessage = document.createElement("div");
+        graphAndMessage.classList.add("graph-and-message");
+        const graph = document.createElement("div");
+        graph.setAttribute("id", `commit-${commit.id}-graph`);
+        graphAndMessage.appendChild(graph);
+        graphAndMessage.appendChild(crate_message(commit));
+        row.appendChild(graphAndMessage);
+
+        const author = document.createElement("div");
+        author.classList.add("author");
+        author.classList.add("oneline");
+        var txt = document.createTextNode(`${commit.author.name} <${commit.author.email}>`);
+        author.appendChild(txt);
+        author.addEventListener("contextmenu", (e) => {
+            if (this.#last_selected_row == row) {
+                const emailOrName = row.commit.author.email || row.commit.author.name;
+                if (emailOrName) {
+                    e.preventDefault();
+                    const menu = document.getElementById('author-context-menu');
+                    menu.author = emailOrName;
+                    menu.style.left = e.pageX + 'px';
+                    menu.style.top = e.pageY + 'px';
+                    menu.classList.remove('hidden');
+                }
+            }
+        });
+        row.appendChild(author);
+
+        const date = document.createElement("div");
+        date.classList.add("date");
+        txt = document.createTextNode(commit["date"]);
+        date.appendChild(txt);
+        row.appendChild(date);
+        return row;
+    }
+
+    #get_diff_options() {
+        var options = "";
+        if (g_ignoreWhitespaceCheckbox.checked) {
+            options += "&ignoreWhitespace=1";
+        }
+        if (g_splitModeCheckbox.checked) {
+            options += "&mode=split";
+        }
+        return options;
+    }
+
+    #get_commit_url(commitId) {
+        const url = `${server}/api/git-commit/${commitId}?repo=${encodeURI(g_repo)}&path=${encodeURI(g_path)}`;
+        return url + this.#get_diff_options();
+    }
+
     async #load_commit_async(commitId) {
         // clear old data.
         clean_commit_detail();
+        this.#selected_commit_id = commitId;
 
         const detailPanelDom = document.getElementById("commit-detail");
         const fileListDom = document.getElementById("commit-file-list");
         const commitIdFieldDom = document.getElementById("commit-id-field");
 
+        // Abort the request of the previous selection, so the server stops running "git show" for it.
+        if (this.#commit_abort_controller) {
+            this.#commit_abort_controller.abort();
+        }
+        const abortController = this.#commit_abort_controller = new AbortController();
+
         show_detail_loading_wrapper(true);
         try {
-            var url = `${server}/api/git-commit/${commitId}?repo=${encodeURI(g_repo)}&path=${encodeURI(g_path)}`;
-            if (g_ignoreWhitespaceCheckbox.checked) {
-                url += "&ignoreWhitespace=1";
-            }
-            const response = await fetch(url);
-            const commit = await response.json();
-            create_commit_detail(commit, detailPanelDom, fileListDom);
-            commitIdFieldDom.innerText = commit.id;
+            const url = this.#get_commit_url(commitId);
+            const fetchCommit = async url => {
+                const response = await fetch(url, { signal: abortController.signal });
+                if (!response.ok) {
+                    throw new Error(await response.text());
+                }
+                return await response.json();
+            };
+
+            // Changed files are counted without generating the patch, show them while the patch is loading.
+            const stat = await fetchCommit(`${url}&stat=1`);
+            create_commit_detail(stat, detailPanelDom, fileListDom, url);
+            commitIdFieldDom.innerText = stat.id;
+
+            const commit = await fetchCommit(url);
+            create_commit_detail(commit, detailPanelDom, fileListDom, url);
         } catch (ex) {
+            if (ex.name == "AbortError") {
+                return;
+            }
             console.error(ex);
         }
         show_detail_loading_wrapper(false);
     }
 
+    #select_next_search_match() {
+        // Matches are in history order, pick the first one loaded after the current selection.
+        const loaded = this.#search_matches.filter(id => document.getElementById(`commit-${id}`));
+        if (!loaded.length) {
+            return;
+        }
+        const next = loaded.find(id => this.#commits.findIndex(c => c.id == id) + 1 > this.#selectIndex);
+        this.select_commit(next || loaded[0]);
+    }
+
     #update_selection_status() {
         document.getElementById("selection-column").innerText = `${this.#selectIndex} / ${this.#commits.length}`;
     }
@@ -461,4 +1041,16 @@ class App {
     #commits = [];
     #selectIndex = 0;
     #last_selected_row;
+    #search_query = "";
+    #search_mode = "";
+    #search_matches = [];
+    #search_event_source = null;
+    #history_event_source = null;
+    #commit_abort_controller = null;
+    #selected_commit_id = null;
+    #blame_event_source = null;
+    #last_blame = null;
+    #compare = null;
+    #compare_row = null;
+    #compare_event_source = null;
 }
\ No newline at end of file